@@ -0,0 +1,147 @@
+#ifndef ACCOUNT_STORE_H
+#define ACCOUNT_STORE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+struct UserAccount {
+    std::string username;
+    int balance;
+    uint64_t version; // bumped on every change a viewer may show, guarded by the account's transfer stripe
+};
+
+// a handle is the index of an account in the store. accounts are never removed, so handles stay valid forever
+typedef uint32_t AccountHandle;
+const AccountHandle NO_ACCOUNT = UINT32_MAX;
+
+#define ACCOUNT_CHUNK_BITS 12    // 4096 accounts per chunk
+#define ACCOUNT_MAX_CHUNKS 16384 // 64M accounts at most
+
+// registered accounts with O(1) lookup by username.
+// accounts live in fixed size chunks that never move, and the username index is an open addressing
+// table (linear probing) of handles. find and insert need the caller's lock, but get may be called
+// without it for a handle obtained earlier, so transfers can run while others register.
+// accounts loaded from a snapshot are indexed on the first find or insert, not while they are loaded
+class AccountStore {
+public:
+    AccountStore() : chunks(ACCOUNT_MAX_CHUNKS), slots(16) {}
+
+    AccountHandle find(const std::string &username) const {
+        if (!unindexed.empty())
+            buildIndex();
+        uint32_t hash = hashName(username);
+        for (size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+            const Slot &slot = slots[i];
+            if (slot.handle == NO_ACCOUNT)
+                return NO_ACCOUNT;
+            if (slot.hash == hash && get(slot.handle).username == username)
+                return slot.handle;
+        }
+    }
+
+    // add a new account, returns NO_ACCOUNT if the username is already taken
+    AccountHandle insert(const std::string &username, int balance) {
+        if (find(username) != NO_ACCOUNT)
+            return NO_ACCOUNT;
+        AccountHandle handle = count;
+        if ((handle >> ACCOUNT_CHUNK_BITS) >= ACCOUNT_MAX_CHUNKS)
+            return NO_ACCOUNT;
+        if ((handle + 1) * 2 > slots.size())
+            grow();
+        std::unique_ptr<UserAccount[]> &chunk = chunks[handle >> ACCOUNT_CHUNK_BITS];
+        if (!chunk)
+            chunk.reset(new UserAccount[1 << ACCOUNT_CHUNK_BITS]);
+        chunk[handle & ((1 << ACCOUNT_CHUNK_BITS) - 1)] = UserAccount{username, balance, 0};
+        place(hashName(username), handle);
+        count.store(handle + 1, std::memory_order_release);
+        return handle;
+    }
+
+    // add an account from a snapshot without indexing it. the snapshot's usernames are unique, so unlike
+    // insert this does not look the name up. hash is hashName(username)
+    AccountHandle load(std::string &&username, int balance, uint32_t hash) {
+        AccountHandle handle = count;
+        if ((handle >> ACCOUNT_CHUNK_BITS) >= ACCOUNT_MAX_CHUNKS)
+            return NO_ACCOUNT;
+        std::unique_ptr<UserAccount[]> &chunk = chunks[handle >> ACCOUNT_CHUNK_BITS];
+        if (!chunk)
+            chunk.reset(new UserAccount[1 << ACCOUNT_CHUNK_BITS]);
+        UserAccount &account = chunk[handle & ((1 << ACCOUNT_CHUNK_BITS) - 1)];
+        account.username = std::move(username);
+        account.balance = balance;
+        account.version = 0;
+        unindexed.push_back(hash);
+        count.store(handle + 1, std::memory_order_release);
+        return handle;
+    }
+
+    UserAccount &get(AccountHandle handle) {
+        return chunks[handle >> ACCOUNT_CHUNK_BITS][handle & ((1 << ACCOUNT_CHUNK_BITS) - 1)];
+    }
+
+    const UserAccount &get(AccountHandle handle) const {
+        return chunks[handle >> ACCOUNT_CHUNK_BITS][handle & ((1 << ACCOUNT_CHUNK_BITS) - 1)];
+    }
+
+    size_t size() const {
+        return count.load(std::memory_order_acquire);
+    }
+
+    static uint32_t hashName(const std::string &username) {
+        return static_cast<uint32_t>(std::hash<std::string>()(username));
+    }
+
+private:
+    struct Slot {
+        uint32_t hash = 0; // cached so probing rarely compares strings
+        AccountHandle handle = NO_ACCOUNT;
+    };
+
+    std::vector<std::unique_ptr<UserAccount[]>> chunks; // allocated up front, so it is never reallocated
+    std::atomic<AccountHandle> count{0};
+    // size is always a power of two, kept at most half full. mutable for the first find after a snapshot load
+    mutable std::vector<Slot> slots;
+    mutable std::vector<uint32_t> unindexed; // hashes of the last accounts, loaded but not in slots yet
+
+    void place(uint32_t hash, AccountHandle handle) const {
+        size_t i = hash & (slots.size() - 1);
+        while (slots[i].handle != NO_ACCOUNT)
+            i = (i + 1) & (slots.size() - 1);
+        slots[i].hash = hash;
+        slots[i].handle = handle;
+    }
+
+    // index the loaded accounts, sizing the table once for all of them
+    void buildIndex() const {
+        size_t size = slots.size();
+        while (size < (size_t)count * 2)
+            size *= 2;
+        if (size != slots.size()) {
+            std::vector<Slot> old(size);
+            old.swap(slots);
+            for (const Slot &slot : old) {
+                if (slot.handle != NO_ACCOUNT)
+                    place(slot.hash, slot.handle);
+            }
+        }
+        AccountHandle first = count - unindexed.size();
+        for (size_t i = 0; i < unindexed.size(); i++)
+            place(unindexed[i], first + i);
+        std::vector<uint32_t>().swap(unindexed);
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const Slot &slot : old) {
+            if (slot.handle != NO_ACCOUNT)
+                place(slot.hash, slot.handle);
+        }
+    }
+};
+
+#endif // ACCOUNT_STORE_H
@@ -0,0 +1,269 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+// standard base64 with padding and without line breaks. the decoder skips whitespace, so it also reads the
+// 64 column lines OpenSSL's BIO writes. on x86 blocks of 16 or 32 characters go through SSSE3 or AVX2,
+// whichever the CPU has, the ends and anything with whitespace in it go through the tables
+
+enum Base64Level {
+    BASE64_SCALAR,
+    BASE64_SSSE3,
+    BASE64_AVX2,
+};
+
+const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define BASE64_SKIP 64    // whitespace
+#define BASE64_PAD 65     // '='
+#define BASE64_INVALID 255
+
+struct Base64DecodeTable {
+    unsigned char values[256];
+
+    Base64DecodeTable() {
+        for (int i = 0; i < 256; i++)
+            values[i] = BASE64_INVALID;
+        for (int i = 0; i < 64; i++)
+            values[(unsigned char)base64Alphabet[i]] = i;
+        values['\r'] = values['\n'] = values[' '] = values['\t'] = BASE64_SKIP;
+        values['='] = BASE64_PAD;
+    }
+};
+const Base64DecodeTable base64DecodeTable;
+
+// the best the CPU can do
+Base64Level base64Detect() {
+#ifdef BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return BASE64_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return BASE64_SSSE3;
+#endif
+    return BASE64_SCALAR;
+}
+
+// what the codec uses, lower it to compare implementations. never set it above base64Detect()
+Base64Level base64Level = base64Detect();
+
+size_t base64EncodedSize(size_t size) {
+    return (size + 2) / 3 * 4;
+}
+
+#ifdef BASE64_X86
+// 12 bytes in the low three quarters of every 16 byte lane to 16 six bit values, one per byte
+__attribute__((target("ssse3"))) inline __m128i base64Split(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i ac = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i bd = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(ac, bd);
+}
+
+// six bit values to their characters: find the alphabet range of each value, then add that range's offset
+__attribute__((target("ssse3"))) inline __m128i base64Chars(__m128i values) {
+    __m128i range = _mm_subs_epu8(values, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values), _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), values);
+}
+
+// encodes while 16 bytes can be read, returns the bytes encoded
+__attribute__((target("ssse3"))) size_t base64EncodeSsse3(const unsigned char *in, size_t size, char *out) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 12, out += 16)
+        _mm_storeu_si128((__m128i *)out, base64Chars(base64Split(_mm_loadu_si128((const __m128i *)(in + i)))));
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t base64EncodeAvx2(const unsigned char *in, size_t size, char *out) {
+    const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i + 28 <= size; i += 24, out += 32) {
+        // 12 bytes in each lane
+        __m256i in256 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))),
+                                                _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+        in256 = _mm256_shuffle_epi8(in256, shuffle);
+        __m256i ac = _mm256_mulhi_epu16(_mm256_and_si256(in256, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i bd = _mm256_mullo_epi16(_mm256_and_si256(in256, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i values = _mm256_or_si256(ac, bd);
+        __m256i range = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values), _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), values));
+    }
+    // the compiler does not clear the upper halves for a target attribute function, and SSE code after
+    // AVX code that left them dirty is several times slower on some CPUs
+    _mm256_zeroupper();
+    return i + base64EncodeSsse3(in + i, size - i, out);
+}
+
+// decodes 16 characters to 12 bytes in the low three quarters of the result. false if any of them is not in
+// the alphabet, whitespace and padding included, the caller takes the slow path then
+__attribute__((target("ssse3"))) inline bool base64DecodeBlock(__m128i in, __m128i &out) {
+    const __m128i lowNibbleClasses = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i highNibbleClasses = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i highNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i lowNibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    // a character is valid if its two nibble classes have no bit in common
+    __m128i common = _mm_and_si128(_mm_shuffle_epi8(lowNibbleClasses, lowNibbles), _mm_shuffle_epi8(highNibbleClasses, highNibbles));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(common, _mm_setzero_si128())) != 0xffff)
+        return false;
+    // '/' shares its high nibble with '+' but needs another offset
+    __m128i values = _mm_add_epi8(in, _mm_shuffle_epi8(offsets, _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), highNibbles)));
+    // pack four six bit values into three bytes, then drop the gaps
+    __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+// decodes blocks until fewer than 16 characters are left or a block has anything but the alphabet in it.
+// writes 16 bytes per 12 decoded, out may be in, it never gets ahead of the input. returns the characters decoded
+__attribute__((target("ssse3"))) size_t base64DecodeSsse3(const char *in, size_t size, unsigned char *out) {
+    size_t i = 0;
+    __m128i block;
+    for (; i + 16 <= size; i += 16, out += 12) {
+        if (!base64DecodeBlock(_mm_loadu_si128((const __m128i *)(in + i)), block))
+            break;
+        _mm_storeu_si128((__m128i *)out, block);
+    }
+    return i;
+}
+
+// same as base64DecodeSsse3 with 32 characters at a time, writes 32 bytes per 24 decoded
+__attribute__((target("avx2"))) size_t base64DecodeAvx2(const char *in, size_t size, unsigned char *out) {
+    const __m256i lowNibbleClasses = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                                      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i highNibbleClasses = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                       0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i offsets = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32, out += 24) {
+        __m256i in256 = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi32(in256, 4), _mm256_set1_epi8(0x0f));
+        __m256i lowNibbles = _mm256_and_si256(in256, _mm256_set1_epi8(0x0f));
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lowNibbleClasses, lowNibbles), _mm256_shuffle_epi8(highNibbleClasses, highNibbles)))
+            break;
+        __m256i values = _mm256_add_epi8(in256, _mm256_shuffle_epi8(offsets, _mm256_add_epi8(_mm256_cmpeq_epi8(in256, _mm256_set1_epi8('/')), highNibbles)));
+        __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+        // 12 bytes at the start of each lane, move them next to each other
+        merged = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, merged);
+    }
+    _mm256_zeroupper(); // see base64EncodeAvx2
+    return i + base64DecodeSsse3(in + i, size - i, out);
+}
+#endif
+
+// encode into output, which keeps its capacity between calls
+void base64Encode(const unsigned char *data, size_t size, std::string &output) {
+    output.resize(base64EncodedSize(size));
+    char *out = &output[0];
+    size_t i = 0;
+#ifdef BASE64_X86
+    if (base64Level == BASE64_AVX2)
+        i = base64EncodeAvx2(data, size, out);
+    else if (base64Level == BASE64_SSSE3)
+        i = base64EncodeSsse3(data, size, out);
+    out += i / 3 * 4;
+#endif
+    for (; i + 3 <= size; i += 3, out += 4) {
+        uint32_t triple = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+        out[0] = base64Alphabet[triple >> 18];
+        out[1] = base64Alphabet[(triple >> 12) & 0x3f];
+        out[2] = base64Alphabet[(triple >> 6) & 0x3f];
+        out[3] = base64Alphabet[triple & 0x3f];
+    }
+    if (i < size) {
+        uint32_t triple = (uint32_t)data[i] << 16 | (i + 1 < size ? (uint32_t)data[i + 1] << 8 : 0);
+        out[0] = base64Alphabet[triple >> 18];
+        out[1] = base64Alphabet[(triple >> 12) & 0x3f];
+        out[2] = i + 1 < size ? base64Alphabet[(triple >> 6) & 0x3f] : '=';
+        out[3] = '=';
+    }
+}
+
+// decode size characters into out, which has room for size / 4 * 3 + 32 bytes or is in itself.
+// returns the bytes written, or -1 if the input is not base64
+long base64DecodeTo(const char *in, size_t size, unsigned char *out) {
+    size_t i = 0, written = 0;
+    uint32_t bits = 0;
+    int pending = 0; // six bit values in bits, a block only goes through SIMD when there are none
+    while (i < size) {
+#ifdef BASE64_X86
+        if (pending == 0 && base64Level != BASE64_SCALAR) {
+            size_t decoded = base64Level == BASE64_AVX2 ? base64DecodeAvx2(in + i, size - i, out + written)
+                                                        : base64DecodeSsse3(in + i, size - i, out + written);
+            i += decoded;
+            written += decoded / 4 * 3;
+            if (i == size)
+                break;
+        }
+#endif
+        unsigned char value = base64DecodeTable.values[(unsigned char)in[i++]];
+        if (value < 64) {
+            bits = bits << 6 | value;
+            if (++pending == 4) {
+                out[written++] = bits >> 16;
+                out[written++] = bits >> 8;
+                out[written++] = bits;
+                bits = 0;
+                pending = 0;
+            }
+        } else if (value == BASE64_PAD) {
+            // the end, only more padding and whitespace may follow
+            for (; i < size; i++) {
+                if (in[i] != '=' && base64DecodeTable.values[(unsigned char)in[i]] != BASE64_SKIP)
+                    return -1;
+            }
+            break;
+        } else if (value != BASE64_SKIP) {
+            return -1;
+        }
+    }
+    // a last group of two or three characters holds one or two bytes, with or without padding
+    if (pending == 1)
+        return -1;
+    if (pending == 2) {
+        out[written++] = bits >> 4;
+    } else if (pending == 3) {
+        out[written++] = bits >> 10;
+        out[written++] = bits >> 2;
+    }
+    return written;
+}
+
+// decode into output, which keeps its capacity between calls. false if the input is not base64
+bool base64Decode(const std::string &input, std::vector<unsigned char> &output) {
+    output.resize(input.size() / 4 * 3 + 32); // SIMD stores run past the decoded bytes
+    long written = base64DecodeTo(input.data(), input.size(), output.data());
+    output.resize(written > 0 ? written : 0);
+    return written >= 0;
+}
+
+// decode a string over itself
+bool base64DecodeInPlace(std::string &data) {
+    long written = base64DecodeTo(data.data(), data.size(), reinterpret_cast<unsigned char *>(&data[0]));
+    data.resize(written > 0 ? written : 0);
+    return written >= 0;
+}
+
+#endif // BASE64_H
@@ -0,0 +1,641 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <sys/resource.h>
+#include <csignal>
+#include "mySocket.h"
+#include "ledger.h"
+#include "transferEngine.h"
+#include "snapshot.h"
+
+// benchmarks for the server and its building blocks
+// args: <mode> <mode args>
+// modes:
+// connections <host> <port> <serverPid> <count>...: open idle client connections in steps, and at each step
+//     measure the HELLO round trip latency and the server's RSS and thread count
+// ledger <dir> <threads> <window us>...: append transfer records from many threads for a few seconds per
+//     group commit window, and report throughput, records per fdatasync and commit latency. first checks that a
+//     username with a line break cannot add records of its own, and that after a failed write the file is cut back
+//     to the last commit and every later record is refused
+// transfers <threads> <accounts> <transfers per thread> <stripes>...: random concurrent transfers through the
+//     TransferEngine while another thread keeps registering accounts, for each lock stripe count (1 is a global lock).
+//     checks that no balance went negative and the total money supply only grew by the new accounts' balances
+// rsa <seconds>: RSA operations per second on one 202 byte chunk, with a new EVP_PKEY_CTX per operation as
+//     encryptMessage/decryptMessage used to do, and with the thread's cached contexts and reused buffers
+// keys <seconds>: RSA-2048 against X25519 identities: key generation, public key size, and the cost of encrypting
+//     and decrypting a 202 byte chunk and a 2 KB reply, RSA chunk by chunk and X25519 sealed whole
+// base64 <seconds>: checks the base64 codec against OpenSSL at every level the CPU supports, then compares
+//     encode and decode throughput with OpenSSL's BIO chain for a session key, an RSA chunk and a session message
+// startup <dir> <accounts>...: for each account count, write a ledger with one registration and one transfer per
+//     account, then compare restoring the accounts by replaying all of it with loading a snapshot and replaying
+//     a tail of 10000 transfers written after it. checks that both end with the same balances
+
+using benchClock = std::chrono::steady_clock;
+
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+    return samples[index];
+}
+
+// reads a "Key:   value kB" line from /proc/<pid>/status
+long readProcStatus(const std::string &pid, const std::string &key) {
+    std::ifstream status("/proc/" + pid + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, key.size() + 1, key + ":") == 0)
+            return std::stol(line.substr(key.size() + 1));
+    }
+    return -1;
+}
+
+// one HELLO round trip, returns the latency in milliseconds or -1 on failure
+double helloRoundTrip(MySocket &sock) {
+    auto start = benchClock::now();
+    if (!sock.send("HELLO"))
+        return -1;
+    std::string response = sock.recv(5);
+    if (response.find("-----END PUBLIC KEY-----") == std::string::npos)
+        return -1;
+    return std::chrono::duration<double, std::milli>(benchClock::now() - start).count();
+}
+
+int benchConnections(int argc, char *argv[]) {
+    if (argc < 6) {
+        std::cerr << "args: connections <host> <port> <serverPid> <count>..." << std::endl;
+        return 1;
+    }
+    std::string host = argv[2], port = argv[3], pid = argv[4];
+
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    std::vector<MySocket *> connections;
+    std::mt19937 gen(42);
+
+    std::cout << std::left << std::setw(14) << "connections" << std::setw(12) << "RSS (kB)" << std::setw(10) << "threads"
+              << std::setw(10) << "p50 (ms)" << std::setw(10) << "p99 (ms)" << "failed" << std::endl;
+    for (int i = 5; i < argc; i++) {
+        size_t target = std::stoul(argv[i]);
+        while (connections.size() < target) {
+            MySocket *sock = new MySocket("bench" + std::to_string(connections.size()));
+            if (!sock->connect(host, port)) {
+                std::cerr << "Failed to open connection " << connections.size() << ": " << sock->error_t << std::endl;
+                delete sock;
+                break;
+            }
+            connections.push_back(sock);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        // each sample is two back to back requests on one connection, like a client sending PKEY right after List
+        std::vector<double> latencies;
+        int failed = 0;
+        std::uniform_int_distribution<size_t> pick(0, connections.size() - 1);
+        for (int sample = 0; sample < 200; sample++) {
+            MySocket &sock = *connections[pick(gen)];
+            for (int request = 0; request < 2; request++) {
+                double latency = helloRoundTrip(sock);
+                if (latency < 0)
+                    failed++;
+                else
+                    latencies.push_back(latency);
+            }
+        }
+
+        std::cout << std::left << std::setw(14) << connections.size() << std::setw(12) << readProcStatus(pid, "VmRSS")
+                  << std::setw(10) << readProcStatus(pid, "Threads") << std::fixed << std::setprecision(2)
+                  << std::setw(10) << percentile(latencies, 0.50) << std::setw(10) << percentile(latencies, 0.99) << failed << std::endl;
+    }
+
+    for (MySocket *sock : connections)
+        delete sock;
+    return 0;
+}
+
+// what a replay of the ledger at path gives
+std::vector<std::vector<std::string>> replayLedger(const std::string &path) {
+    std::vector<std::vector<std::string>> records;
+    Ledger::readRecords(path, 0, 0, [&records](const std::vector<std::string> &record) { records.push_back(record); });
+    return records;
+}
+
+// the ledger's defences against forged and half written records, false with the reason on stderr if one fails
+bool checkLedger(const std::string &path) {
+    std::remove(path.c_str());
+    Ledger ledger;
+    if (!ledger.open(path) || !ledger.replay([](const std::vector<std::string> &) {})) {
+        std::cerr << ledger.error_t << std::endl;
+        return false;
+    }
+    const std::vector<std::string> alice = {"REGISTER", "alice", "10000"};
+    if (!ledger.waitDurable(ledger.append("REGISTER#alice#10000"))) {
+        std::cerr << "a valid record was not committed" << std::endl;
+        return false;
+    }
+
+    // a REGISTER for this name would replay as a registration of "x" and a transfer from alice
+    std::string forged = "x\nTRANSFER#alice#9999#x";
+    bool refusedCallback = false;
+    uint64_t seq = ledger.append("REGISTER#" + forged + "#10000", [&refusedCallback](bool durable) { refusedCallback = !durable; });
+    if (Ledger::validField(forged) || Ledger::validField("a#b") || !Ledger::validField("alice") || seq != 0 || ledger.waitDurable(seq) || !refusedCallback) {
+        std::cerr << "a record with a line break was not refused" << std::endl;
+        return false;
+    }
+    if (replayLedger(path) != std::vector<std::vector<std::string>>{alice}) {
+        std::cerr << "replay after a forged username does not give back only the valid record" << std::endl;
+        return false;
+    }
+
+    // a file size limit just past the committed records makes the next batch a partial write that then fails
+    uint64_t committed = ledger.durableOffset();
+    struct rlimit oldLimit, limit;
+    getrlimit(RLIMIT_FSIZE, &oldLimit);
+    limit = oldLimit;
+    limit.rlim_cur = committed + 10;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    std::atomic<int> failedCallbacks{0};
+    seq = ledger.append("TRANSFER#alice#1#bob", [&failedCallbacks](bool durable) { failedCallbacks += !durable; });
+    bool failed = !ledger.waitDurable(seq);
+    setrlimit(RLIMIT_FSIZE, &oldLimit);
+    signal(SIGXFSZ, SIG_DFL);
+    uint64_t later = ledger.append("TRANSFER#alice#2#bob", [&failedCallbacks](bool durable) { failedCallbacks += !durable; });
+    uint64_t fileSize = ledger.fileSize();
+    ledger.close();
+    if (!failed || !ledger.hasFailed() || later != 0 || failedCallbacks != 2) {
+        std::cerr << "the ledger went on taking records after a failed write" << std::endl;
+        return false;
+    }
+    if (ledger.durableOffset() != committed || fileSize != committed || replayLedger(path) != std::vector<std::vector<std::string>>{alice}) {
+        std::cerr << "the ledger file does not end at the last commit after a failed write" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int benchLedger(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cerr << "args: ledger <dir> <threads> <window us>..." << std::endl;
+        return 1;
+    }
+    std::string path = std::string(argv[2]) + "/bench_ledger.log";
+    int threadCount = std::stoi(argv[3]);
+
+    bool ok = checkLedger(path);
+    std::cout << "checked forged records and failed writes: " << (ok ? "OK" : "FAILED") << std::endl;
+    if (!ok)
+        return 1;
+
+    std::cout << std::left << std::setw(12) << "window (us)" << std::setw(16) << "transfers/s" << std::setw(16) << "records/commit"
+              << std::setw(10) << "p50 (ms)" << std::setw(10) << "p99 (ms)" << "p999 (ms)" << std::endl;
+    for (int i = 4; i < argc; i++) {
+        std::remove(path.c_str());
+        Ledger ledger;
+        ledger.batchWindowUs = std::stoi(argv[i]);
+        if (!ledger.open(path) || !ledger.replay([](const std::vector<std::string> &) {})) {
+            std::cerr << ledger.error_t << std::endl;
+            return 1;
+        }
+
+        std::vector<std::vector<double>> latencies(threadCount);
+        std::vector<std::thread> threads;
+        auto deadline = benchClock::now() + std::chrono::seconds(3);
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back([&ledger, &latencies, deadline, t]() {
+                std::string record = "TRANSFER#payer" + std::to_string(t) + "#1#payee";
+                while (benchClock::now() < deadline) {
+                    auto start = benchClock::now();
+                    ledger.waitDurable(ledger.append(record));
+                    latencies[t].push_back(std::chrono::duration<double, std::milli>(benchClock::now() - start).count());
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        ledger.close();
+
+        std::vector<double> all;
+        for (auto &threadLatencies : latencies)
+            all.insert(all.end(), threadLatencies.begin(), threadLatencies.end());
+        std::cout << std::left << std::setw(12) << argv[i] << std::fixed << std::setprecision(0) << std::setw(16) << all.size() / 3.0
+                  << std::setprecision(1) << std::setw(16) << (double)ledger.recordCount / std::max<uint64_t>(ledger.commitCount, 1)
+                  << std::setprecision(2) << std::setw(10) << percentile(all, 0.50) << std::setw(10) << percentile(all, 0.99)
+                  << percentile(all, 0.999) << std::endl;
+    }
+    std::remove(path.c_str());
+    return 0;
+}
+
+int benchTransfers(int argc, char *argv[]) {
+    if (argc < 6) {
+        std::cerr << "args: transfers <threads> <accounts> <transfers per thread> <stripes>..." << std::endl;
+        return 1;
+    }
+    int threadCount = std::stoi(argv[2]);
+    int accountCount = std::stoi(argv[3]);
+    long transfersPerThread = std::stol(argv[4]);
+    const int initialBalance = 1000;
+
+    bool consistent = true;
+    std::cout << std::left << std::setw(10) << "stripes" << std::setw(16) << "transfers/s" << std::setw(12) << "rejected"
+              << std::setw(14) << "registered" << "money supply" << std::endl;
+    for (int i = 5; i < argc; i++) {
+        AccountStore accounts;
+        TransferEngine engine(accounts, std::stoul(argv[i]));
+        std::mutex registerMutex; // stands in for the server's stateMutex around find/insert
+        for (int a = 0; a < accountCount; a++)
+            accounts.insert("user" + std::to_string(a), initialBalance);
+
+        std::atomic<bool> transfersDone{false};
+        std::thread registrar([&]() {
+            for (int a = accountCount; !transfersDone; a++) {
+                std::lock_guard<std::mutex> lock(registerMutex);
+                accounts.insert("user" + std::to_string(a), initialBalance);
+            }
+        });
+
+        std::atomic<uint64_t> rejected{0};
+        std::vector<std::thread> threads;
+        auto start = benchClock::now();
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back([&, t]() {
+                std::mt19937 gen(t);
+                std::uniform_int_distribution<int> pickAmount(1, initialBalance / 2);
+                uint64_t threadRejected = 0;
+                for (long n = 0; n < transfersPerThread; n++) {
+                    // new accounts can be paid as soon as they are registered
+                    std::uniform_int_distribution<AccountHandle> pickAccount(0, accounts.size() - 1);
+                    if (engine.transfer(pickAccount(gen), pickAccount(gen), pickAmount(gen)) != TRANSFER_OK)
+                        threadRejected++;
+                }
+                rejected += threadRejected;
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        double seconds = std::chrono::duration<double>(benchClock::now() - start).count();
+        transfersDone = true;
+        registrar.join();
+
+        long long supply = 0;
+        bool negative = false;
+        for (AccountHandle a = 0; a < accounts.size(); a++) {
+            supply += accounts.get(a).balance;
+            negative |= accounts.get(a).balance < 0;
+        }
+        bool ok = !negative && supply == (long long)accounts.size() * initialBalance;
+        consistent &= ok;
+        std::cout << std::left << std::setw(10) << argv[i] << std::fixed << std::setprecision(0) << std::setw(16)
+                  << threadCount * transfersPerThread / seconds << std::setw(12) << rejected << std::setw(14) << accounts.size() - accountCount
+                  << supply << (ok ? " OK" : negative ? " NEGATIVE BALANCE" : " MISMATCH") << std::endl;
+    }
+    return consistent ? 0 : 1;
+}
+
+// runs op for about the given time and returns the number of times per second it ran
+double opsPerSecond(double seconds, const std::function<bool()> &op) {
+    long count = 0;
+    auto start = benchClock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < 16; i++) {
+            if (!op())
+                return -1;
+        }
+        count += 16;
+        elapsed = std::chrono::duration<double>(benchClock::now() - start).count();
+    }
+    return count / elapsed;
+}
+
+int benchRsa(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "args: rsa <seconds>" << std::endl;
+        return 1;
+    }
+    double seconds = std::stod(argv[2]);
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    if (!key) {
+        std::cerr << "Failed to generate a key: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return 1;
+    }
+    std::string chunk(202, 'x');
+    std::string ciphertext = encryptMessage(key, chunk);
+    std::string output;
+
+    double encryptNew = opsPerSecond(seconds, [&]() {
+        EVP_PKEY_CTX *ctx = newRsaContext(key, false);
+        bool ok = ctx && encryptWithContext(ctx, chunk, output);
+        EVP_PKEY_CTX_free(ctx);
+        return ok;
+    });
+    double encryptCached = opsPerSecond(seconds, [&]() { return encryptMessage(key, chunk, output); });
+    double decryptNew = opsPerSecond(seconds, [&]() {
+        EVP_PKEY_CTX *ctx = newRsaContext(key, true);
+        bool ok = ctx && decryptWithContext(ctx, ciphertext, output);
+        EVP_PKEY_CTX_free(ctx);
+        return ok && output == chunk;
+    });
+    double decryptCached = opsPerSecond(seconds, [&]() { return decryptMessage(key, ciphertext, output) && output == chunk; });
+    EVP_PKEY_free(key);
+
+    std::cout << std::left << std::setw(10) << "op" << std::setw(16) << "new ctx ops/s" << std::setw(18) << "cached ctx ops/s" << "speedup" << std::endl;
+    std::cout << std::fixed << std::setprecision(0) << std::setw(10) << "encrypt" << std::setw(16) << encryptNew << std::setw(18) << encryptCached
+              << std::setprecision(2) << encryptCached / encryptNew << "x" << std::endl;
+    std::cout << std::fixed << std::setprecision(0) << std::setw(10) << "decrypt" << std::setw(16) << decryptNew << std::setw(18) << decryptCached
+              << std::setprecision(2) << decryptCached / decryptNew << "x" << std::endl;
+    return encryptNew > 0 && encryptCached > 0 && decryptNew > 0 && decryptCached > 0 ? 0 : 1;
+}
+
+// encrypt message for key the way sendEncrypted does, RSA chunks or one sealed line, then decrypt it again
+bool publicKeyRoundTrip(EVP_PKEY *key, const std::string &message, bool decrypt, std::vector<std::string> &lines) {
+    std::string output;
+    if (!decrypt) {
+        lines.clear();
+        for (size_t i = 0; i < message.size(); i += isSealingKey(key) ? message.size() : 202) {
+            std::string part = message.substr(i, isSealingKey(key) ? std::string::npos : 202);
+            if (!(isSealingKey(key) ? sealMessage(key, part, output) : encryptMessage(key, part, output)))
+                return false;
+            lines.push_back(output);
+        }
+        return true;
+    }
+    std::string decrypted;
+    for (const auto &line : lines) {
+        if (!(isSealingKey(key) ? openSealed(key, line, output) : decryptMessage(key, line, output)))
+            return false;
+        decrypted += output;
+    }
+    return decrypted == message;
+}
+
+int benchKeys(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "args: keys <seconds>" << std::endl;
+        return 1;
+    }
+    double seconds = std::stod(argv[2]);
+    EVP_PKEY *keys[] = {EVP_RSA_gen(2048), generateX25519Key()};
+    const char *names[] = {"RSA-2048", "X25519"};
+    if (!keys[0] || !keys[1]) {
+        std::cerr << "Failed to generate a key: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return 1;
+    }
+    double keygen[] = {
+        opsPerSecond(seconds, []() {
+            EVP_PKEY *key = EVP_RSA_gen(2048);
+            EVP_PKEY_free(key);
+            return key != nullptr;
+        }),
+        opsPerSecond(seconds, []() {
+            EVP_PKEY *key = generateX25519Key();
+            EVP_PKEY_free(key);
+            return key != nullptr;
+        }),
+    };
+
+    std::cout << std::left << std::setw(10) << "key" << std::setw(12) << "keygen (ms)" << std::setw(14) << "PEM (bytes)" << std::setw(10) << "message"
+              << std::setw(14) << "encrypt (us)" << "decrypt (us)" << std::endl;
+    bool ok = true;
+    for (int k = 0; k < 2; k++) {
+        for (size_t size : {202, 2048}) {
+            std::string message(size, 'x');
+            std::vector<std::string> lines;
+            double encrypts = opsPerSecond(seconds, [&]() { return publicKeyRoundTrip(keys[k], message, false, lines); });
+            double decrypts = opsPerSecond(seconds, [&]() { return publicKeyRoundTrip(keys[k], message, true, lines); });
+            ok = ok && keygen[k] > 0 && encrypts > 0 && decrypts > 0;
+            std::cout << std::fixed << std::setw(10) << names[k] << std::setprecision(3) << std::setw(12) << 1e3 / keygen[k] << std::setw(14)
+                      << keyToString(keys[k], false).size() << std::setw(10) << size << std::setprecision(1) << std::setw(14) << 1e6 / encrypts
+                      << 1e6 / decrypts << std::endl;
+        }
+    }
+    EVP_PKEY_free(keys[0]);
+    EVP_PKEY_free(keys[1]);
+    return ok ? 0 : 1;
+}
+
+// base64 the way encryption.h did before it had its own codec, 64 column lines
+std::string bioBase64Encode(const std::vector<unsigned char> &input) {
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO *bio = BIO_push(b64, BIO_new(BIO_s_mem()));
+    BIO_write(bio, input.data(), input.size());
+    BIO_flush(bio);
+    BUF_MEM *bufferPtr;
+    BIO_get_mem_ptr(bio, &bufferPtr);
+    std::string encoded(bufferPtr->data, bufferPtr->length);
+    BIO_free_all(bio);
+    return encoded;
+}
+
+std::vector<unsigned char> bioBase64Decode(const std::string &input) {
+    std::vector<unsigned char> decoded(input.size());
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO *bio = BIO_push(b64, BIO_new_mem_buf(input.data(), input.size()));
+    int size = BIO_read(bio, decoded.data(), input.size());
+    decoded.resize(size > 0 ? size : 0);
+    BIO_free_all(bio);
+    return decoded;
+}
+
+int benchBase64(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "args: base64 <seconds>" << std::endl;
+        return 1;
+    }
+    double seconds = std::stod(argv[2]);
+    const char *levelNames[] = {"scalar", "ssse3", "avx2"};
+    Base64Level best = base64Detect();
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    // every length up to a few SIMD blocks past an RSA chunk, OpenSSL's EVP_EncodeBlock writes the same unwrapped text
+    bool ok = true;
+    for (int level = BASE64_SCALAR; level <= best; level++) {
+        base64Level = (Base64Level)level;
+        for (size_t size = 0; size <= 600 && ok; size++) {
+            std::vector<unsigned char> data(size);
+            for (auto &b : data)
+                b = byte(gen);
+            std::string expected(base64EncodedSize(size) + 1, '\0');
+            expected.resize(EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&expected[0]), data.data(), size));
+            std::string encoded = base64Encode(data);
+            std::vector<unsigned char> decoded, wrappedDecoded;
+            std::string inPlace = encoded;
+            ok = encoded == expected && base64Decode(encoded, decoded) && decoded == data &&
+                 base64Decode(bioBase64Encode(data), wrappedDecoded) && wrappedDecoded == data &&
+                 base64DecodeInPlace(inPlace) && inPlace == std::string(data.begin(), data.end());
+            if (!ok)
+                std::cerr << levelNames[level] << " differs from OpenSSL at " << size << " bytes" << std::endl;
+        }
+        std::vector<unsigned char> decoded;
+        for (const char *bad : {"QUJD*", "QUJDRA=x", "Q", "QUJDR===="}) {
+            if (base64Decode(bad, decoded)) {
+                std::cerr << levelNames[level] << " accepted \"" << bad << "\"" << std::endl;
+                ok = false;
+            }
+        }
+    }
+    std::cout << "checked against OpenSSL up to " << levelNames[best] << ": " << (ok ? "OK" : "MISMATCH") << std::endl;
+
+    std::cout << std::left << std::setw(10) << "bytes" << std::setw(10) << "codec" << std::setw(18) << "encode MB/s" << "decode MB/s" << std::endl;
+    for (size_t size : {32, 256, 4096}) {
+        std::vector<unsigned char> data(size);
+        for (auto &b : data)
+            b = byte(gen);
+        std::string wrapped = bioBase64Encode(data), encoded = base64Encode(data);
+        std::vector<unsigned char> decoded;
+        double encodeRate = opsPerSecond(seconds, [&]() { return !bioBase64Encode(data).empty(); });
+        double decodeRate = opsPerSecond(seconds, [&]() { return bioBase64Decode(wrapped).size() == size; });
+        std::cout << std::left << std::fixed << std::setprecision(1) << std::setw(10) << size << std::setw(10) << "openssl"
+                  << std::setw(18) << encodeRate * size / 1e6 << decodeRate * size / 1e6 << std::endl;
+        for (int level = BASE64_SCALAR; level <= best; level++) {
+            base64Level = (Base64Level)level;
+            encodeRate = opsPerSecond(seconds, [&]() {
+                base64Encode(data.data(), data.size(), wrapped);
+                return true;
+            });
+            decodeRate = opsPerSecond(seconds, [&]() { return base64Decode(encoded, decoded); });
+            std::cout << std::left << std::setw(10) << size << std::setw(10) << levelNames[level]
+                      << std::setw(18) << encodeRate * size / 1e6 << decodeRate * size / 1e6 << std::endl;
+        }
+        wrapped.clear();
+    }
+    base64Level = best;
+    return ok ? 0 : 1;
+}
+
+// appends transfers between random accounts of the first count to the ledger file
+void writeBenchTransfers(std::ofstream &file, std::mt19937 &gen, size_t count, size_t transfers) {
+    std::uniform_int_distribution<size_t> pickAccount(0, count - 1);
+    for (size_t i = 0; i < transfers; i++)
+        file << "TRANSFER#user" << pickAccount(gen) << "#" << 1 + i % 50 << "#user" << pickAccount(gen) << "\n";
+}
+
+int benchStartup(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << "args: startup <dir> <accounts>..." << std::endl;
+        return 1;
+    }
+    std::string ledgerPath = std::string(argv[2]) + "/bench_startup.log";
+    std::string snapshotPath = std::string(argv[2]) + "/bench_startup.snap";
+    const size_t tailTransfers = 10000;
+    bool consistent = true;
+    auto seconds = [](benchClock::time_point start) { return std::chrono::duration<double>(benchClock::now() - start).count(); };
+
+    std::cout << std::left << std::setw(12) << "accounts" << std::setw(14) << "ledger MB" << std::setw(14) << "replay (s)"
+              << std::setw(16) << "snapshot MB" << std::setw(16) << "write snap (s)" << std::setw(14) << "load (s)"
+              << std::setw(14) << "index (s)" << std::setw(12) << "tail (s)" << "speedup" << std::endl;
+    for (int i = 3; i < argc; i++) {
+        size_t count = std::stoul(argv[i]);
+        std::mt19937 gen(i);
+        {
+            std::ofstream file(ledgerPath, std::ios::trunc);
+            for (size_t a = 0; a < count; a++)
+                file << "REGISTER#user" << a << "#10000\n";
+            writeBenchTransfers(file, gen, count, count);
+        }
+
+        // the old startup, all of the ledger
+        uint64_t snapshotOffset;
+        double replaySeconds, writeSeconds;
+        {
+            AccountStore replayed;
+            auto start = benchClock::now();
+            snapshotOffset = Ledger::readRecords(ledgerPath, 0, 0, [&replayed](const std::vector<std::string> &record) {
+                applyLedgerRecord(replayed, record);
+            });
+            replaySeconds = seconds(start);
+
+            Snapshot snapshot;
+            start = benchClock::now();
+            if (!snapshot.write(snapshotPath, replayed, ledgerPath, snapshotOffset)) {
+                std::cerr << snapshot.error_t << std::endl;
+                return 1;
+            }
+            writeSeconds = seconds(start);
+        }
+        {
+            std::ofstream file(ledgerPath, std::ios::app);
+            writeBenchTransfers(file, gen, count, tailTransfers);
+        }
+
+        // startup with the snapshot: map it, index on the first lookup, which the tail replay makes
+        AccountStore restored;
+        Snapshot snapshot;
+        uint64_t from = 0;
+        auto start = benchClock::now();
+        if (!snapshot.load(snapshotPath, restored, ledgerPath, from)) {
+            std::cerr << snapshot.error_t << std::endl;
+            return 1;
+        }
+        double loadSeconds = seconds(start);
+        start = benchClock::now();
+        restored.find("user0");
+        double indexSeconds = seconds(start);
+        start = benchClock::now();
+        Ledger::readRecords(ledgerPath, from, 0, [&restored](const std::vector<std::string> &record) {
+            applyLedgerRecord(restored, record);
+        });
+        double tailSeconds = seconds(start);
+
+        // the same balances as replaying everything
+        AccountStore replayed;
+        Ledger::readRecords(ledgerPath, 0, 0, [&replayed](const std::vector<std::string> &record) {
+            applyLedgerRecord(replayed, record);
+        });
+        bool ok = replayed.size() == restored.size();
+        for (AccountHandle a = 0; ok && a < replayed.size(); a++)
+            ok = replayed.get(a).username == restored.get(a).username && replayed.get(a).balance == restored.get(a).balance;
+        consistent &= ok;
+
+        struct stat ledgerStat, snapshotStat;
+        stat(ledgerPath.c_str(), &ledgerStat);
+        stat(snapshotPath.c_str(), &snapshotStat);
+        std::cout << std::left << std::fixed << std::setw(12) << count << std::setprecision(1) << std::setw(14) << ledgerStat.st_size / 1e6
+                  << std::setprecision(3) << std::setw(14) << replaySeconds << std::setprecision(1) << std::setw(16) << snapshotStat.st_size / 1e6
+                  << std::setprecision(3) << std::setw(16) << writeSeconds << std::setw(14) << loadSeconds << std::setw(14) << indexSeconds
+                  << std::setw(12) << tailSeconds << std::setprecision(1) << replaySeconds / (loadSeconds + indexSeconds + tailSeconds) << "x"
+                  << (ok ? "" : " MISMATCH") << std::endl;
+    }
+    std::remove(ledgerPath.c_str());
+    std::remove(snapshotPath.c_str());
+    return consistent ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "args: <mode> <mode args>\nAvailable modes: connections, ledger, transfers, rsa, keys, base64, startup" << std::endl;
+        return 1;
+    }
+    std::string mode = argv[1];
+    if (mode == "connections")
+        return benchConnections(argc, argv);
+    if (mode == "ledger")
+        return benchLedger(argc, argv);
+    if (mode == "transfers")
+        return benchTransfers(argc, argv);
+    if (mode == "rsa")
+        return benchRsa(argc, argv);
+    if (mode == "keys")
+        return benchKeys(argc, argv);
+    if (mode == "base64")
+        return benchBase64(argc, argv);
+    if (mode == "startup")
+        return benchStartup(argc, argv);
+    std::cerr << "Unknown mode: " << mode << std::endl;
+    return 1;
+}
@@ -22,11 +22,11 @@ int main(int argc, char *argv[]) {
 
         loginForm->signal_hide().connect([&app, mainWindow]() {
             std::cerr << "login window hidden" << std::endl;
-            if (clientAction.loggedIn) { // login action
-                app->hold();             // hold for the main window
+            if (clientWorker().view.loggedIn) { // login action
+                app->hold();                        // hold for the main window
                 mainWindow->show_all();
             } else {
-                clientAction.quitApp();
+                clientWorker().post([]() { clientAction.quitApp(); });
                 // app->release();
             }
             app->release();
@@ -34,10 +34,11 @@ int main(int argc, char *argv[]) {
 
         // Release the application when the main window is closed
         mainWindow->signal_hide().connect([&app, loginForm]() {
-            if (clientAction.loggedIn) {
-                clientAction.quitApp();
+            // quitApp waits for the p2p threads, the worker runs it after whatever it is doing
+            if (clientWorker().view.loggedIn) {
+                clientWorker().post([]() { clientAction.quitApp(); });
             } else {
-                clientAction.quitApp();
+                clientWorker().post([]() { clientAction.quitApp(); });
                 app->hold();
                 loginForm->show_all();
             }
@@ -46,4 +47,4 @@ int main(int argc, char *argv[]) {
     });
 
     return app->run();
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -5,13 +5,52 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <future>
 #include "mySocket.h"
 #include "encryption.h"
+#include "keyCache.h"
+#include "localKeystore.h"
+#include "reactor.h"
+#include "p2pPool.h"
 
 struct UserAccount {
     std::string username;
     std::string ipAddr;
     std::string p2pPort;
+    std::string keyFingerprint; // empty if the server did not send one
+};
+
+// a user's public key as the server gave it to us
+struct PeerKey {
+    std::string fingerprint;
+    std::string pem;
+    SharedKey key;
+};
+
+// a reply from the server and how many pushes had arrived before it, they are applied before the reply is used
+struct ServerReply {
+    std::string message;
+    uint64_t pushesBefore;
+};
+
+// a resumption ticket from the server and the session it resumes
+struct SessionTicket {
+    std::string ticket;                    // sealed by the server, we only hand it back
+    std::vector<unsigned char> sessionKey; // of the connection the ticket was issued on
+    std::string server;                    // <host>:<port> it is valid for
+    std::string username;
+    std::string p2pPort;
+    std::chrono::steady_clock::time_point expiry;
+    std::chrono::steady_clock::time_point renewAt; // half way to expiry
 };
 
 class ClientAction {
@@ -30,28 +69,84 @@ public:
     std::string p2pPort;
     int accountBalance;
     std::vector<UserAccount> userAccounts;
+    std::unordered_map<std::string, size_t> userIndex; // position of every user in userAccounts
+    // users added, changed or removed since the last takeUserChanges, so a view can redraw just those
+    std::unordered_set<std::string> changedUsers;
     bool transferOk = false;
     std::function<void()> statusUpdatedCallback;
     std::function<void()> sessionEndedCallback;
 
     bool waitingForRecv = false;
 
+    // multiplexing: a server that echoes request IDs gets every request as @<id> <request>, and readerThread
+    // routes each reply to the caller waiting for that ID. pushes are queued for pollPresence and transfer
+    // confirmations go to the oldest payment waiting for one, so requests and payments can overlap.
+    // older servers get one request at a time, read on the caller's thread as before
+    bool multiplexed = false;
+    std::thread readerThread;
+    std::atomic<bool> reading{false};
+    std::mutex routeMutex;
+    uint64_t nextRequestId = 1;
+    std::map<uint64_t, std::shared_ptr<std::promise<ServerReply>>> pendingReplies;
+    std::deque<std::shared_ptr<std::promise<ServerReply>>> pendingConfirmations;
+    std::deque<std::pair<uint64_t, std::string>> pendingPushes; // numbered in the order they arrived
+    uint64_t pushesRouted = 0;
+    // payments sent with sendMicropaymentTransaction, waiting for verifyMicropaymentTransaction, oldest first
+    std::deque<std::shared_future<ServerReply>> unverifiedPayments;
+
+    // presence subscription: the server pushes joins, leaves and balance changes instead of us polling List
+    bool subscribed = false;
+    uint64_t presenceVersion = 0;
+
+    // session resumption: once logged in we hold a ticket from the server. when the connection is lost,
+    // connectToServer presents it and a logIn as the same user then skips HELLO, the RSA session setup and
+    // LOGIN, and only catches up on presence. the ticket is dropped when we log out
+    SessionTicket sessionTicket;
+    bool resumed = false; // this connection was logged in again from the ticket
+
     EVP_PKEY *serverPublicKey = nullptr;
-    EVP_PKEY *clientPrivateKey = nullptr;
+    uint64_t serverKeyGeneration = 0; // bumped every time serverPublicKey is replaced, the pointer alone may be reused
+    EVP_PKEY *clientPrivateKey = nullptr; // shared through localKeystore, not ours to free
+    // other users' public keys by username. an entry is used without asking the server for as long as
+    // the online list shows the same fingerprint for that user, a new key means a new fingerprint
+    std::map<std::string, PeerKey> peerKeys;
+    uint64_t pkeyLookups = 0; // PKEY round trips, the ones the cache could not save
 
     // p2p
     MySocket p2pListenSocket;
 
     std::thread listeningThread;
-    std::atomic<bool> p2pListening;
-
-    ClientAction() : clientSocket("client", true), p2pListenSocket("p2pListen", false) {
-        checkKeyFiles();
-        clientPrivateKey = stringToKey(loadKeyFromFile(PRIVATE_KEY_FILE), true);
+    std::atomic<bool> p2pListening{false};
+    // payers keep their connections open, the reactor reads every payment they send on them
+    Reactor *p2pReactor = nullptr;
+    // our own connections to payees, reused for repeated payments
+    P2PPool p2pPool;
+
+    // payments we received, waiting to be forwarded to the server. the forward thread sends them as one BATCH
+    // when the window in clientConfig runs out or the batch is full
+    std::mutex forwardMutex;
+    std::condition_variable forwardReady;
+    std::vector<std::string> pendingForwards;
+    std::deque<std::vector<std::string>> sentBatches; // batches the server has not answered yet, oldest first
+    std::thread forwardThread;
+    bool forwarding = false;
+    // servers that push presence also take BATCH, older ones get each payment on its own
+    std::atomic<bool> serverBatches{false};
+
+    ClientAction(bool enableLogging = true) : clientSocket("client", enableLogging), p2pListenSocket("p2pListen", false) {
+        // a new identity is X25519, an RSA one that is already there keeps working. this only starts loading it,
+        // the first connectToServer waits for it
+        localKeystore().prepare();
     }
 
     bool connectToServer(const std::string &hostname, const std::string &serverPort) {
         std::cerr << "Connecting to server" << std::endl;
+        stopReader(); // still running for a previous connection
+        clientPrivateKey = localKeystore().privateKey();
+        if (!clientPrivateKey) {
+            error_t = localKeystore().error_t;
+            return false;
+        }
         // add timeout
         clientSocket.connect(hostname, serverPort, 5);
         if (!clientSocket.isConnected)
@@ -61,25 +156,272 @@ public:
             port = serverPort;
         }
 
-        clientSocket.send("HELLO");
+        resumed = clientSocket.isConnected && resumeSession(hostname + ":" + serverPort);
+        if (resumed) {
+            multiplexed = true; // every server that resumes sessions also multiplexes
+            reading = true;
+            readerThread = std::thread(&ClientAction::readReplies, this);
+            return true;
+        }
+
+        // a multiplexing server answers a tagged HELLO with the same tag, older ones reject it and get a plain one.
+        // we ask for the server's X25519 key, servers that only have RSA refuse and are asked again with HELLO
+        clientSocket.send("@0 HELLO#X25519");
         std::string response = clientSocket.recv(5);
+        multiplexed = response.compare(0, 3, "@0 ") == 0;
+        if (multiplexed && response.find("-----BEGIN PUBLIC KEY-----") != 3) {
+            clientSocket.send("@0 HELLO");
+            response = clientSocket.recv(5);
+        }
+        if (multiplexed) {
+            response.erase(0, 3);
+        } else {
+            clientSocket.send("HELLO");
+            response = clientSocket.recv(5);
+        }
 
         std::cerr << "Public key received, reading" << std::endl;
 
+        if (serverPublicKey)
+            EVP_PKEY_free(serverPublicKey); // key from a previous connection
         serverPublicKey = stringToKey(response, false);
+        serverKeyGeneration++;
         std::cerr << "Server public key: " << response.substr(27, 37) << "..." << std::endl;
 
+        if (serverPublicKey && !startSession())
+            std::cerr << "Server does not support sessions, falling back to per-message public key encryption" << std::endl;
+
+        if (multiplexed && clientSocket.isConnected) {
+            reading = true;
+            readerThread = std::thread(&ClientAction::readReplies, this);
+        }
         return clientSocket.isConnected;
     }
 
+    // send a request to the server, the future gets its reply, or an empty string if the connection is lost.
+    // when multiplexed any number of requests can be in flight, otherwise the reply is read before this returns
+    std::shared_future<ServerReply> requestAsync(const std::string &message, bool encrypt = true) {
+        std::shared_ptr<std::promise<ServerReply>> reply = std::make_shared<std::promise<ServerReply>>();
+        std::shared_future<ServerReply> future = reply->get_future().share();
+        if (!multiplexed) {
+            if (encrypt)
+                clientSocket.sendEncrypted(serverPublicKey, message);
+            else
+                clientSocket.send(message);
+            reply->set_value(ServerReply{recvReply(), 0});
+            return future;
+        }
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(routeMutex);
+            if (!reading) {
+                reply->set_value(ServerReply{"", pushesRouted}); // the reader has stopped, the connection is gone
+                return future;
+            }
+            id = nextRequestId++;
+            pendingReplies[id] = reply;
+        }
+        std::string tagged = "@" + std::to_string(id) + " " + message;
+        if (!(encrypt ? clientSocket.sendEncrypted(serverPublicKey, tagged) : clientSocket.send(tagged))) {
+            std::lock_guard<std::mutex> lock(routeMutex);
+            if (pendingReplies.erase(id))
+                reply->set_value(ServerReply{"", pushesRouted});
+        }
+        return future;
+    }
+
+    // send a request and wait for its reply, an empty string with error_t set if it does not come in time
+    std::string request(const std::string &message, int timeout_sec = 5) {
+        return awaitReply(requestAsync(message), timeout_sec);
+    }
+
+    // wait for a reply, and apply the pushes that came before it so they are seen in the order the server sent them
+    std::string awaitReply(const std::shared_future<ServerReply> &reply, int timeout_sec = 5) {
+        if (reply.wait_for(std::chrono::seconds(timeout_sec)) != std::future_status::ready) {
+            error_t = "Timeout occurred";
+            return "";
+        }
+        applyPushes(reply.get().pushesBefore);
+        return reply.get().message;
+    }
+
+    // apply the pushes readerThread has queued, up to push number upTo
+    void applyPushes(uint64_t upTo = UINT64_MAX) {
+        std::deque<std::pair<uint64_t, std::string>> pushes;
+        {
+            std::lock_guard<std::mutex> lock(routeMutex);
+            while (!pendingPushes.empty() && pendingPushes.front().first <= upTo) {
+                pushes.push_back(pendingPushes.front());
+                pendingPushes.pop_front();
+            }
+        }
+        for (const auto &push : pushes)
+            applyPresence(push.second);
+    }
+
+    // runs on readerThread while multiplexed, the only place that reads clientSocket then
+    void readReplies() {
+        while (reading) {
+            std::string message = clientSocket.recvEncrypted(clientPrivateKey, nullptr, 1);
+            if (message.empty()) {
+                if (clientSocket.error_t == "Timeout occurred" && clientSocket.isConnected)
+                    continue;
+                break;
+            }
+            routeMessage(message);
+        }
+        reading = false;
+        // nobody is going to answer what is still waiting
+        std::lock_guard<std::mutex> lock(routeMutex);
+        for (auto &waiting : pendingReplies)
+            waiting.second->set_value(ServerReply{"", pushesRouted});
+        pendingReplies.clear();
+        for (auto &waiting : pendingConfirmations)
+            waiting->set_value(ServerReply{"", pushesRouted});
+        pendingConfirmations.clear();
+    }
+
+    // hand one message from the server to whoever is waiting for it
+    void routeMessage(const std::string &message) {
+        if (message.compare(0, 1, "@") == 0) {
+            size_t space = message.find(' ');
+            uint64_t id = std::strtoull(message.c_str() + 1, nullptr, 10);
+            std::string reply = space == std::string::npos ? "" : message.substr(space + 1);
+            std::lock_guard<std::mutex> lock(routeMutex);
+            auto waiting = pendingReplies.find(id);
+            if (waiting == pendingReplies.end()) {
+                std::cerr << "Ignoring reply to request " << id << ", nobody is waiting for it" << std::endl;
+                return;
+            }
+            // a SUBSCRIBE reply brings us up to date, the pushes queued before it are already covered
+            if (reply.compare(0, 9, "PRESENCE#") == 0)
+                pendingPushes.clear();
+            waiting->second->set_value(ServerReply{reply, pushesRouted});
+            pendingReplies.erase(waiting);
+        } else if (message.compare(0, 9, "PRESENCE#") == 0) {
+            std::lock_guard<std::mutex> lock(routeMutex);
+            pendingPushes.emplace_back(++pushesRouted, message);
+        } else if (message.compare(0, 6, "BATCH#") == 0) {
+            applyBatchResult(message);
+        } else if (message.compare(0, 8, "Transfer") == 0) {
+            std::lock_guard<std::mutex> lock(routeMutex);
+            if (pendingConfirmations.empty()) {
+                std::cerr << "Ignoring transfer confirmation, no payment is waiting for one: " << message << std::endl;
+                return;
+            }
+            pendingConfirmations.front()->set_value(ServerReply{message, pushesRouted});
+            pendingConfirmations.pop_front();
+        } else {
+            std::cerr << "Ignoring unexpected message from server: " << message << std::endl;
+        }
+    }
+
+    // stop readerThread, the socket is shut down so the reader does not wait for its timeout
+    void stopReader() {
+        if (!readerThread.joinable())
+            return;
+        reading = false;
+        if (clientSocket.sockfd != -1)
+            ::shutdown(clientSocket.sockfd, SHUT_RDWR);
+        readerThread.join();
+    }
+
+    // pick a symmetric key for this connection and send it once under the server's RSA or X25519 key, everything
+    // after that is AES-GCM encrypted. servers without session support answer with an error and we stay on RSA
+    bool startSession() {
+        std::vector<unsigned char> key = generateSessionKey();
+        if (key.empty())
+            return false;
+        if (!clientSocket.sendEncrypted(serverPublicKey, "SESSION#" + base64Encode(key)))
+            return false;
+
+        clientSocket.sessionKey = key; // the reply is already encrypted with the new key
+        bool encrypted = false;
+        std::string response = clientSocket.recvEncrypted(clientPrivateKey, &encrypted);
+        if (encrypted && response.substr(0, 3) == "100")
+            return true;
+        clientSocket.sessionKey.clear();
+        error_t = "Server response: " + response;
+        return false;
+    }
+
+    // present the ticket from an earlier connection to server (<host>:<port>) with a fresh nonce. the server derives
+    // this connection's session key from the nonce and the ticket's key and logs us in as the ticket says
+    bool resumeSession(const std::string &server) {
+        if (sessionTicket.ticket.empty() || sessionTicket.server != server)
+            return false;
+        if (std::chrono::steady_clock::now() >= sessionTicket.expiry) {
+            sessionTicket = SessionTicket();
+            return false;
+        }
+        std::vector<unsigned char> nonce(RESUME_NONCE_SIZE);
+        if (RAND_bytes(nonce.data(), nonce.size()) != 1)
+            return false;
+        std::vector<unsigned char> key = deriveSessionKey(sessionTicket.sessionKey, nonce);
+        if (key.empty())
+            return false;
+        // the proof shows the server we hold the ticket's key, not just the ticket
+        if (!clientSocket.send("@0 RESUME#" + sessionTicket.ticket + "#" + base64Encode(nonce) + "#" + sessionEncrypt(key, "RESUME")))
+            return false;
+
+        clientSocket.sessionKey = key; // the reply is already encrypted with the new key
+        bool encrypted = false;
+        std::string response = clientSocket.recvEncrypted(clientPrivateKey, &encrypted);
+        if (encrypted && response.compare(0, 6, "@0 100") == 0) {
+            std::cerr << "Resumed the session of " << sessionTicket.username << std::endl;
+            return true;
+        }
+        // refused, it will not be accepted next time either
+        clientSocket.sessionKey.clear();
+        sessionTicket = SessionTicket();
+        std::cerr << "Server did not resume the session, logging in again. Server response: " << response << std::endl;
+        return false;
+    }
+
+    // ask for a ticket to resume this session with, or a new one before the current one runs out.
+    // servers without resumption refuse, then every reconnect logs in in full
+    void requestTicket() {
+        if (!multiplexed || clientSocket.sessionKey.empty())
+            return;
+        std::string response = request("TICKET");
+        std::vector<std::string> parts = split(response, '#');
+        int lifetime = 0;
+        try {
+            if (parts.size() == 3 && parts[0] == "TICKET")
+                lifetime = std::stoi(parts[1]);
+        } catch (const std::exception &e) {
+        }
+        if (lifetime <= 0) {
+            sessionTicket = SessionTicket();
+            return;
+        }
+        std::string &ticket = parts[2];
+        while (!ticket.empty() && (ticket.back() == '\r' || ticket.back() == '\n'))
+            ticket.pop_back();
+        auto now = std::chrono::steady_clock::now();
+        sessionTicket.ticket = ticket;
+        sessionTicket.sessionKey = clientSocket.sessionKey;
+        sessionTicket.server = serverAddress + ":" + port;
+        sessionTicket.username = username;
+        sessionTicket.p2pPort = p2pPort;
+        sessionTicket.expiry = now + std::chrono::seconds(lifetime);
+        sessionTicket.renewAt = now + std::chrono::seconds(lifetime / 2);
+    }
+
+    // close the connection without logging out, like a network failure would. the ticket is kept,
+    // so connectToServer and logIn resume the session
+    void dropConnection() {
+        stopReader();
+        clientSocket.closeConnection();
+    }
+
     bool registerAccount(const std::string &username) {
         std::cerr << "Registering account" << std::endl;
         if (!clientSocket.isConnected) {
             error_t = "Not connected to server";
             return false;
         }
-        clientSocket.sendEncrypted(serverPublicKey, "REGISTER#" + username);
-        std::string response = clientSocket.recvEncrypted(clientPrivateKey);
+        std::string response = request("REGISTER#" + username);
 
         if (response.substr(0, 3) == "100") {
             error_t = "Server response: " + response;
@@ -109,6 +451,10 @@ public:
             return false;
         }
 
+        // a resumed connection is already logged in, unless someone else is logging in on it now
+        if (resumed && username == sessionTicket.username && (p2pPort == "0" || p2pPort == sessionTicket.p2pPort))
+            return finishResume();
+
         int portNum = p2pListenSocket.checkPort(p2pPort);
         if (portNum == -1) {
             error_t = "Invalid client port";
@@ -126,12 +472,12 @@ public:
             this->p2pPort = std::to_string(portNum);
         }
 
-        std::string publicKey = loadKeyFromFile(PUBLIC_KEY_FILE);
+        const std::string &publicKey = localKeystore().publicKeyPem();
 
-        clientSocket.sendEncrypted(serverPublicKey, "LOGIN#" + this->username + "#" + this->p2pPort + "#" + publicKey);
-        std::string response = clientSocket.recvEncrypted(clientPrivateKey);
+        std::string response = request("LOGIN#" + this->username + "#" + this->p2pPort + "#" + publicKey);
 
-        if (response.substr(0, 13) == "220 AUTH_FAIL") {
+        // the server has always replied "220 AUTH FAIL", with a space
+        if (response.substr(0, 13) == "220 AUTH FAIL") {
             error_t = "Please check your username and try again.\nServer response: " + response;
             return false;
         }
@@ -139,6 +485,10 @@ public:
             error_t = "Error message format from client.\nServer response: " + response;
             return false;
         }
+        if (response.substr(0, 16) == "230 SERVER ERROR") {
+            error_t = "The server cannot take logins right now.\nServer response: " + response;
+            return false;
+        }
 
         loggedIn = true;
 
@@ -154,9 +504,207 @@ public:
             return false;
         }
 
+        subscribed = false;
+        presenceVersion = 0;
+        if (!subscribePresence())
+            std::cerr << "Server does not push presence, falling back to List polling" << std::endl;
+        serverBatches = subscribed;
+
+        requestTicket();
+        return true;
+    }
+
+    // logIn on a connection connectToServer resumed. the server restored our account and P2P port from the ticket,
+    // so presence only has to catch up from the version we had when the connection was lost
+    bool finishResume() {
+        p2pPort = sessionTicket.p2pPort;
+        loggedIn = true;
+        if (!p2pListening) {
+            if (!p2pListenSocket.bindSocket(p2pPort)) {
+                error_t = "Failed to bind p2p port. Please check if the port is available on your system.\n" + p2pListenSocket.error_t;
+                return false;
+            }
+            p2pStartListening();
+        }
+
+        subscribed = false;
+        if (!subscribePresence()) {
+            error_t = "Resumed the session but failed to catch up on presence\n" + error_t;
+            return false;
+        }
+        serverBatches = true;
+
+        requestTicket();
+        return true;
+    }
+
+    // read the reply to the request just sent when not multiplexed. presence pushes and batch results that
+    // arrive in the meantime are applied and skipped
+    std::string recvReply(bool *encrypted = nullptr, int timeout_sec = 5) {
+        while (true) {
+            std::string message = clientSocket.recvEncrypted(clientPrivateKey, encrypted, timeout_sec);
+            if (message.compare(0, 9, "PRESENCE#") == 0)
+                applyPresence(message);
+            else if (message.compare(0, 6, "BATCH#") == 0)
+                applyBatchResult(message);
+            else
+                return message;
+        }
+    }
+
+    // ask the server to push presence changes after presenceVersion. the reply brings us up to date
+    bool subscribePresence() {
+        if (multiplexed) {
+            std::string response = request("SUBSCRIBE#" + std::to_string(presenceVersion));
+            if (response.compare(0, 9, "PRESENCE#") != 0) {
+                error_t = "Server response: " + response;
+                return false;
+            }
+            subscribed = true;
+            return applyPresence(response);
+        }
+        if (!clientSocket.sendEncrypted(serverPublicKey, "SUBSCRIBE#" + std::to_string(presenceVersion)))
+            return false;
+        while (true) {
+            std::string response = clientSocket.recvEncrypted(clientPrivateKey);
+            if (response.compare(0, 9, "PRESENCE#") != 0) {
+                error_t = "Server response: " + response;
+                return false;
+            }
+            // pushes the server sent before it saw SUBSCRIBE are covered by the reply, skip them
+            std::string from = response.substr(9, response.find('#', 9) - 9);
+            if (from != "FULL" && from != std::to_string(presenceVersion))
+                continue;
+            subscribed = true;
+            return applyPresence(response);
+        }
+    }
+
+    // apply the presence pushes that have arrived since the last call, without blocking.
+    // returns false when the connection to the server is gone
+    bool pollPresence() {
+        if (!clientSocket.isConnected) {
+            error_t = "Not connected to server";
+            return false;
+        }
+        if (multiplexed) {
+            applyPushes();
+            if (reading && !sessionTicket.ticket.empty() && std::chrono::steady_clock::now() >= sessionTicket.renewAt)
+                requestTicket();
+            return reading;
+        }
+        // the transfer confirmation is read by verifyMicropaymentTransaction, leave it in the buffer
+        if (waitingForRecv)
+            return true;
+        while (true) {
+            std::string message = clientSocket.recvEncrypted(clientPrivateKey, nullptr, 0);
+            if (message.empty())
+                return clientSocket.error_t == "Timeout occurred";
+            if (message.compare(0, 9, "PRESENCE#") == 0)
+                applyPresence(message);
+            else if (message.compare(0, 6, "BATCH#") == 0)
+                applyBatchResult(message);
+            else
+                std::cerr << "Ignoring unexpected message from server: " << message << std::endl;
+        }
+    }
+
+    // patch userAccounts and the balance with one push from the server, format:
+    // PRESENCE#<from version>#<to version><CRLF> followed by JOIN#<user>#<ip>#<port>[#<key fingerprint>], LEAVE#<user> or BALANCE#<balance> lines,
+    // or PRESENCE#FULL#<version><CRLF> followed by a List response
+    bool applyPresence(const std::string &message) {
+        size_t headerEnd = message.find("\r\n");
+        std::vector<std::string> header = split(message.substr(0, headerEnd), '#');
+        std::string body = headerEnd == std::string::npos ? "" : message.substr(headerEnd + 2);
+        try {
+            if (header.size() == 3 && header[1] == "FULL") {
+                if (!parseOnlineUsers(body))
+                    return false;
+                presenceVersion = std::stoull(header[2]);
+                statusUpdatedCallback();
+                return true;
+            }
+            if (header.size() != 3) {
+                error_t = "Invalid presence update: " + message;
+                return false;
+            }
+            if (std::stoull(header[1]) < presenceVersion)
+                return true; // sent before the reply that brought us to presenceVersion
+            if (std::stoull(header[1]) != presenceVersion) {
+                // we missed a change, ask for everything after the version we have
+                std::cerr << "Presence version " << presenceVersion << " is behind " << header[1] << ", resubscribing" << std::endl;
+                return subscribePresence();
+            }
+            presenceVersion = std::stoull(header[2]);
+
+            std::istringstream bodyStream(body);
+            std::string line;
+            while (std::getline(bodyStream, line)) {
+                if (!line.empty() && line[line.size() - 1] == '\r')
+                    line.pop_back();
+                std::vector<std::string> change = split(line, '#');
+                if (change.empty())
+                    continue;
+                if (change[0] == "BALANCE" && change.size() == 2) {
+                    accountBalance = std::stoi(change[1]);
+                    continue;
+                }
+                if ((change[0] != "JOIN" || change.size() < 4 || change.size() > 5) && (change[0] != "LEAVE" || change.size() != 2))
+                    continue;
+                if (change[0] == "LEAVE")
+                    removeUser(change[1]);
+                else
+                    setUser({change[1], change[2], change[3], change.size() == 5 ? change[4] : ""});
+            }
+        } catch (const std::exception &e) {
+            error_t = "Invalid presence update: " + message + "\nException: " + e.what();
+            return false;
+        }
+        statusUpdatedCallback();
         return true;
     }
 
+    const UserAccount *findUser(const std::string &name) const {
+        auto index = userIndex.find(name);
+        return index == userIndex.end() ? nullptr : &userAccounts[index->second];
+    }
+
+    // add or update a user in the online list, a no-op if nothing about it changed
+    void setUser(const UserAccount &user) {
+        auto index = userIndex.find(user.username);
+        if (index == userIndex.end()) {
+            userIndex[user.username] = userAccounts.size();
+            userAccounts.push_back(user);
+        } else {
+            UserAccount &listed = userAccounts[index->second];
+            if (listed.ipAddr == user.ipAddr && listed.p2pPort == user.p2pPort && listed.keyFingerprint == user.keyFingerprint)
+                return;
+            listed = user;
+        }
+        changedUsers.insert(user.username);
+    }
+
+    // the last user takes the removed one's place, so removal does not shift the whole list
+    void removeUser(const std::string &name) {
+        auto index = userIndex.find(name);
+        if (index == userIndex.end())
+            return;
+        size_t position = index->second;
+        userIndex.erase(index);
+        if (position != userAccounts.size() - 1) {
+            userAccounts[position] = std::move(userAccounts.back());
+            userIndex[userAccounts[position].username] = position;
+        }
+        userAccounts.pop_back();
+        changedUsers.insert(name);
+    }
+
+    std::vector<std::string> takeUserChanges() {
+        std::vector<std::string> changes(changedUsers.begin(), changedUsers.end());
+        changedUsers.clear();
+        return changes;
+    }
+
     bool parseOnlineUsers(const std::string &response) {
         /* format:
         <accountBalance><CRLF>
@@ -164,6 +712,7 @@ public:
         <number of accounts online><CRLF>
         <userAccount1>#<userAccount1_IPaddr>#<userAccount1_portNum><CRLF>
         <userAccount2>#<userAccount2_ IPaddr>#<userAccount2_portNum><CRLF>
+        each user line may end with #<public key fingerprint>
         */
         std::cerr << "Parsing online users" << std::endl;
 
@@ -200,15 +749,29 @@ public:
 
             int numAccounts = std::stoi(lines[1]);
 
-            userAccounts.clear();
+            std::vector<UserAccount> listed;
             for (int i = 2; i < numAccounts + 2; i++) {
                 std::istringstream accountStream(lines[i]);
-                std::string username, ipAddr, portNum;
+                std::string username, ipAddr, portNum, fingerprint;
                 std::getline(accountStream, username, '#');
                 std::getline(accountStream, ipAddr, '#');
-                std::getline(accountStream, portNum);
-                userAccounts.push_back({username, ipAddr, portNum});
+                std::getline(accountStream, portNum, '#');
+                std::getline(accountStream, fingerprint);
+                listed.push_back({username, ipAddr, portNum, fingerprint});
+            }
+            // merge rather than replace, so only the users that really changed are reported
+            std::unordered_set<std::string> listedNames;
+            for (const auto &user : listed)
+                listedNames.insert(user.username);
+            std::vector<std::string> gone;
+            for (const auto &user : userAccounts) {
+                if (!listedNames.count(user.username))
+                    gone.push_back(user.username);
             }
+            for (const auto &name : gone)
+                removeUser(name);
+            for (const auto &user : listed)
+                setUser(user);
         } catch (const std::exception &e) {
             error_t = "Server response: " + response + "\nException: " + e.what();
             return false;
@@ -223,12 +786,11 @@ public:
             return false;
         }
         // don't let the List request interfere with Transfer OK! response, etc.
-        if (waitingForRecv) {
+        if (waitingForRecv && !multiplexed) {
             std::cerr << "Waiting for Transfer OK! receive/timeout" << std::endl;
             return false;
         }
-        clientSocket.sendEncrypted(serverPublicKey, "List");
-        std::string response = clientSocket.recvEncrypted(clientPrivateKey);
+        std::string response = request("List#FP");
         bool parseSuccess = parseOnlineUsers(response);
 
         if (!parseSuccess) {
@@ -247,24 +809,24 @@ public:
             error_t = "Not connected to server";
             return false;
         }
+        // the payee may have just logged in or moved
+        if (multiplexed)
+            applyPushes();
 
         // find the payee's IP address and port number
         std::string payeeIPAddr = "";
         std::string payeePort = "";
-        for (const auto &user : userAccounts) {
-            if (user.username == payeeUsername) {
-                payeeIPAddr = user.ipAddr;
-                payeePort = user.p2pPort;
-                std::cerr << payeePort.size() << std::endl;
-                break;
-            }
+        std::string payeeFingerprint = "";
+        if (const UserAccount *user = findUser(payeeUsername)) {
+            payeeIPAddr = user->ipAddr;
+            payeePort = user->p2pPort;
+            payeeFingerprint = user->keyFingerprint;
         }
 
         // find the payee's public key
-        clientSocket.sendEncrypted(serverPublicKey, "PKEY#" + payeeUsername);
-        std::string payeePkey = clientSocket.recvEncrypted(clientPrivateKey);
-        if (payeePkey.empty() || payeePkey.substr(0, 3) == "240") {
-            error_t = "Failed to fetch payee's public key\n" + clientSocket.error_t;
+        const PeerKey *payeeKey = peerKey(payeeUsername, payeeFingerprint);
+        if (!payeeKey) {
+            error_t = "Failed to fetch payee's public key\n" + error_t;
             return false;
         }
 
@@ -273,27 +835,77 @@ public:
             return false;
         }
 
-        MySocket p2pSendSocket("p2pSend");
-        if (!p2pSendSocket.connect(payeeIPAddr, payeePort)) {
-            error_t = "Failed to connect to payee\n" + p2pSendSocket.error_t;
-            return false;
-        }
-
         transferOk = false;
 
-        waitingForRecv = true;
-        if (p2pSendSocket.sendEncrypted(stringToKey(payeePkey, false), username + "#" + std::to_string(amount) + "#" + payeeUsername)) {
+        // waiting before the payment leaves, the confirmation can come back before send returns
+        std::shared_ptr<std::promise<ServerReply>> confirmation;
+        if (multiplexed) {
+            confirmation = std::make_shared<std::promise<ServerReply>>();
+            std::lock_guard<std::mutex> lock(routeMutex);
+            pendingConfirmations.push_back(confirmation);
+        }
+
+        // the pooled connection is tied to this payee's address and key, a re-login elsewhere gets a new one
+        std::string peer = payeeUsername + "@" + payeeIPAddr + ":" + payeePort + "#" + payeeKey->fingerprint;
+        if (p2pPool.send(peer, payeeIPAddr, payeePort, payeeKey->key.get(), username + "#" + std::to_string(amount) + "#" + payeeUsername)) {
+            waitingForRecv = true;
+            if (confirmation)
+                unverifiedPayments.push_back(confirmation->get_future().share());
             std::cerr << "Sent micropayment transaction to " << payeeUsername << std::endl;
             return true;
         }
+        if (confirmation)
+            dropConfirmation(confirmation);
 
-        error_t = "Failed to send payment to " + payeeUsername + "\nError: " + error_t;
+        error_t = "Failed to send payment to " + payeeUsername + "\nError: " + p2pPool.error_t;
         return false;
     }
 
+    // a user's public key, from peerKeys if fingerprint still matches it, otherwise asked from the server with PKEY.
+    // an empty fingerprint (older servers) always asks. nullptr with error_t set if there is no valid key
+    const PeerKey *peerKey(const std::string &username, const std::string &fingerprint) {
+        auto cached = peerKeys.find(username);
+        if (cached != peerKeys.end() && !fingerprint.empty() && cached->second.fingerprint == fingerprint)
+            return &cached->second;
+
+        pkeyLookups++;
+        std::string pem = request("PKEY#" + username);
+        if (pem.empty() || pem.substr(0, 3) == "240") {
+            error_t = "Server response: " + pem + "\n" + clientSocket.error_t;
+            return nullptr;
+        }
+        // the server ends the key with a CRLF that is not part of the fingerprint
+        if (pem.size() >= 2 && pem.compare(pem.size() - 2, 2, "\r\n") == 0)
+            pem.erase(pem.size() - 2);
+        SharedKey key(stringToKey(pem, false), EVP_PKEY_free);
+        if (!key) {
+            error_t = "Invalid public key for " + username;
+            return nullptr;
+        }
+        PeerKey &entry = peerKeys[username];
+        entry = PeerKey{keyFingerprint(pem), pem, key};
+        if (!fingerprint.empty() && entry.fingerprint != fingerprint)
+            std::cerr << "Public key of " << username << " does not match the online list, it may have logged in again" << std::endl;
+        return &entry;
+    }
+
+    // wait for the server to confirm the oldest payment we sent
     bool verifyMicropaymentTransaction() {
-        std::string response = clientSocket.recvEncrypted(clientPrivateKey);
-        waitingForRecv = false;
+        std::string response;
+        if (multiplexed) {
+            if (unverifiedPayments.empty()) {
+                error_t = "No payment is waiting for confirmation";
+                return false;
+            }
+            std::shared_future<ServerReply> confirmation = unverifiedPayments.front();
+            unverifiedPayments.pop_front();
+            response = awaitReply(confirmation);
+            if (response.empty())
+                dropOldestConfirmation();
+        } else {
+            response = recvReply();
+        }
+        waitingForRecv = !unverifiedPayments.empty();
         if (response == "Transfer OK!\n" || response == "Transfer OK!\r\n") {
             transferOk = true;
             return true;
@@ -302,15 +914,40 @@ public:
         return false;
     }
 
+    // stop waiting for a confirmation of a payment that never left
+    void dropConfirmation(const std::shared_ptr<std::promise<ServerReply>> &confirmation) {
+        std::lock_guard<std::mutex> lock(routeMutex);
+        auto waiting = std::find(pendingConfirmations.begin(), pendingConfirmations.end(), confirmation);
+        if (waiting != pendingConfirmations.end())
+            pendingConfirmations.erase(waiting);
+    }
+
+    // a payment timed out, the next confirmation is for a later one
+    void dropOldestConfirmation() {
+        std::lock_guard<std::mutex> lock(routeMutex);
+        if (!pendingConfirmations.empty())
+            pendingConfirmations.pop_front();
+    }
+
     void logOut() {
+        // forward the payments still waiting before saying goodbye
+        if (p2pListening)
+            p2pStopListening();
         if (clientSocket.isConnected) {
-            clientSocket.sendEncrypted(serverPublicKey, "Exit");
-            std::cout << "Server replied: " << clientSocket.recvEncrypted(clientPrivateKey) << std::endl;
+            std::string reply = request("Exit");
+            std::cout << "Server replied: " << reply << std::endl;
             std::cout << clientSocket.error_t << std::endl;
+            // logged out on purpose, nothing to resume. a connection that was already lost keeps its ticket
+            if (!reply.empty())
+                sessionTicket = SessionTicket();
         }
+        stopReader();
+        unverifiedPayments.clear();
         loggedIn = false;
-        if (p2pListening)
-            p2pStopListening();
+        subscribed = false;
+        serverBatches = false;
+        p2pPool.clear();
+        peerKeys.clear();
         clientSocket.closeConnection();
     }
 
@@ -319,24 +956,40 @@ public:
     }
 
     void p2pStartListening() {
+        p2pReactor = new Reactor("p2p");
+        p2pReactor->frameCallback = [this](MySocket *peer, const std::string &frame) {
+            bool encrypted = false;
+            std::string message = peer->decodeEncrypted(frame, clientPrivateKey, &encrypted);
+            if (!encrypted) {
+                error_t = "Received unencrypted message from peer";
+                return false;
+            }
+            handleIncomingMessage(message);
+            return true;
+        };
+        if (!p2pReactor->start()) {
+            error_t = "Failed to start p2p event loop\n" + p2pReactor->error_t;
+            delete p2pReactor;
+            p2pReactor = nullptr;
+            return;
+        }
+
+        forwarding = true;
+        forwardThread = std::thread(&ClientAction::forwardLoop, this);
+
         p2pListening = true;
         listeningThread = std::thread([this]() {
             while (p2pListening) {
                 if (p2pListenSocket.listen(1)) {
-                    MySocket p2pRecv("p2p_recv");
-                    p2pListenSocket.accept(p2pRecv);
-                    bool encrypted = false;
-                    std::string message = p2pRecv.recvEncrypted(clientPrivateKey, &encrypted);
-                    if (message.empty())
-                        error_t = "Failed to receive message from peer\n" + p2pRecv.error_t;
-                    else if (!encrypted)
-                        error_t = "Received unencrypted message from peer";
-                    else
-                        handleIncomingMessage(message);
-                } else {
-                    error_t = "Failed to listen for incoming connections (timeout)\n" + p2pListenSocket.error_t;
+                    // payers keep the connection for their next payments, the reactor serves it from now on
+                    MySocket *p2pRecv = new MySocket("p2p_recv");
+                    if (p2pListenSocket.accept(*p2pRecv).first.empty() || !p2pReactor->addSocket(p2pRecv)) {
+                        error_t = "Failed to accept connection from peer\n" + p2pListenSocket.error_t;
+                        delete p2pRecv;
+                    }
+                } else if (p2pListenSocket.error_t != "Timeout occurred") {
+                    error_t = "Failed to listen for incoming connections\n" + p2pListenSocket.error_t;
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
         });
     }
@@ -346,6 +999,24 @@ public:
         std::cerr << "Stopping p2p listening thread" << std::endl;
         if (listeningThread.joinable())
             listeningThread.join();
+        // free the port, a resumed session listens on the same one again
+        if (p2pListenSocket.sockfd != -1) {
+            ::close(p2pListenSocket.sockfd);
+            p2pListenSocket.sockfd = -1;
+        }
+        if (p2pReactor) {
+            p2pReactor->stop();
+            delete p2pReactor;
+            p2pReactor = nullptr;
+        }
+        // no more payments can come in, the forward thread sends what is left and exits
+        {
+            std::lock_guard<std::mutex> lock(forwardMutex);
+            forwarding = false;
+        }
+        forwardReady.notify_all();
+        if (forwardThread.joinable())
+            forwardThread.join();
         std::cerr << "Stopped p2p listening thread" << std::endl;
     }
 
@@ -362,11 +1033,88 @@ public:
 
         std::cout << "Payer: " << payerUsername << ", Amount: " << amount << ", Payee: " << payeeUsername << std::endl;
 
-        clientSocket.sendEncrypted(serverPublicKey, payerUsername + "#" + amount + "#" + payeeUsername);
+        // the forward thread passes it on to the server, together with whatever else arrives in the window
+        {
+            std::lock_guard<std::mutex> lock(forwardMutex);
+            pendingForwards.push_back(payerUsername + "#" + amount + "#" + payeeUsername);
+        }
+        forwardReady.notify_one();
 
         // fetchServerInfo(); // I don't think we can do this here, because multithreading thing
     }
 
+    // runs on forwardThread while we listen for payments
+    void forwardLoop() {
+        size_t batchMax = std::min(std::max<size_t>(clientConfig.forwardBatchMax, 1), (size_t)FORWARD_BATCH_LIMIT);
+        std::unique_lock<std::mutex> lock(forwardMutex);
+        while (true) {
+            forwardReady.wait(lock, [this]() { return !pendingForwards.empty() || !forwarding; });
+            if (pendingForwards.empty())
+                return; // stopped and nothing left to send
+            // the first payment waits for others to join it, unless we are stopping
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(clientConfig.forwardWindowMs);
+            forwardReady.wait_until(lock, deadline, [this, batchMax]() { return pendingForwards.size() >= batchMax || !forwarding; });
+
+            size_t count = std::min(pendingForwards.size(), batchMax);
+            std::vector<std::string> batch(pendingForwards.begin(), pendingForwards.begin() + count);
+            pendingForwards.erase(pendingForwards.begin(), pendingForwards.begin() + count);
+            bool asBatch = batch.size() > 1 && serverBatches;
+            if (asBatch)
+                sentBatches.push_back(batch); // before sending, the result may come back before we get the lock again
+            lock.unlock();
+            bool sent = forwardPayments(batch, asBatch);
+            lock.lock();
+            if (!sent && asBatch)
+                sentBatches.pop_back(); // only this thread adds batches, so the failed one is still the last
+        }
+    }
+
+    // one message per payment, or a single BATCH#<count><CRLF><payer#amount#payee><CRLF>... for all of them
+    bool forwardPayments(const std::vector<std::string> &payments, bool asBatch) {
+        if (!asBatch) {
+            bool sent = true;
+            for (const auto &payment : payments)
+                sent = clientSocket.sendEncrypted(serverPublicKey, payment) && sent;
+            return sent;
+        }
+        std::string message = "BATCH#" + std::to_string(payments.size()) + "\r\n";
+        for (const auto &payment : payments)
+            message += payment + "\r\n";
+        if (!clientSocket.sendEncrypted(serverPublicKey, message)) {
+            std::cerr << "Failed to forward " << payments.size() << " payments to the server: " << clientSocket.error_t << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // the server's answer to the oldest batch we forwarded, one line per payment,
+    // BATCH#<count><CRLF><index>#OK<CRLF> or <index>#FAILED#<reason><CRLF>
+    void applyBatchResult(const std::string &message) {
+        std::vector<std::string> batch;
+        {
+            std::lock_guard<std::mutex> lock(forwardMutex);
+            if (sentBatches.empty()) {
+                std::cerr << "Ignoring result of a batch we did not send: " << message << std::endl;
+                return;
+            }
+            batch = sentBatches.front();
+            sentBatches.pop_front();
+        }
+        std::istringstream resultStream(message);
+        std::string line;
+        std::getline(resultStream, line); // header
+        while (std::getline(resultStream, line)) {
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.pop_back();
+            std::vector<std::string> result = split(line, '#');
+            if (result.size() < 2 || result[1] == "OK")
+                continue;
+            size_t index = std::strtoul(result[0].c_str(), nullptr, 10);
+            std::string payment = index < batch.size() ? batch[index] : result[0];
+            std::cerr << "\033[31mServer rejected forwarded payment " << payment << ": " << (result.size() > 2 ? result[2] : result[1]) << "\033[0m" << std::endl;
+        }
+    }
+
     void quitApp() {
         p2pListenSocket.closeConnection();
 
@@ -3,6 +3,9 @@
 
 #include <fstream>
 #include <string>
+#include <cstdlib>
+#include <algorithm>
+#include "mySocket.h"
 
 #define CLIENT_CONFIG_FILE "client.conf"
 
@@ -12,6 +15,10 @@ public:
     std::string serverPort = "5000";
     std::string username;
     std::string p2pPort = "0";
+    // payments we receive wait up to forwardWindowMs for others to be forwarded to the server with them,
+    // a batch goes out right away once it has forwardBatchMax payments
+    int forwardWindowMs = 5;
+    size_t forwardBatchMax = 64;
 
     ClientConfig() {
         read();
@@ -33,6 +40,10 @@ public:
                     username = line.substr(line.find("=") + 1);
                 } else if (line.find("p2pPort=") != std::string::npos) {
                     p2pPort = line.substr(line.find("=") + 1);
+                } else if (line.find("forwardWindowMs=") != std::string::npos) {
+                    forwardWindowMs = std::max(0, std::atoi(line.substr(line.find("=") + 1).c_str()));
+                } else if (line.find("forwardBatchMax=") != std::string::npos) {
+                    forwardBatchMax = std::min(std::max(1, std::atoi(line.substr(line.find("=") + 1).c_str())), FORWARD_BATCH_LIMIT);
                 }
             }
             configFile.close();
@@ -43,6 +54,8 @@ public:
         std::ofstream configFile(CLIENT_CONFIG_FILE);
         configFile << "serverAddress=" << serverAddress << std::endl;
         configFile << "serverPort=" << serverPort << std::endl;
+        configFile << "forwardWindowMs=" << forwardWindowMs << std::endl;
+        configFile << "forwardBatchMax=" << forwardBatchMax << std::endl;
         if (rememberMe && !username.empty()) {
             configFile << "username=" << username << std::endl;
             configFile << "p2pPort=" << p2pPort << std::endl;
@@ -0,0 +1,212 @@
+#ifndef CLIENT_WORKER_H
+#define CLIENT_WORKER_H
+
+#include <gtkmm.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include "../clientAction.h"
+
+// what the windows show of clientAction. the worker copies it after every operation, the windows read
+// this copy and never clientAction itself, so they do not race with the operation running on the worker
+struct ClientView {
+    std::string username;
+    int accountBalance = 0;
+    // online users by name. kept up to date with the users that changed instead of copied whole every time
+    std::unordered_map<std::string, UserAccount> users;
+    std::string serverAddress;
+    std::string port;
+    std::string serverPublicKey;
+    std::string error;
+    bool loggedIn = false;
+    bool subscribed = false;
+    uint64_t revision = 0; // bumped every time clientAction reports a status update
+};
+
+// runs clientAction's blocking operations on a worker thread and hands the results back to the GTK main loop
+// through a Glib::Dispatcher, so a slow or dead server never stalls the UI. operations run one at a time in
+// the order they were posted, which keeps clientAction single threaded. requests from consecutive operations
+// still overlap on the wire, clientAction multiplexes the connection
+class ClientWorker {
+public:
+    ClientView view;                           // main loop only
+    std::function<void()> viewChangedCallback; // on the main loop, when view.revision changes
+    // on the main loop, with the users added to, changed in or removed from view.users
+    std::function<void(const std::vector<std::string> &)> usersChangedCallback;
+
+    ClientWorker() {
+        dispatcher.connect(sigc::mem_fun(*this, &ClientWorker::onDispatch));
+        clientAction.statusUpdatedCallback = [this]() {
+            revision++; // on the worker, picked up by the next snapshot
+        };
+        worker = std::thread(&ClientWorker::run, this);
+    }
+
+    ~ClientWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobReady.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // run job on the worker, then done on the main loop once view reflects what job did
+    void post(const std::function<void()> &job, const std::function<void()> &done = nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(Job{job, done});
+        }
+        jobReady.notify_one();
+    }
+
+    // run fn on the main loop, for callbacks clientAction makes on the worker
+    void runOnMain(const std::function<void()> &fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(fn);
+        }
+        dispatcher.emit();
+    }
+
+    // operations posted and not finished yet
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size() + (busy ? 1 : 0);
+    }
+
+private:
+    struct Job {
+        std::function<void()> run;
+        std::function<void()> done;
+    };
+
+    // a user as it is now, or gone from the online list
+    struct UserChange {
+        std::string username;
+        bool online;
+        UserAccount account;
+    };
+
+    Glib::Dispatcher dispatcher;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::deque<Job> jobs;
+    std::vector<std::function<void()>> finished; // done callbacks waiting for the main loop
+    ClientView latest;                           // newest snapshot, not yet handed to the main loop
+    std::vector<UserChange> userChanges;         // not yet applied to view.users, oldest first
+    bool hasLatest = false;
+    bool busy = false;
+    bool stopping = false;
+
+    // worker only
+    uint64_t revision = 0;
+    uint64_t shownServerKey = UINT64_MAX; // serverKeyGeneration serverKeyText was made from
+    std::string serverKeyText;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            jobReady.wait(lock, [this]() { return !jobs.empty() || stopping; });
+            if (jobs.empty())
+                return; // stopping, and everything posted has run
+            Job job = jobs.front();
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+
+            job.run();
+            ClientView snapshot = capture();
+            std::vector<UserChange> changes = captureUsers();
+
+            lock.lock();
+            busy = false;
+            latest = std::move(snapshot);
+            userChanges.insert(userChanges.end(), changes.begin(), changes.end());
+            hasLatest = true;
+            if (job.done)
+                finished.push_back(job.done);
+            lock.unlock();
+            dispatcher.emit();
+            lock.lock();
+        }
+    }
+
+    ClientView capture() {
+        ClientView snapshot;
+        snapshot.username = clientAction.username;
+        snapshot.accountBalance = clientAction.accountBalance;
+        snapshot.serverAddress = clientAction.serverAddress;
+        snapshot.port = clientAction.port;
+        // the key only changes on connect, so it is turned into text once per key
+        if (clientAction.serverKeyGeneration != shownServerKey) {
+            shownServerKey = clientAction.serverKeyGeneration;
+            serverKeyText = clientAction.serverPublicKey ? keyToString(clientAction.serverPublicKey, false) : "";
+        }
+        snapshot.serverPublicKey = serverKeyText;
+        snapshot.error = clientAction.error_t;
+        snapshot.loggedIn = clientAction.loggedIn;
+        snapshot.subscribed = clientAction.subscribed;
+        snapshot.revision = revision;
+        return snapshot;
+    }
+
+    std::vector<UserChange> captureUsers() {
+        std::vector<UserChange> changes;
+        for (const auto &name : clientAction.takeUserChanges()) {
+            const UserAccount *user = clientAction.findUser(name);
+            changes.push_back(UserChange{name, user != nullptr, user ? *user : UserAccount()});
+        }
+        return changes;
+    }
+
+    // on the main loop: take the newest snapshot, then run the callbacks that were waiting for it
+    void onDispatch() {
+        std::vector<std::function<void()>> callbacks;
+        std::vector<UserChange> changes;
+        bool changed = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            callbacks.swap(finished);
+            changes.swap(userChanges);
+            if (hasLatest) {
+                changed = latest.revision != view.revision;
+                std::unordered_map<std::string, UserAccount> users;
+                users.swap(view.users);
+                view = std::move(latest);
+                view.users.swap(users);
+                hasLatest = false;
+            }
+        }
+        if (!changes.empty()) {
+            std::vector<std::string> names;
+            for (auto &change : changes) {
+                if (change.online)
+                    view.users[change.username] = change.account;
+                else
+                    view.users.erase(change.username);
+                names.push_back(change.username);
+            }
+            if (usersChangedCallback)
+                usersChangedCallback(names);
+        }
+        if (changed && viewChangedCallback)
+            viewChangedCallback();
+        for (auto &callback : callbacks)
+            callback();
+    }
+};
+
+// created on first use, which has to be on the main loop after GTK is initialized
+ClientWorker &clientWorker() {
+    static ClientWorker worker;
+    return worker;
+}
+
+#endif // CLIENT_WORKER_H
@@ -3,6 +3,7 @@
 
 #include <gtkmm.h>
 #include "../clientAction.h"
+#include "clientWorker.h"
 
 using namespace Glib;
 using namespace Gtk;
@@ -65,6 +66,7 @@ public:
         Window::on_show();
         serverAddressEntry.set_text(serverAddress);
         portEntry.set_text(port);
+        testRun++;
         testConnectionButton.set_label("Test Connection");
         testConnectionButton.get_style_context()->remove_class("connection_success");
         testConnectionButton.get_style_context()->remove_class("connection_fail");
@@ -73,6 +75,7 @@ public:
 
 private:
     void on_serverAddressEntry_changed() {
+        testRun++;
         testConnectionButton.set_label("Test Connection");
         testConnectionButton.get_style_context()->remove_class("connection_success");
         testConnectionButton.get_style_context()->remove_class("connection_fail");
@@ -81,6 +84,7 @@ private:
     }
 
     void on_portEntry_changed() {
+        testRun++;
         testConnectionButton.set_label("Test Connection");
         testConnectionButton.get_style_context()->remove_class("connection_success");
         testConnectionButton.get_style_context()->remove_class("connection_fail");
@@ -117,7 +121,7 @@ private:
         testConnectionButton.get_style_context()->remove_class("connection_success");
         testConnectionButton.get_style_context()->remove_class("connection_fail");
 
-        signal_timeout().connect_once(sigc::mem_fun(*this, &ConfigureServerWindow::testConnection), 50);
+        testConnection();
     }
 
     void testConnection() {
@@ -132,20 +136,32 @@ private:
             return;
         }
 
-        // Test the connection
+        // Test the connection on the worker, a dead server would otherwise freeze the window for the connect and
+        // HELLO timeouts. a test still running when the address or port is changed, or another is started, is ignored
         std::cout << "Testing connection to " << serverAddress << ":" << port << std::endl;
-        ClientAction testConnection;
-        bool connectionResult = testConnection.connectToServer(serverAddress, port);
-        if (connectionResult) {
-            testConnectionButton.get_style_context()->add_class("connection_success");
-            testConnectionButton.set_label("Connection successful");
-        } else {
-            testConnectionButton.get_style_context()->add_class("connection_fail");
-            testConnectionButton.set_label("Fail");
-            MessageDialog dialog(*this, "Connection failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text(testConnection.error_t);
-            dialog.run();
-        }
+        uint64_t run = ++testRun;
+        std::shared_ptr<bool> connected = std::make_shared<bool>(false);
+        std::shared_ptr<std::string> error = std::make_shared<std::string>();
+        std::string address = serverAddress, serverPort = port;
+        clientWorker().post([=]() {
+            ClientAction testConnection; // cheap, it uses the keys localKeystore already loaded. not clientAction, so the
+                                         // test does not touch the connection the other windows use
+            *connected = testConnection.connectToServer(address, serverPort);
+            *error = testConnection.error_t;
+        }, [this, run, connected, error]() {
+            if (run != testRun)
+                return;
+            if (*connected) {
+                testConnectionButton.get_style_context()->add_class("connection_success");
+                testConnectionButton.set_label("Connection successful");
+            } else {
+                testConnectionButton.get_style_context()->add_class("connection_fail");
+                testConnectionButton.set_label("Fail");
+                MessageDialog dialog(*this, "Connection failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
+                dialog.set_secondary_text(*error);
+                dialog.run();
+            }
+        });
     }
 
     void on_saveButton_clicked() {
@@ -170,6 +186,7 @@ private:
     Entry portEntry;
     Button saveButton;
     Button testConnectionButton;
+    uint64_t testRun = 0; // the connection test whose result the button waits for
 };
 
 #endif // CONFIGURE_SERVER_H
\ No newline at end of file
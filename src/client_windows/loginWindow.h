@@ -182,14 +182,29 @@ private:
 
         logInButton.set_sensitive(false);
         logInButton.set_label("Logging in...");
-        signal_timeout().connect_once(sigc::mem_fun(*this, &LoginWindow::logIn), 50);
+        logIn();
     }
 
+    // connect and log in on the worker, the result comes back to logInFinished on the main loop
     void logIn() {
-        clientAction.connectToServer(configureServerWindow.serverAddress, configureServerWindow.port);
-        if (!clientAction.clientSocket.isConnected) {
+        std::shared_ptr<bool> connected = std::make_shared<bool>(false);
+        std::shared_ptr<bool> ok = std::make_shared<bool>(false);
+        std::string address = configureServerWindow.serverAddress, port = configureServerWindow.port;
+        std::string user = username, p2pPort = clientPort;
+        clientWorker().post([=]() {
+            clientAction.connectToServer(address, port);
+            *connected = clientAction.clientSocket.isConnected;
+            if (*connected)
+                *ok = clientAction.logIn(user, p2pPort);
+        }, [this, connected, ok]() {
+            logInFinished(*connected, *ok);
+        });
+    }
+
+    void logInFinished(bool connected, bool ok) {
+        if (!connected) {
             MessageDialog dialog(*this, "Failed to connect to server", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text(clientAction.error_t);
+            dialog.set_secondary_text(clientWorker().view.error);
             dialog.run();
 
             // configureServerButton.get_style_context()->add_class("error");
@@ -198,7 +213,7 @@ private:
             return;
         }
 
-        if (clientAction.logIn(username, clientPort)) {
+        if (ok) {
             // login success
             logInButton.set_sensitive(true);
             logInButton.set_label("Log in");
@@ -217,7 +232,7 @@ private:
 
         } else {
             MessageDialog dialog(*this, "Login failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text(clientAction.error_t);
+            dialog.set_secondary_text(clientWorker().view.error);
             dialog.run();
             logInButton.set_sensitive(true);
             logInButton.set_label("Log in");
@@ -2,7 +2,12 @@
 #define MAIN_WINDOW_H
 
 #include <gtkmm.h>
+#include <unordered_map>
 #include "payWindow.h"
+#include "clientWorker.h"
+
+// users changed in one update above which the filtered view is rebuilt instead of updated row by row
+#define USER_LIST_BULK_ROWS 1000
 
 using namespace Gtk;
 using namespace Glib;
@@ -87,7 +92,8 @@ public:
         serverDetailsButton.set_label("Details");
         serverDetailsButton.signal_clicked().connect([this]() {
             MessageDialog dialog(*this, "Server details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text("Server address: " + clientAction.serverAddress + "\nPort: " + clientAction.port + "\nPublic key: \n" + keyToString(clientAction.serverPublicKey, false) + "\nLast error: \n" + clientAction.error_t);
+            const ClientView &view = clientWorker().view;
+            dialog.set_secondary_text("Server address: " + view.serverAddress + "\nPort: " + view.port + "\nPublic key: \n" + view.serverPublicKey + "\nLast error: \n" + view.error);
             dialog.run();
         });
 
@@ -98,7 +104,7 @@ public:
         });
 
         filterGrid.set_column_spacing(10);
-        onlineUsersGrid.attach(filterGrid, 3, 0, 3, 1);
+        userStatusGrid.attach(filterGrid, 2, 2, 3, 1);
         Label *filterLabel = manage(new Label("Filter:"));
         filterGrid.attach(*filterLabel, 0, 0, 1, 1);
         filterLabel->set_halign(Align::ALIGN_END);
@@ -107,20 +113,65 @@ public:
         filterGrid.attach(usernameFilterEntry, 1, 0, 1, 1);
         usernameFilterEntry.set_placeholder_text("Filter by username");
         usernameFilterEntry.signal_changed().connect([this]() {
-            updateOnlineUsers();
+            filterText = usernameFilterEntry.get_text();
+            std::transform(filterText.begin(), filterText.end(), filterText.begin(), ::tolower);
+            filteredModel->refilter();
+            updateHiddenByFilter();
+        });
+
+        // the buttons act on the selected user, double clicking a user pays them too
+        filterGrid.attach(payButton, 2, 0, 1, 1);
+        payButton.set_label("Pay");
+        payButton.get_style_context()->add_class("suggested-action");
+        payButton.get_style_context()->add_class("wide-button");
+        payButton.signal_clicked().connect([this]() {
+            paySelected();
+        });
+
+        filterGrid.attach(detailsButton, 3, 0, 1, 1);
+        detailsButton.set_label("Details");
+        detailsButton.get_style_context()->add_class("wide-button");
+        detailsButton.signal_clicked().connect([this]() {
+            showSelectedDetails();
         });
 
-        // bottom part
-        scrolledWindow.add(onlineUsersGrid);
+        // bottom part, the table only draws the rows that are scrolled into view
+        scrolledWindow.add(onlineUsersView);
+        scrolledWindow.set_policy(PolicyType::POLICY_AUTOMATIC, PolicyType::POLICY_AUTOMATIC);
 
-        onlineUsersGrid.set_row_spacing(5);
-        onlineUsersGrid.set_column_spacing(10);
-        onlineUsersGrid.set_margin_top(15);
-        onlineUsersGrid.set_margin_bottom(15);
-        onlineUsersGrid.set_margin_start(15);
-        onlineUsersGrid.set_margin_end(15);
+        onlineUsersView.set_margin_top(15);
+        onlineUsersView.set_margin_bottom(15);
+        onlineUsersView.set_margin_start(15);
+        onlineUsersView.set_margin_end(15);
+
+        Pango::FontDescription tableFont;
+        tableFont.set_family("monospace");
+        tableFont.set_size(12 * PANGO_SCALE);
+        onlineUsersView.override_font(tableFont);
+
+        userStore = ListStore::create(columns);
+        attachModel();
+
+        appendColumn("Username", columns.username, 160);
+        appendColumn("Transfer Address", columns.address, 200);
+        // every column has a fixed width, so rows are measured once instead of each one being laid out
+        onlineUsersView.set_fixed_height_mode(true);
+
+        onlineUsersView.get_selection()->signal_changed().connect([this]() {
+            updateSelectionButtons();
+        });
+        onlineUsersView.signal_row_activated().connect([this](const TreeModel::Path &, TreeViewColumn *) {
+            paySelected();
+        });
+
+        mainBox.pack_start(hiddenByFilterLabel, false, false);
+        Pango::FontDescription tableHeaderFont;
+        tableHeaderFont.set_style(Pango::Style::STYLE_ITALIC);
+        hiddenByFilterLabel.set_text("Some users are hidden by the filter");
+        hiddenByFilterLabel.override_font(tableHeaderFont);
+        hiddenByFilterLabel.set_no_show_all(true);
 
-        updateOnlineUsers();
+        updateSelectionButtons();
 
         show_all_children();
     }
@@ -132,151 +183,152 @@ public:
 
         updateAll();
 
-        clientAction.statusUpdatedCallback = [this]() {
+        clientWorker().viewChangedCallback = [this]() {
             updateAll();
         };
-        clientAction.sessionEndedCallback = [this]() {
-            fetchOk = false;
-            updateAll();
-
-            MessageDialog dialog(*this, "Session ended", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text("Server has ended your session.\nPlease log in again.");
-            dialog.run();
-            logOut();
+        clientWorker().usersChangedCallback = [this](const std::vector<std::string> &names) {
+            updateOnlineUsers(names);
         };
+        // catch up with everything that changed while the window was hidden, like a login as someone else
+        std::vector<std::string> names;
+        for (const auto &user : clientWorker().view.users)
+            names.push_back(user.first);
+        for (const auto &row : rows)
+            names.push_back(row.first);
+        updateOnlineUsers(names);
+        // clientAction calls this on the worker, the dialog has to wait for the main loop
+        clientWorker().post([this]() {
+            clientAction.sessionEndedCallback = [this]() {
+                clientWorker().runOnMain([this]() {
+                    fetchOk = false;
+                    updateAll();
+
+                    MessageDialog dialog(*this, "Session ended", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
+                    dialog.set_secondary_text("Server has ended your session.\nPlease log in again.");
+                    dialog.run();
+                    logOut();
+                });
+            };
+        });
 
         signal_timeout().connect(sigc::mem_fun(*this, &MainWindow::autoRefresh), 1000);
     }
 
     bool autoRefresh() {
-        if (!clientAction.loggedIn)
+        if (!clientWorker().view.loggedIn)
             return false; // stop the loop until re-logged in and on_show is called again
-        fetchOk = clientAction.fetchServerInfo();
+        // the previous refresh is still waiting on the server, do not pile up more behind it
+        if (refreshing)
+            return true;
+        refreshing = true;
+        std::shared_ptr<bool> ok = std::make_shared<bool>(false);
+        clientWorker().post([ok]() {
+            // subscribed clients only apply what the server pushed, older servers still get polled with List
+            *ok = clientAction.subscribed ? clientAction.pollPresence() : clientAction.fetchServerInfo();
+        }, [this, ok]() {
+            refreshing = false;
+            if (*ok != fetchOk) {
+                fetchOk = *ok;
+                updateAll();
+            }
+        });
         return true;
     }
 
     void updateAll() {
         updateUserStatus();
-        updateOnlineUsers();
-        show_all_children();
+        if (fetchOk)
+            onlineUsersView.get_style_context()->remove_class("fetch_fail");
+        else
+            onlineUsersView.get_style_context()->add_class("fetch_fail");
+        updateSelectionButtons();
     }
 
     void updateUserStatus() {
-        usernameLabel.set_text(clientAction.username);
-        accountBalanceLabel.set_text(std::to_string(clientAction.accountBalance));
+        const ClientView &view = clientWorker().view;
+        usernameLabel.set_text(view.username);
+        accountBalanceLabel.set_text(std::to_string(view.accountBalance));
         if (fetchOk) {
-            serverAddressLabel.set_text("Connected to " + clientAction.serverAddress + ":" + clientAction.port);
+            serverAddressLabel.set_text("Connected to " + view.serverAddress + ":" + view.port);
             serverAddressLabel.get_style_context()->remove_class("deep_red");
         } else {
-            serverAddressLabel.set_text("Reconnecting to " + clientAction.serverAddress + ":" + clientAction.port);
+            serverAddressLabel.set_text("Reconnecting to " + view.serverAddress + ":" + view.port);
             serverAddressLabel.get_style_context()->add_class("deep_red");
         }
 
-        if (clientAction.accountBalance < 0) {
+        if (view.accountBalance < 0) {
             accountBalanceLabel.get_style_context()->add_class("deep_red");
         } else {
             accountBalanceLabel.get_style_context()->remove_class("deep_red");
         }
     }
 
-    void updateOnlineUsers() {
-        for (auto &child : onlineUsersGrid.get_children()) {
-            if (child != &filterGrid)
-                onlineUsersGrid.remove(*child);
+    // apply the users that changed to their rows, the rest of the list is left alone
+    void updateOnlineUsers(const std::vector<std::string> &names) {
+        const ClientView &view = clientWorker().view;
+        bool bulk = names.size() > USER_LIST_BULK_ROWS;
+        if (bulk)
+            detachModel();
+        for (const auto &name : names) {
+            auto user = view.users.find(name);
+            auto row = rows.find(name);
+            if (user == view.users.end()) {
+                if (row != rows.end()) {
+                    userStore->erase(row->second);
+                    rows.erase(row);
+                }
+                continue;
+            }
+            if (row == rows.end()) {
+                row = rows.emplace(name, userStore->append()).first;
+                std::string lowercase = name;
+                std::transform(lowercase.begin(), lowercase.end(), lowercase.begin(), ::tolower);
+                (*row->second)[columns.username] = name;
+                (*row->second)[columns.lowercaseUsername] = lowercase;
+            }
+            std::string address = user->second.ipAddr + ":" + user->second.p2pPort;
+            if (row->second->get_value(columns.address) != address)
+                (*row->second)[columns.address] = address;
         }
-
-        auto filteredUsers = clientAction.userAccounts;
-        std::string filter = usernameFilterEntry.get_text();
-        if (!filter.empty()) {
-            std::transform(filter.begin(), filter.end(), filter.begin(), ::tolower);
-            filteredUsers.erase(std::remove_if(filteredUsers.begin(), filteredUsers.end(), [filter](const UserAccount &user) {
-                                    std::string username = user.username;
-                                    std::transform(username.begin(), username.end(), username.begin(), ::tolower);
-                                    return username.find(filter) == std::string::npos;
-                                }),
-                                filteredUsers.end());
-        }
-
-        Pango::FontDescription tableHeaderFont;
-        tableHeaderFont.set_style(Pango::Style::STYLE_ITALIC);
-
-        Label *onlineUsernameHeader = manage(new Label("Username  "));
-        onlineUsersGrid.attach(*onlineUsernameHeader, 0, 0, 1, 1);
-        onlineUsernameHeader->override_font(tableHeaderFont);
-        onlineUsernameHeader->set_halign(Align::ALIGN_START);
-
-        Label *onlineIPHeader = manage(new Label("Transfer Address  "));
-        onlineUsersGrid.attach(*onlineIPHeader, 1, 0, 1, 1);
-        onlineIPHeader->override_font(tableHeaderFont);
-        onlineIPHeader->set_halign(Align::ALIGN_START);
-
-        onlineIPHeader->set_hexpand(true);
-
-        Pango::FontDescription tableFont;
-        tableFont.set_family("monospace");
-        tableFont.set_size(12 * PANGO_SCALE);
-
-        for (auto &user : filteredUsers) {
-            Label *usernameLabel = manage(new Label(user.username));
-            usernameLabel->set_halign(Align::ALIGN_START);
-            usernameLabel->override_font(tableFont);
-            if (!fetchOk)
-                usernameLabel->get_style_context()->add_class("fetch_fail");
-            onlineUsersGrid.attach(*usernameLabel, 0, (onlineUsersGrid.get_children().size() + 1) / 4, 1, 1);
-
-            Label *ipLabel = manage(new Label(user.ipAddr + ":" + user.p2pPort));
-            ipLabel->set_halign(Align::ALIGN_START);
-            ipLabel->override_font(tableFont);
-            if (!fetchOk)
-                ipLabel->get_style_context()->add_class("fetch_fail");
-            onlineUsersGrid.attach(*ipLabel, 1, (onlineUsersGrid.get_children().size() + 1) / 4, 1, 1);
-
-            Button *payButton = manage(new Button("Pay"));
-            if (user.username == clientAction.username)
-                payButton->set_sensitive(false);
-            else
-                payButton->get_style_context()->add_class("suggested-action");
-            payButton->get_style_context()->add_class("wide-button");
-            onlineUsersGrid.attach(*payButton, 4, (onlineUsersGrid.get_children().size() + 1) / 4, 1, 1);
-
-            payButton->signal_clicked().connect([this, user]() {
-                payWindow.payeeUsername = user.username;
-                payWindow.set_transient_for(*this);
-                payWindow.show_all();
-            });
-
-            Button *detailsButton = manage(new Button("Details"));
-            detailsButton->get_style_context()->add_class("wide-button");
-            onlineUsersGrid.attach(*detailsButton, 5, (onlineUsersGrid.get_children().size() + 1) / 4, 1, 1);
-
-            detailsButton->signal_clicked().connect([this, user]() {
-                clientAction.clientSocket.sendEncrypted(clientAction.serverPublicKey, "PKEY#" + user.username);
-                std::string response = clientAction.clientSocket.recvEncrypted(clientAction.clientPrivateKey);
-
-                MessageDialog dialog(*this, "User details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
-                dialog.set_secondary_text("IP: " + user.ipAddr + "\nPort: " + user.p2pPort + "\nPublic key: \n" + response);
-                dialog.run();
-            });
-        }
-
-        if (filteredUsers.size() != clientAction.userAccounts.size()) {
-            Label *filteredLabel = manage(new Label("Some users are hidden by the filter"));
-            filteredLabel->override_font(tableHeaderFont);
-            filteredLabel->set_halign(Align::ALIGN_CENTER);
-            onlineUsersGrid.attach(*filteredLabel, 0, (onlineUsersGrid.get_children().size() + 1) / 4, 6, 1);
-        }
-
-        show_all_children();
+        if (bulk)
+            attachModel();
+        updateHiddenByFilter();
+        updateSelectionButtons();
     }
 
     void logOut() {
-        clientAction.logOut();
-        fetchOk = false;
-        hide();
+        logOutButton.set_sensitive(false);
+        clientWorker().post([]() {
+            clientAction.logOut();
+        }, [this]() {
+            logOutButton.set_sensitive(true);
+            fetchOk = false;
+            hide();
+        });
     }
 
 private:
+    struct UserColumns : public TreeModelColumnRecord {
+        TreeModelColumn<std::string> username;
+        TreeModelColumn<std::string> lowercaseUsername; // what the filter matches, lowered once per user
+        TreeModelColumn<std::string> address;
+
+        UserColumns() {
+            add(username);
+            add(lowercaseUsername);
+            add(address);
+        }
+    };
+
+    UserColumns columns;
+    RefPtr<ListStore> userStore;
+    RefPtr<TreeModelFilter> filteredModel; // what the view shows
+    // the row of every listed user. list store rows stay valid while others are added and removed
+    std::unordered_map<std::string, TreeModel::iterator> rows;
+    std::string filterText; // lowercase
+
     bool fetchOk = false;
+    bool refreshing = false; // an autoRefresh is queued or running on the worker
 
     Box mainBox;
 
@@ -295,13 +347,78 @@ private:
     Button logOutButton;
 
     Grid filterGrid;
+    Button payButton;
+    Button detailsButton;
 
     // bottom
     ScrolledWindow scrolledWindow;
-    Grid onlineUsersGrid;
+    TreeView onlineUsersView;
     Entry usernameFilterEntry;
+    Label hiddenByFilterLabel;
 
     PayWindow payWindow;
+
+    void appendColumn(const std::string &title, const TreeModelColumn<std::string> &column, int width) {
+        TreeViewColumn *viewColumn = onlineUsersView.get_column(onlineUsersView.append_column(title, column) - 1);
+        viewColumn->set_sizing(TreeViewColumnSizing::TREE_VIEW_COLUMN_FIXED);
+        viewColumn->set_fixed_width(width);
+        viewColumn->set_resizable(true);
+    }
+
+    // the filter follows every change to the store row by row
+    void attachModel() {
+        filteredModel = TreeModelFilter::create(userStore);
+        filteredModel->set_visible_func([this](const TreeModel::const_iterator &iter) {
+            return filterText.empty() || iter->get_value(columns.lowercaseUsername).find(filterText) != std::string::npos;
+        });
+        onlineUsersView.set_model(filteredModel);
+    }
+
+    void detachModel() {
+        onlineUsersView.unset_model();
+        filteredModel.reset();
+    }
+
+    void updateHiddenByFilter() {
+        hiddenByFilterLabel.set_visible(filteredModel->children().size() != userStore->children().size());
+    }
+
+    // the selected user's name, empty if none
+    std::string selectedUsername() {
+        TreeModel::iterator selected = onlineUsersView.get_selection()->get_selected();
+        return selected ? selected->get_value(columns.username) : "";
+    }
+
+    void updateSelectionButtons() {
+        std::string selected = selectedUsername();
+        payButton.set_sensitive(!selected.empty() && selected != clientWorker().view.username);
+        detailsButton.set_sensitive(!selected.empty());
+    }
+
+    void paySelected() {
+        std::string selected = selectedUsername();
+        if (selected.empty() || selected == clientWorker().view.username)
+            return;
+        payWindow.payeeUsername = selected;
+        payWindow.set_transient_for(*this);
+        payWindow.show_all();
+    }
+
+    void showSelectedDetails() {
+        auto user = clientWorker().view.users.find(selectedUsername());
+        if (user == clientWorker().view.users.end())
+            return;
+        UserAccount account = user->second;
+        std::shared_ptr<std::string> response = std::make_shared<std::string>();
+        clientWorker().post([account, response]() {
+            const PeerKey *key = clientAction.peerKey(account.username, account.keyFingerprint);
+            *response = key ? key->pem : clientAction.error_t;
+        }, [this, account, response]() {
+            MessageDialog dialog(*this, "User details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
+            dialog.set_secondary_text("IP: " + account.ipAddr + "\nPort: " + account.p2pPort + "\nPublic key: \n" + *response);
+            dialog.run();
+        });
+    }
 };
 
 #endif // MAIN_WINDOW_H
\ No newline at end of file
@@ -2,7 +2,7 @@
 #define PAY_H
 
 #include <gtkmm.h>
-#include "../clientAction.h"
+#include "clientWorker.h"
 
 using namespace Glib;
 using namespace Gtk;
@@ -82,14 +82,7 @@ public:
             MessageDialog dialog(*this, "Payee username cannot be empty", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
             return;
         }
-        bool usernameExists = false;
-        for (auto &user : clientAction.userAccounts) {
-            if (user.username == payeeUsername) {
-                usernameExists = true;
-                break;
-            }
-        }
-        if (!usernameExists) {
+        if (!clientWorker().view.users.count(payeeUsername)) {
             payeeUsernameEntry.get_style_context()->add_class("error");
             MessageDialog dialog(*this, "Payee username not found", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
             return;
@@ -112,40 +105,58 @@ public:
         MessageDialog dialog(*this, "Confirm payment", false, MessageType::MESSAGE_QUESTION, ButtonsType::BUTTONS_OK, true);
         dialog.set_secondary_text("Are you sure you want to send " + std::to_string(amount) + " to " + payeeUsernameEntry.get_text() + "?\nThis action cannot be undone.");
         int result = dialog.run();
-        if (result == RESPONSE_OK && (clientAction.sendMicropaymentTransaction(amount, payeeUsername))) {
+        if (result != RESPONSE_OK)
+            return;
+
+        payButton.set_sensitive(false);
+        payButton.set_label("Sending...");
+        std::shared_ptr<bool> sent = std::make_shared<bool>(false);
+        std::string payee = payeeUsername;
+        clientWorker().post([sent, amount, payee]() {
+            *sent = clientAction.sendMicropaymentTransaction(amount, payee);
+        }, [this, sent]() {
+            paymentSent(*sent);
+        });
+    }
+
+    void paymentSent(bool sent) {
+        if (sent) {
             amountEntry.set_text("");
             payButton.get_style_context()->remove_class("suggested-action");
             payButton.get_style_context()->add_class("warning");
             payButton.set_label("Verifying transfer...");
             payButton.set_sensitive(false);
 
-            transferResultTimeout = 10;
-            clientAction.transferOk = false;
-
-            signal_timeout().connect_once(sigc::mem_fun(*this, &PayWindow::checkTransferResult), 250);
-            // we actually don't need to wait. we just do this to show the user that the payment is being processed
+            // the worker waits for the server's confirmation, the window keeps drawing meanwhile
+            std::shared_ptr<bool> verified = std::make_shared<bool>(false);
+            clientWorker().post([verified]() {
+                *verified = clientAction.verifyMicropaymentTransaction();
+                clientAction.transferOk = false;
+            }, [this, verified]() {
+                checkTransferResult(*verified);
+            });
         } else {
+            payButton.set_sensitive(true);
+            payButton.set_label("Pay");
             MessageDialog dialog(*this, "Failed to send payment", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            std::cerr << "Failed to send payment, error: " << clientAction.error_t << std::endl;
-            dialog.set_secondary_text(clientAction.error_t);
+            std::cerr << "Failed to send payment, error: " << clientWorker().view.error << std::endl;
+            dialog.set_secondary_text(clientWorker().view.error);
             dialog.run();
         }
     }
 
-    void checkTransferResult() {
-        if (clientAction.verifyMicropaymentTransaction()) {
+    void checkTransferResult(bool verified) {
+        if (verified) {
             payButton.get_style_context()->remove_class("warning");
             payButton.get_style_context()->add_class("success");
             payButton.set_label("Payment successful!");
-
-            clientAction.transferOk = false;
         } else {
             payButton.get_style_context()->remove_class("success");
             payButton.get_style_context()->add_class("error");
             payButton.set_label("Payment failed");
 
             MessageDialog dialog(*this, "Transfer verification failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text("Verify micropayment transaction failed. Check your balance a while later to see if the payment went through before trying again.\n" + clientAction.error_t);
+            dialog.set_secondary_text("Verify micropayment transaction failed. Check your balance a while later to see if the payment went through before trying again.\n" + clientWorker().view.error);
 
             dialog.run();
         }
@@ -164,13 +175,10 @@ public:
             payeeUsernameEntry.get_style_context()->remove_class("error");
         }
 
-        for (auto &user : clientAction.userAccounts) {
-            if (user.username == payeeUsername) {
-                payeeUsernameEntry.get_style_context()->remove_class("error");
-                break;
-            }
+        if (clientWorker().view.users.count(payeeUsername))
+            payeeUsernameEntry.get_style_context()->remove_class("error");
+        else
             payeeUsernameEntry.get_style_context()->add_class("error");
-        }
 
         if (amountEntry.get_style_context()->has_class("error") || payeeUsernameEntry.get_style_context()->has_class("error")) {
             payButton.set_sensitive(false);
@@ -192,7 +200,7 @@ public:
             if (amount.empty() || std::stoi(amount) <= 0) {
                 amountEntry.get_style_context()->remove_class("warning");
                 amountEntry.get_style_context()->add_class("error");
-            } else if (std::stoi(amount) > clientAction.accountBalance) {
+            } else if (std::stoi(amount) > clientWorker().view.accountBalance) {
                 amountEntry.get_style_context()->add_class("warning");
                 amountEntry.get_style_context()->remove_class("error");
             } else {
@@ -219,8 +227,6 @@ private:
     Entry amountEntry;
 
     Button payButton;
-
-    int transferResultTimeout = 10; // 5 seconds, 0.5s poll interval
 };
 
 #endif // PAY_H
\ No newline at end of file
@@ -2,7 +2,7 @@
 #define REGISTER_H
 
 #include <gtkmm.h>
-#include "../clientAction.h"
+#include "clientWorker.h"
 
 using namespace Glib;
 using namespace Gtk;
@@ -71,32 +71,37 @@ public:
 
         registerButton.set_sensitive(false);
         registerButton.set_label("Registering...");
-        signal_timeout().connect_once(sigc::bind(sigc::mem_fun(*this, &RegisterWindow::registerAccount), usernameEntry.get_text()), 50);
+        registerAccount(usernameEntry.get_text());
     }
 
+    // connect and register on the worker, the window stays responsive meanwhile
     void registerAccount(const std::string &username) {
-        clientAction.connectToServer(serverAddress, port);
-        if (!clientAction.clientSocket.isConnected) {
-            MessageDialog dialog(*this, "Failed to connect to server", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text(clientAction.error_t);
-            dialog.run();
+        std::shared_ptr<bool> connected = std::make_shared<bool>(false);
+        std::shared_ptr<bool> registered = std::make_shared<bool>(false);
+        std::string address = serverAddress, serverPort = port;
+        clientWorker().post([=]() {
+            clientAction.connectToServer(address, serverPort);
+            *connected = clientAction.clientSocket.isConnected;
+            if (*connected)
+                *registered = clientAction.registerAccount(username);
+        }, [this, connected, registered]() {
+            if (!*connected) {
+                MessageDialog dialog(*this, "Failed to connect to server", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
+                dialog.set_secondary_text(clientWorker().view.error);
+                dialog.run();
+            } else if (*registered) {
+                MessageDialog dialog(*this, "Registration successful", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
+                dialog.set_secondary_text("You may now log in.\n" + clientWorker().view.error);
+                dialog.run();
+                hide();
+            } else {
+                MessageDialog dialog(*this, "Registration failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
+                dialog.set_secondary_text(clientWorker().view.error);
+                dialog.run();
+            }
             registerButton.set_sensitive(true);
             registerButton.set_label("Register");
-            return;
-        }
-
-        if (clientAction.registerAccount(username)) {
-            MessageDialog dialog(*this, "Registration successful", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text("You may now log in.\n" + clientAction.error_t);
-            dialog.run();
-            hide();
-        } else {
-            MessageDialog dialog(*this, "Registration failed", false, MessageType::MESSAGE_ERROR, ButtonsType::BUTTONS_OK, true);
-            dialog.set_secondary_text(clientAction.error_t);
-            dialog.run();
-        }
-        registerButton.set_sensitive(true);
-        registerButton.set_label("Register");
+        });
     }
 
 private:
@@ -0,0 +1,174 @@
+#ifndef CRYPTO_POOL_H
+#define CRYPTO_POOL_H
+
+#include <openssl/evp.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include "mySocket.h"
+
+// RSA operations queued at most, a batch that does not fit is turned away and done by the caller
+#define CRYPTO_QUEUE_LIMIT 4096
+
+// one RSA operation on a chunk of at most one key size
+struct CryptoJob {
+    EVP_PKEY *key;      // private key to decrypt, public key to encrypt. has to outlive the job
+    bool decrypt;
+    std::string input;  // plain text to encrypt, or base64 to decrypt
+    std::string output; // base64 or plain text, empty if the operation failed
+};
+
+// a bounded pool of threads for RSA, so a private key decryption does not hold up an event loop and
+// a long reply is encrypted on several cores. jobs come in batches, the chunks of one message, which are
+// spread over the threads, and the batch's callback runs once all of them are done. every thread reuses
+// its contexts through rsaContexts like any other thread doing RSA.
+// when the queue is full submit refuses the batch, the caller does the work itself, which slows it
+// down the same way an overloaded pool would without letting the queue grow
+class CryptoPool : public ChunkEncryptor {
+public:
+    SocketObserver *observer = nullptr; // gets the queue wait and run time of every job, optional
+
+    CryptoPool(size_t queueLimit = CRYPTO_QUEUE_LIMIT) : queueLimit(queueLimit) {}
+
+    ~CryptoPool() {
+        stop();
+    }
+
+    void start(size_t threadCount) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!workers.empty())
+            return;
+        stopping = false;
+        for (size_t i = 0; i < threadCount; i++)
+            workers.emplace_back([this]() { work(); });
+        accepting = !workers.empty();
+    }
+
+    // finish the queued jobs, then end the threads. callbacks of the last batches run before this returns
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            accepting = false;
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    bool running() const {
+        return accepting;
+    }
+
+    // queue jobs, done gets them back with their outputs filled in, on a pool thread.
+    // false if the pool is stopped or has no room for the whole batch, nothing is queued then
+    bool submit(std::vector<CryptoJob> jobs, const std::function<void(std::vector<CryptoJob> &)> &done) {
+        if (jobs.empty())
+            return false;
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+        batch->jobs = std::move(jobs);
+        batch->remaining = batch->jobs.size();
+        batch->done = done;
+        batch->queued = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!accepting || queue.size() + batch->jobs.size() > queueLimit) {
+                rejected++;
+                return false;
+            }
+            for (size_t i = 0; i < batch->jobs.size(); i++)
+                queue.emplace_back(batch, i);
+        }
+        if (batch->jobs.size() == 1)
+            jobReady.notify_one();
+        else
+            jobReady.notify_all();
+        return true;
+    }
+
+    // for sockets: encrypt the chunks on the pool and wait for them
+    bool encryptChunks(EVP_PKEY *publicKey, std::vector<std::string> &chunks) override {
+        std::vector<CryptoJob> jobs;
+        for (const auto &chunk : chunks)
+            jobs.push_back(CryptoJob{publicKey, false, chunk, ""});
+        // shared, the waiting caller may return before set_value does
+        std::shared_ptr<std::promise<void>> finished = std::make_shared<std::promise<void>>();
+        std::future<void> finishedFuture = finished->get_future();
+        bool ok = submit(std::move(jobs), [&chunks, finished](std::vector<CryptoJob> &done) {
+            for (size_t i = 0; i < done.size(); i++)
+                chunks[i] = std::move(done[i].output);
+            finished->set_value();
+        });
+        if (ok)
+            finishedFuture.wait();
+        return ok;
+    }
+
+    // jobs waiting for a thread
+    size_t queueDepth() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    // batches turned away because the queue was full, since the pool was created
+    uint64_t rejectedBatches() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rejected;
+    }
+
+private:
+    struct Batch {
+        std::vector<CryptoJob> jobs;
+        std::atomic<size_t> remaining;
+        std::function<void(std::vector<CryptoJob> &)> done;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    size_t queueLimit;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::deque<std::pair<std::shared_ptr<Batch>, size_t>> queue; // a batch and the index of one of its jobs
+    std::vector<std::thread> workers;
+    std::atomic<bool> accepting{false};
+    bool stopping = false;
+    uint64_t rejected = 0;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            jobReady.wait(lock, [this]() { return !queue.empty() || stopping; });
+            if (queue.empty())
+                break; // stopping, and everything queued has run
+            std::shared_ptr<Batch> batch = queue.front().first;
+            CryptoJob &job = batch->jobs[queue.front().second];
+            queue.pop_front();
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            if (observer)
+                observer->observeStage(STAGE_CRYPTO_QUEUE, std::chrono::duration<double>(start - batch->queued).count());
+            if (job.decrypt)
+                decryptMessage(job.key, job.input, job.output);
+            else
+                encryptMessage(job.key, job.input, job.output);
+            if (observer)
+                observer->observeStage(STAGE_CRYPTO_JOB, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+            // the thread that finishes the last job of a batch hands it back
+            if (--batch->remaining == 0)
+                batch->done(batch->jobs);
+            lock.lock();
+        }
+    }
+};
+
+#endif // CRYPTO_POOL_H
@@ -8,13 +8,44 @@
 #include <openssl/bn.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <string>
+#include <cstring>
 #include <vector>
 #include <stdexcept>
 #include <fstream>
+#include <map>
+#include "base64.h"
 
 #define PUBLIC_KEY_FILE "public.pem"
 #define PRIVATE_KEY_FILE "private.pem"
+// the server's X25519 key pair, offered to clients that ask for it at HELLO. the RSA pair above stays for older clients
+#define SEALING_PUBLIC_KEY_FILE "public_x25519.pem"
+#define SEALING_PRIVATE_KEY_FILE "private_x25519.pem"
+
+#define SESSION_KEY_SIZE 32 // AES-256
+#define SESSION_IV_SIZE 12
+#define SESSION_TAG_SIZE 16
+#define RESUME_NONCE_SIZE 16 // sent with a resumption ticket to derive a fresh session key
+#define SEALING_KEY_SIZE 32  // raw X25519 public key, the ephemeral one leads every sealed message
+
+// RSA contexts a thread keeps, one per key and direction it has used recently
+#define RSA_CONTEXT_CACHE 64
+
+// public key and symmetric operations done by the calling thread, so the server can attribute crypto cost to requests
+struct CryptoOpCount {
+    uint64_t rsa = 0;
+    uint64_t aes = 0;
+    uint64_t x25519 = 0; // key agreements, a sealed message takes two to make and one to open
+};
+
+// RSA-2048 is what every key used to be. X25519 keys are generated in microseconds and are a fraction of the size,
+// and a message to one is sealed whole (see sealMessage) instead of RSA encrypted chunk by chunk
+enum KeyType {
+    KEY_RSA,
+    KEY_X25519,
+};
+thread_local CryptoOpCount cryptoOps;
 
 // check if file exists
 bool fileExists(const std::string &file) {
@@ -28,7 +59,42 @@ void handleOpenSSLError() {
     exit(EXIT_FAILURE);
 }
 
-void generateKeyPair(const std::string &privateKeyFile, const std::string &publicKeyFile) {
+// write key to the two PEM files, false if either could not be written
+bool writeKeyFiles(EVP_PKEY *key, const std::string &privateKeyFile, const std::string &publicKeyFile) {
+    FILE *privFile = fopen(privateKeyFile.c_str(), "wb");
+    bool ok = privFile && PEM_write_PrivateKey(privFile, key, NULL, NULL, 0, NULL, NULL);
+    if (privFile)
+        fclose(privFile);
+    FILE *pubFile = ok ? fopen(publicKeyFile.c_str(), "wb") : nullptr;
+    ok = pubFile && PEM_write_PUBKEY(pubFile, key);
+    if (pubFile)
+        fclose(pubFile);
+    if (!ok)
+        std::cerr << "Error saving key pair to " << privateKeyFile << " and " << publicKeyFile << std::endl;
+    return ok;
+}
+
+// a new X25519 key, nullptr on failure
+EVP_PKEY *generateX25519Key() {
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &key) <= 0) {
+        std::cerr << "Error generating X25519 key: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        key = nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+void generateKeyPair(const std::string &privateKeyFile, const std::string &publicKeyFile, KeyType type = KEY_RSA) {
+    if (type == KEY_X25519) {
+        EVP_PKEY *key = generateX25519Key();
+        if (key)
+            writeKeyFiles(key, privateKeyFile, publicKeyFile);
+        EVP_PKEY_free(key);
+        return;
+    }
+
     RSA *rsa = RSA_new();
     BIGNUM *bne = BN_new();
 
@@ -77,15 +143,15 @@ std::string loadKeyFromFile(const std::string &keyFile) {
     return key;
 }
 
-// try generate pair if not exist
-void checkKeyFiles() {
-    if (fileExists(PUBLIC_KEY_FILE) && fileExists(PRIVATE_KEY_FILE))
+// try generate pair if not exist. a pair that exists is used whatever its type, so RSA identities keep working
+void checkKeyFiles(KeyType type = KEY_RSA, const std::string &privateKeyFile = PRIVATE_KEY_FILE, const std::string &publicKeyFile = PUBLIC_KEY_FILE) {
+    if (fileExists(publicKeyFile) && fileExists(privateKeyFile))
         return;
-    std::remove(PUBLIC_KEY_FILE);
-    std::remove(PRIVATE_KEY_FILE);
-    generateKeyPair(PRIVATE_KEY_FILE, PUBLIC_KEY_FILE);
+    std::remove(publicKeyFile.c_str());
+    std::remove(privateKeyFile.c_str());
+    generateKeyPair(privateKeyFile, publicKeyFile, type);
 
-    std::cout << loadKeyFromFile(PUBLIC_KEY_FILE) << std::endl;
+    std::cout << loadKeyFromFile(publicKeyFile) << std::endl;
 }
 
 std::string keyToString(EVP_PKEY *pkey, bool isPrivate) {
@@ -115,102 +181,308 @@ EVP_PKEY *stringToKey(const std::string &keyString, bool isPrivate) {
     return pkey;
 }
 
+std::string base64Encode(const unsigned char *data, size_t size) {
+    std::string encoded;
+    base64Encode(data, size, encoded);
+    return encoded;
+}
+
 std::string base64Encode(const std::vector<unsigned char> &input) {
-    BIO *bio, *b64;
-    BUF_MEM *bufferPtr;
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
-    BIO_write(bio, input.data(), input.size());
-    BIO_flush(bio);
-    BIO_get_mem_ptr(bio, &bufferPtr);
-    std::string base64Str(bufferPtr->data, bufferPtr->length);
-    BIO_free_all(bio);
-    return base64Str;
+    return base64Encode(input.data(), input.size());
 }
 
+// empty if the input is not base64
 std::vector<unsigned char> base64Decode(const std::string &input) {
-    BIO *bio, *b64;
-    char *buffer = new char[input.size()];
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new_mem_buf(input.data(), input.size());
-    bio = BIO_push(b64, bio);
-    int decodedSize = BIO_read(bio, buffer, input.size());
-    std::vector<unsigned char> decodedData(buffer, buffer + decodedSize);
-    BIO_free_all(bio);
-    delete[] buffer;
+    std::vector<unsigned char> decodedData;
+    base64Decode(input, decodedData);
     return decodedData;
 }
 
-std::string encryptMessage(EVP_PKEY *publicKey, const std::string &message) {
-    std::cerr << "Encrypting message: " << message << std::endl;
-
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(publicKey, NULL);
+// a context set up for RSA with PKCS#1 padding, for decryption with a private key or encryption with a public one.
+// one context can be reused for any number of messages by the thread that owns it. nullptr on failure
+EVP_PKEY_CTX *newRsaContext(EVP_PKEY *key, bool decrypt) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
     if (!ctx) {
-        std::cerr << "Error creating context for encryption: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
-        return "";
+        std::cerr << "Error creating context for " << (decrypt ? "decryption: " : "encryption: ") << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return nullptr;
     }
-
-    if (EVP_PKEY_encrypt_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0) {
-        std::cerr << "Error initializing encryption or setting padding: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+    if ((decrypt ? EVP_PKEY_decrypt_init(ctx) : EVP_PKEY_encrypt_init(ctx)) <= 0 || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0) {
+        std::cerr << "Error initializing " << (decrypt ? "decryption" : "encryption") << " or setting padding: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
         EVP_PKEY_CTX_free(ctx);
-        return "";
+        return nullptr;
     }
+    return ctx;
+}
 
-    size_t outLen;
-    std::vector<unsigned char> encryptedMessage(EVP_PKEY_size(publicKey));
+// the RSA contexts of one thread by key and direction, so a message of many chunks or many messages to the
+// same key set up a context once. a context holds a reference to its key, so a key cannot be freed and its
+// address reused while it is in here. when full the cache starts over, keys seen once do not pile up
+class RsaContextCache {
+public:
+    ~RsaContextCache() {
+        clear();
+    }
 
-    if (EVP_PKEY_encrypt(ctx, encryptedMessage.data(), &outLen, reinterpret_cast<const unsigned char *>(message.c_str()), message.length()) <= 0) {
+    // nullptr if the context could not be set up
+    EVP_PKEY_CTX *get(EVP_PKEY *key, bool decrypt) {
+        auto context = contexts.find(std::make_pair(key, decrypt));
+        if (context != contexts.end())
+            return context->second;
+        EVP_PKEY_CTX *ctx = newRsaContext(key, decrypt);
+        if (!ctx)
+            return nullptr;
+        if (contexts.size() >= RSA_CONTEXT_CACHE)
+            clear();
+        contexts.emplace(std::make_pair(key, decrypt), ctx);
+        return ctx;
+    }
+
+    void clear() {
+        for (auto &context : contexts)
+            EVP_PKEY_CTX_free(context.second);
+        contexts.clear();
+    }
+
+    size_t size() const {
+        return contexts.size();
+    }
+
+private:
+    std::map<std::pair<EVP_PKEY *, bool>, EVP_PKEY_CTX *> contexts;
+};
+thread_local RsaContextCache rsaContexts;
+
+// scratch space for the binary side of RSA operations, reused by every call on the thread
+thread_local std::vector<unsigned char> rsaBuffer;
+
+// encrypt one chunk with a context from newRsaContext, writes base64 to output. false on failure
+bool encryptWithContext(EVP_PKEY_CTX *ctx, const std::string &message, std::string &output) {
+    cryptoOps.rsa++;
+    rsaBuffer.resize(EVP_PKEY_size(EVP_PKEY_CTX_get0_pkey(ctx)));
+    size_t outLen = rsaBuffer.size(); // room for the output, the call replaces it with the length written
+
+    if (EVP_PKEY_encrypt(ctx, rsaBuffer.data(), &outLen, reinterpret_cast<const unsigned char *>(message.c_str()), message.length()) <= 0) {
         std::cerr << "Encryption failed: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
-        EVP_PKEY_CTX_free(ctx);
-        return "";
+        output.clear();
+        return false;
     }
 
-    EVP_PKEY_CTX_free(ctx);
-    encryptedMessage.resize(outLen); // Adjust size to actual encrypted output
-    return base64Encode(encryptedMessage);
+    base64Encode(rsaBuffer.data(), outLen, output);
+    return true;
 }
 
-std::string decryptMessage(EVP_PKEY *privateKey, const std::string &encryptedMessage64) {
-    // std::cerr << "Raw decrypt message with length " << encryptedMessage64.size() << ": ";
-    // for (char c : encryptedMessage64) {
-    //     if (c == '\r')
-    //         std::cerr << "\\r";
-    //     else if (c == '\n')
-    //         std::cerr << "\\n";
-    //     else
-    //         std::cerr << c;
-    // }
-    // std::cerr << std::endl;
-
-    std::vector<unsigned char> encryptedMessage(base64Decode(encryptedMessage64));
-
-    // std::cerr << "Decrypting message: " << encryptedMessage64 << " with decoded size " << encryptedMessage.size() << std::endl;
-
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(privateKey, NULL);
+// decrypt one base64 chunk with a context from newRsaContext, writes the plain text to output. false on failure
+bool decryptWithContext(EVP_PKEY_CTX *ctx, const std::string &encryptedMessage64, std::string &output) {
+    if (!base64Decode(encryptedMessage64, rsaBuffer)) {
+        std::cerr << "Decryption failed: not base64" << std::endl;
+        output.clear();
+        return false;
+    }
+    cryptoOps.rsa++;
+
+    output.resize(EVP_PKEY_size(EVP_PKEY_CTX_get0_pkey(ctx)));
+    size_t outLen = output.size();
+
+    if (EVP_PKEY_decrypt(ctx, reinterpret_cast<unsigned char *>(&output[0]), &outLen, rsaBuffer.data(), rsaBuffer.size()) <= 0) {
+        std::cerr << "Decryption failed: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        output.clear();
+        return false;
+    }
+
+    output.resize(outLen); // Adjust size to actual decrypted output
+    return true;
+}
+
+std::string encryptWithContext(EVP_PKEY_CTX *ctx, const std::string &message) {
+    std::string encrypted;
+    encryptWithContext(ctx, message, encrypted);
+    return encrypted;
+}
+
+std::string decryptWithContext(EVP_PKEY_CTX *ctx, const std::string &encryptedMessage64) {
+    std::string decrypted;
+    decryptWithContext(ctx, encryptedMessage64, decrypted);
+    return decrypted;
+}
+
+// encrypt one chunk with the calling thread's context for the key, writes base64 to output. false on failure
+bool encryptMessage(EVP_PKEY *publicKey, const std::string &message, std::string &output) {
+    EVP_PKEY_CTX *ctx = rsaContexts.get(publicKey, false);
     if (!ctx) {
-        std::cerr << "Error creating context for decryption: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
-        return "";
+        output.clear();
+        return false;
     }
+    return encryptWithContext(ctx, message, output);
+}
 
-    if (EVP_PKEY_decrypt_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0) {
-        std::cerr << "Error initializing decryption or setting padding: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
-        EVP_PKEY_CTX_free(ctx);
-        return "";
+bool decryptMessage(EVP_PKEY *privateKey, const std::string &encryptedMessage64, std::string &output) {
+    EVP_PKEY_CTX *ctx = rsaContexts.get(privateKey, true);
+    if (!ctx) {
+        output.clear();
+        return false;
     }
+    return decryptWithContext(ctx, encryptedMessage64, output);
+}
+
+std::string encryptMessage(EVP_PKEY *publicKey, const std::string &message) {
+    std::string encrypted;
+    encryptMessage(publicKey, message, encrypted);
+    return encrypted;
+}
 
-    size_t outLen;
-    std::vector<unsigned char> decryptedMessage(EVP_PKEY_size(privateKey));
+std::string decryptMessage(EVP_PKEY *privateKey, const std::string &encryptedMessage64) {
+    std::string decrypted;
+    decryptMessage(privateKey, encryptedMessage64, decrypted);
+    return decrypted;
+}
 
-    if (EVP_PKEY_decrypt(ctx, decryptedMessage.data(), &outLen, encryptedMessage.data(), encryptedMessage.size()) <= 0) {
-        std::cerr << "Decryption failed: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
-        EVP_PKEY_CTX_free(ctx);
-        return "";
+std::vector<unsigned char> generateSessionKey() {
+    std::vector<unsigned char> key(SESSION_KEY_SIZE);
+    if (RAND_bytes(key.data(), key.size()) != 1) {
+        std::cerr << "Error generating session key: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return {};
     }
+    return key;
+}
 
+// the session key for a connection resumed from a ticket: HMAC-SHA256 of the client's fresh nonce under the key
+// in the ticket, so every resumed connection gets its own key even when a ticket is presented more than once
+std::vector<unsigned char> deriveSessionKey(const std::vector<unsigned char> &previousKey, const std::vector<unsigned char> &nonce) {
+    std::vector<unsigned char> key(SESSION_KEY_SIZE);
+    unsigned int keyLen = key.size();
+    if (previousKey.size() != SESSION_KEY_SIZE ||
+        !HMAC(EVP_sha256(), previousKey.data(), previousKey.size(), nonce.data(), nonce.size(), key.data(), &keyLen))
+        return {};
+    return key;
+}
+
+// AES-256-GCM encrypt message with a 32 byte key into out, which has room for iv | ciphertext | tag,
+// SESSION_IV_SIZE + message.size() + SESSION_TAG_SIZE bytes
+bool aesGcmSeal(const unsigned char *key, const std::string &message, unsigned char *out) {
+    cryptoOps.aes++;
+    unsigned char *iv = out;
+    unsigned char *ciphertext = iv + SESSION_IV_SIZE;
+    unsigned char *tag = ciphertext + message.size();
+    if (RAND_bytes(iv, SESSION_IV_SIZE) != 1) {
+        std::cerr << "Error generating IV: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return false;
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len = 0;
+    if (!ctx || EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) != 1 ||
+        EVP_EncryptUpdate(ctx, ciphertext, &len, reinterpret_cast<const unsigned char *>(message.data()), message.size()) != 1 ||
+        EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SESSION_TAG_SIZE, tag) != 1) {
+        std::cerr << "Session encryption failed: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return true;
+}
+
+// reverse of aesGcmSeal on the size bytes at sealed. false if they were tampered with or sealed with another key
+bool aesGcmOpen(const unsigned char *key, const unsigned char *sealed, size_t size, std::string &message) {
+    cryptoOps.aes++;
+    if (size < SESSION_IV_SIZE + SESSION_TAG_SIZE)
+        return false;
+    size_t ciphertextSize = size - SESSION_IV_SIZE - SESSION_TAG_SIZE;
+    const unsigned char *iv = sealed;
+    const unsigned char *ciphertext = iv + SESSION_IV_SIZE;
+    unsigned char tag[SESSION_TAG_SIZE];
+    memcpy(tag, ciphertext + ciphertextSize, SESSION_TAG_SIZE);
+
+    std::vector<unsigned char> plaintext(ciphertextSize + 1);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len = 0, finalLen = 0;
+    if (!ctx || EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) != 1 ||
+        EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext, ciphertextSize) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SESSION_TAG_SIZE, tag) != 1 ||
+        EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &finalLen) != 1) {
+        std::cerr << "Session decryption failed" << std::endl;
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    message.assign(plaintext.begin(), plaintext.begin() + len + finalLen);
+    return true;
+}
+
+// AES-256-GCM encrypt a message of any length with a session key, the result is base64(iv | ciphertext | tag)
+std::string sessionEncrypt(const std::vector<unsigned char> &key, const std::string &message) {
+    std::vector<unsigned char> sealed(SESSION_IV_SIZE + message.size() + SESSION_TAG_SIZE);
+    if (key.size() != SESSION_KEY_SIZE || !aesGcmSeal(key.data(), message, sealed.data()))
+        return "";
+    return base64Encode(sealed);
+}
+
+// reverse of sessionEncrypt. returns false if the message was tampered with or encrypted with another key
+bool sessionDecrypt(const std::vector<unsigned char> &key, const std::string &sealed64, std::string &message) {
+    std::vector<unsigned char> sealed(base64Decode(sealed64));
+    return key.size() == SESSION_KEY_SIZE && aesGcmOpen(key.data(), sealed.data(), sealed.size(), message);
+}
+
+// messages to an X25519 key are sealed instead of RSA encrypted
+bool isSealingKey(EVP_PKEY *key) {
+    return key && EVP_PKEY_id(key) == EVP_PKEY_X25519;
+}
+
+// the AES key a sealed message is encrypted with: SHA-256 of the X25519 shared secret of ours and peer, then the
+// ephemeral and the recipient's raw public keys, so the key is tied to both ends
+bool sealingKey(EVP_PKEY *ours, EVP_PKEY *peer, const unsigned char *ephemeralPublic, const unsigned char *recipientPublic, unsigned char *key) {
+    cryptoOps.x25519++;
+    unsigned char material[3 * SEALING_KEY_SIZE];
+    size_t secretLen = SEALING_KEY_SIZE;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(ours, NULL);
+    bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+              EVP_PKEY_derive(ctx, material, &secretLen) > 0 && secretLen == SEALING_KEY_SIZE;
     EVP_PKEY_CTX_free(ctx);
-    decryptedMessage.resize(outLen); // Adjust size to actual decrypted output
-    return std::string(decryptedMessage.begin(), decryptedMessage.end());
+    if (!ok) {
+        std::cerr << "X25519 key agreement failed: " << ERR_error_string(ERR_get_error(), NULL) << std::endl;
+        return false;
+    }
+    memcpy(material + SEALING_KEY_SIZE, ephemeralPublic, SEALING_KEY_SIZE);
+    memcpy(material + 2 * SEALING_KEY_SIZE, recipientPublic, SEALING_KEY_SIZE);
+    return EVP_Digest(material, sizeof(material), key, NULL, EVP_sha256(), NULL) == 1;
+}
+
+// encrypt a message of any length so only the holder of the X25519 private key can read it: a throwaway key pair
+// agrees on an AES-256-GCM key with publicKey. writes base64(ephemeral public key | iv | ciphertext | tag) to output
+bool sealMessage(EVP_PKEY *publicKey, const std::string &message, std::string &output) {
+    output.clear();
+    std::vector<unsigned char> sealed(SEALING_KEY_SIZE + SESSION_IV_SIZE + message.size() + SESSION_TAG_SIZE);
+    unsigned char recipientPublic[SEALING_KEY_SIZE], key[SESSION_KEY_SIZE];
+    size_t ephemeralLen = SEALING_KEY_SIZE, recipientLen = SEALING_KEY_SIZE;
+    if (!isSealingKey(publicKey) || EVP_PKEY_get_raw_public_key(publicKey, recipientPublic, &recipientLen) != 1)
+        return false;
+    EVP_PKEY *ephemeral = generateX25519Key();
+    bool ok = ephemeral && EVP_PKEY_get_raw_public_key(ephemeral, sealed.data(), &ephemeralLen) == 1 &&
+              sealingKey(ephemeral, publicKey, sealed.data(), recipientPublic, key) &&
+              aesGcmSeal(key, message, sealed.data() + SEALING_KEY_SIZE);
+    cryptoOps.x25519 += ephemeral != nullptr; // making the throwaway key is a scalar multiplication too
+    EVP_PKEY_free(ephemeral);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (ok)
+        base64Encode(sealed.data(), sealed.size(), output);
+    return ok;
+}
+
+// reverse of sealMessage with the recipient's private key. false if it was sealed for another key or tampered with
+bool openSealed(EVP_PKEY *privateKey, const std::string &sealed64, std::string &output) {
+    output.clear();
+    std::vector<unsigned char> sealed;
+    unsigned char recipientPublic[SEALING_KEY_SIZE], key[SESSION_KEY_SIZE];
+    size_t recipientLen = SEALING_KEY_SIZE;
+    if (!isSealingKey(privateKey) || !base64Decode(sealed64, sealed) || sealed.size() < SEALING_KEY_SIZE ||
+        EVP_PKEY_get_raw_public_key(privateKey, recipientPublic, &recipientLen) != 1)
+        return false;
+    EVP_PKEY *ephemeral = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, sealed.data(), SEALING_KEY_SIZE);
+    bool ok = ephemeral && sealingKey(privateKey, ephemeral, sealed.data(), recipientPublic, key) &&
+              aesGcmOpen(key, sealed.data() + SEALING_KEY_SIZE, sealed.size() - SEALING_KEY_SIZE, output);
+    EVP_PKEY_free(ephemeral);
+    OPENSSL_cleanse(key, sizeof(key));
+    return ok;
 }
 
 #endif // ENCRYPTION_H
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef KEY_CACHE_H
+#define KEY_CACHE_H
+
+#include <openssl/evp.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "encryption.h"
+
+// a parsed public key, freed when the last owner lets go of it
+typedef std::shared_ptr<EVP_PKEY> SharedKey;
+
+// hex SHA-256 of a PEM public key, identifies a key without parsing it
+std::string keyFingerprint(const std::string &pem) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+    if (!EVP_Digest(pem.data(), pem.size(), digest, &digestLen, EVP_sha256(), nullptr))
+        return "";
+    static const char hex[] = "0123456789abcdef";
+    std::string fingerprint;
+    for (unsigned int i = 0; i < digestLen; i++) {
+        fingerprint += hex[digest[i] >> 4];
+        fingerprint += hex[digest[i] & 0xf];
+    }
+    return fingerprint;
+}
+
+// parsed public keys by fingerprint, so each PEM goes through a BIO once instead of once per message.
+// the cache keeps up to capacity keys alive. when it is full, keys nobody else holds any more are dropped
+class KeyCache {
+public:
+    size_t capacity;
+    uint64_t hits = 0;   // lookups answered without parsing
+    uint64_t misses = 0; // PEMs parsed
+
+    KeyCache(size_t capacity = 4096) : capacity(capacity) {}
+
+    // the parsed key for a PEM public key, nullptr if it does not parse
+    SharedKey get(const std::string &pem) {
+        return get(pem, keyFingerprint(pem));
+    }
+
+    // same, for a caller that already has the fingerprint
+    SharedKey get(const std::string &pem, const std::string &fingerprint) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto cached = keys.find(fingerprint);
+            if (cached != keys.end()) {
+                hits++;
+                return cached->second;
+            }
+        }
+
+        // parse outside the lock, two threads racing on the same new key both parse and one copy wins
+        SharedKey key(stringToKey(pem, false), EVP_PKEY_free);
+        if (!key)
+            return key;
+        std::lock_guard<std::mutex> lock(mutex);
+        misses++;
+        if (keys.size() >= capacity)
+            evictUnused();
+        if (keys.size() < capacity)
+            return keys.emplace(fingerprint, key).first->second;
+        return key;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return keys.size();
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, SharedKey> keys;
+
+    void evictUnused() {
+        for (auto entry = keys.begin(); entry != keys.end();) {
+            if (entry->second.use_count() == 1)
+                entry = keys.erase(entry);
+            else
+                entry++;
+        }
+    }
+};
+
+// a public key in a KeyStore
+typedef uint32_t KeyId;
+const KeyId NO_KEY = UINT32_MAX;
+
+// the public keys of logged in users, each distinct PEM kept once with its fingerprint and parsed key and
+// shared by every session that logged in with it. sessions hold a KeyId, and the entry is freed and its id
+// reused once the last of them releases it. not locked, the server guards it with stateMutex like onlineUsers
+class KeyStore {
+public:
+    KeyStore(KeyCache &cache) : cache(cache) {}
+
+    // a reference to the key for pem, NO_KEY if it does not parse. every acquire needs a release
+    KeyId acquire(const std::string &pem) {
+        std::string fingerprint = keyFingerprint(pem);
+        auto existing = byFingerprint.find(fingerprint);
+        if (existing != byFingerprint.end()) {
+            entries[existing->second].references++;
+            return existing->second;
+        }
+        SharedKey parsed = cache.get(pem, fingerprint);
+        if (!parsed)
+            return NO_KEY;
+        KeyId id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+        } else {
+            id = entries.size();
+            entries.emplace_back();
+        }
+        entries[id] = Entry{pem, fingerprint, parsed, 1};
+        byFingerprint.emplace(fingerprint, id);
+        return id;
+    }
+
+    void release(KeyId id) {
+        if (id == NO_KEY || --entries[id].references > 0)
+            return;
+        byFingerprint.erase(entries[id].fingerprint);
+        entries[id] = Entry();
+        freeIds.push_back(id);
+    }
+
+    const std::string &pem(KeyId id) const {
+        return id == NO_KEY ? empty : entries[id].pem;
+    }
+
+    const std::string &fingerprint(KeyId id) const {
+        return id == NO_KEY ? empty : entries[id].fingerprint;
+    }
+
+    // nullptr for NO_KEY. copy the SharedKey to use the key after the lock is released
+    const SharedKey &parsed(KeyId id) const {
+        return id == NO_KEY ? none : entries[id].parsed;
+    }
+
+    // distinct keys held
+    size_t size() const {
+        return byFingerprint.size();
+    }
+
+private:
+    struct Entry {
+        std::string pem;
+        std::string fingerprint;
+        SharedKey parsed;
+        uint32_t references;
+    };
+
+    KeyCache &cache;
+    std::vector<Entry> entries; // by id
+    std::vector<KeyId> freeIds;
+    std::unordered_map<std::string, KeyId> byFingerprint;
+    const std::string empty;
+    const SharedKey none;
+};
+
+#endif // KEY_CACHE_H
@@ -0,0 +1,260 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include "mySocket.h"
+
+#define LEDGER_FILE "ledger.log"
+
+// append-only write-ahead log of every balance change, one record per line, fields separated by '#'
+// like the protocol messages:
+//   REGISTER#<username>#<initial balance>
+//   TRANSFER#<payer>#<amount>#<payee>
+// appends are group committed: a flusher thread writes and fdatasyncs everything queued as one batch,
+// so many transfers share one disk flush. with batchWindowUs = 0 a batch is whatever queued up during
+// the previous flush, a larger window waits that long for more records to join each batch.
+// a failed write is final: the file is cut back to the last commit and nothing more is written
+class Ledger {
+public:
+    std::string error_t;
+    int batchWindowUs = 0;
+
+    uint64_t commitCount = 0; // number of fdatasyncs so far
+    uint64_t recordCount = 0; // number of records made durable so far
+
+    // open (or create) the ledger file, call replay before appending
+    bool open(const std::string &path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            error_t = "Failed to open ledger " + path + "\n" + strerror(errno);
+            return false;
+        }
+        this->path = path;
+        return true;
+    }
+
+    // feed every complete record from byte offset from on to apply in order, then start accepting appends.
+    // a torn last line (the server died mid-write) is cut off the file
+    bool replay(const std::function<void(const std::vector<std::string> &)> &apply, size_t *replayed = nullptr, uint64_t from = 0) {
+        uint64_t completeBytes = readRecords(path, from, 0, apply, replayed);
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > completeBytes) {
+            std::cerr << "\033[33mLedger has a torn record at byte " << completeBytes << ", truncating\033[0m" << std::endl;
+            if (ftruncate(fd, completeBytes) == -1) {
+                error_t = "Failed to truncate ledger\n" + std::string(strerror(errno));
+                return false;
+            }
+        }
+        durableBytes = completeBytes;
+
+        stopping = false;
+        flusher = std::thread([this]() { flushLoop(); });
+        return true;
+    }
+
+    // feed the complete records between byte offsets from and to (0 for the end of the file) to apply,
+    // returns the offset after the last one. safe while the ledger is appended to, up to durableOffset()
+    static uint64_t readRecords(const std::string &path, uint64_t from, uint64_t to,
+                                const std::function<void(const std::vector<std::string> &)> &apply, size_t *count = nullptr) {
+        std::ifstream file(path, std::ios::binary);
+        file.seekg(from);
+        std::string line;
+        uint64_t completeBytes = from;
+        size_t records = 0;
+        while ((to == 0 || completeBytes < to) && std::getline(file, line)) {
+            if (file.eof())
+                break; // no trailing newline, the record never fully made it to disk
+            completeBytes += line.size() + 1;
+            if (line.empty())
+                continue;
+            apply(split(line, '#'));
+            records++;
+        }
+        if (count)
+            *count = records;
+        return completeBytes;
+    }
+
+    // bytes of the file that hold committed records
+    uint64_t durableOffset() const {
+        return durableBytes;
+    }
+
+    // a write or flush failed. appends are refused from then on
+    bool hasFailed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed;
+    }
+
+    // current size of the file, before replay it may end in a torn record
+    uint64_t fileSize() const {
+        struct stat st;
+        return fstat(fd, &st) == 0 ? st.st_size : 0;
+    }
+
+    // whether field can go into a record as it is: not empty, no '#' and no line break or other control character,
+    // any of which would change what the record says when it is read back
+    static bool validField(const std::string &field) {
+        if (field.empty())
+            return false;
+        for (unsigned char c : field) {
+            if (c == '#' || c < 0x20 || c == 0x7f)
+                return false;
+        }
+        return true;
+    }
+
+    // queue a record for the next group commit and return its sequence number.
+    // onDurable is called on the flusher thread once the record is on disk (or the write failed).
+    // a record with a control character in it, or any record once the ledger has failed, is refused: it gets
+    // sequence number 0, which waitDurable reports as failed, and onDurable(false) on the calling thread
+    uint64_t append(const std::string &record, std::function<void(bool)> onDurable = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool refused = failed || record.empty();
+        for (unsigned char c : record)
+            refused = refused || c < 0x20 || c == 0x7f;
+        if (refused) {
+            lock.unlock();
+            if (onDurable)
+                onDurable(false);
+            return 0;
+        }
+        pending += record;
+        pending += '\n';
+        if (onDurable)
+            pendingCallbacks.push_back(onDurable);
+        uint64_t seq = ++appendedSeq;
+        flushNeeded.notify_one();
+        return seq;
+    }
+
+    // block until the record with the given sequence number is on disk. false if the ledger failed or refused it
+    bool waitDurable(uint64_t seq) {
+        if (seq == 0)
+            return false;
+        std::unique_lock<std::mutex> lock(mutex);
+        flushed.wait(lock, [this, seq]() { return durableSeq >= seq || failed; });
+        return !failed;
+    }
+
+    // flush everything still queued and stop the flusher thread
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            flushNeeded.notify_one();
+        }
+        if (flusher.joinable())
+            flusher.join();
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+    }
+
+    ~Ledger() {
+        close();
+    }
+
+private:
+    int fd = -1;
+    std::string path;
+
+    std::mutex mutex;
+    std::condition_variable flushNeeded;
+    std::condition_variable flushed;
+    std::thread flusher;
+    bool stopping = true;
+    bool failed = false;
+
+    std::string pending; // records queued since the last commit
+    std::vector<std::function<void(bool)>> pendingCallbacks;
+    uint64_t appendedSeq = 0;
+    uint64_t durableSeq = 0;
+    std::atomic<uint64_t> durableBytes{0};
+
+    void flushLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            flushNeeded.wait(lock, [this]() { return !pending.empty() || stopping; });
+            if (pending.empty())
+                break; // stopping with nothing left to write
+
+            if (batchWindowUs > 0 && !stopping) {
+                // give other connections a moment to join this commit
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::microseconds(batchWindowUs));
+                lock.lock();
+            }
+
+            std::string batch;
+            batch.swap(pending);
+            std::vector<std::function<void(bool)>> callbacks;
+            callbacks.swap(pendingCallbacks);
+            uint64_t batchSeq = appendedSeq;
+            uint64_t batchRecords = batchSeq - durableSeq;
+            lock.unlock();
+
+            bool ok = writeAll(batch) && fdatasync(fd) == 0;
+            int writeErrno = errno;
+
+            lock.lock();
+            commitCount++;
+            if (ok) {
+                durableSeq = batchSeq;
+                durableBytes += batch.size();
+                recordCount += batchRecords;
+            } else {
+                failed = true;
+                error_t = "Failed to write ledger\n" + std::string(strerror(writeErrno));
+                // whatever part of the batch reached the file was reported as failed, so it must not be replayed
+                // on restart. cut the file back to the last commit, the way a torn record is cut off
+                if (ftruncate(fd, durableBytes) == -1)
+                    error_t += "\nFailed to cut the ledger back to byte " + std::to_string(durableBytes) + ": " + strerror(errno);
+                std::cerr << "\033[31m" << error_t << "\033[0m" << std::endl;
+                // the records queued meanwhile fail with this batch, append refuses any more
+                pending.clear();
+                callbacks.insert(callbacks.end(), pendingCallbacks.begin(), pendingCallbacks.end());
+                pendingCallbacks.clear();
+            }
+            flushed.notify_all();
+
+            lock.unlock();
+            for (auto &callback : callbacks)
+                callback(ok);
+            lock.lock();
+            if (failed)
+                break;
+        }
+    }
+
+    bool writeAll(const std::string &data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+};
+
+#endif // LEDGER_H
@@ -0,0 +1,242 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <iomanip>
+#include "clientAction.h"
+
+// headless load generator: simulates many users against a running server with the same ClientAction the GUI uses
+// args: <host> <port> [-u users] [-d seconds] [-m mix] [-j json file] [-v]
+//   -u  number of concurrent users, each one has its own connection (default 10)
+//   -d  how long every user keeps sending requests after logging in (default 10)
+//   -m  weights of the commands each user picks from (default hello=1,list=4,pkey=2,transfer=1)
+//   -j  also write the results as JSON to this file, "-" for stdout
+//   -v  keep the client's debug output
+// every user connects (HELLO), registers a fresh account and logs in, then loops over random commands.
+// a transfer is timed from sending the payment to the payee until the server confirms it to us.
+// a reconnect drops the connection and times connecting and logging in again, resumed from a ticket if the server gave one
+
+using loadClock = std::chrono::steady_clock;
+
+const std::vector<std::string> commandNames = {"HELLO", "REGISTER", "LOGIN", "List", "PKEY", "Transfer", "Reconnect"};
+enum Command { HELLO, REGISTER, LOGIN, LIST, PKEY, TRANSFER, RECONNECT, COMMAND_COUNT };
+
+struct CommandStats {
+    std::vector<double> latencies; // milliseconds, successful requests only
+    uint64_t errors = 0;
+};
+
+double percentile(std::vector<double> &samples, double p) {
+    if (samples.empty())
+        return 0;
+    size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// parse "hello=1,list=4" into weights per command, false on an unknown command
+bool parseMix(const std::string &mix, std::vector<int> &weights) {
+    weights.assign(COMMAND_COUNT, 0);
+    for (const std::string &entry : split(mix, ',')) {
+        std::vector<std::string> parts = split(entry, '=');
+        if (parts.size() != 2)
+            return false;
+        std::string name = parts[0];
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        int command = -1;
+        for (int i = 0; i < COMMAND_COUNT; i++) {
+            std::string known = commandNames[i];
+            std::transform(known.begin(), known.end(), known.begin(), ::tolower);
+            if (known == name)
+                command = i;
+        }
+        if (command == -1 || command == REGISTER || command == LOGIN)
+            return false; // every user registers and logs in exactly once
+        try {
+            weights[command] = std::stoi(parts[1]);
+        } catch (const std::exception &e) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// one simulated user, runs on its own thread
+void runUser(int id, const std::string &host, const std::string &port, const std::string &runTag, const std::vector<int> &weights,
+             int seconds, int userCount, std::vector<CommandStats> &stats) {
+    ClientAction client(false);
+    client.statusUpdatedCallback = []() {};
+    client.sessionEndedCallback = []() {};
+
+    auto timed = [&stats](Command command, const std::function<bool()> &request) {
+        auto start = loadClock::now();
+        bool ok = request();
+        if (ok)
+            stats[command].latencies.push_back(std::chrono::duration<double, std::milli>(loadClock::now() - start).count());
+        else
+            stats[command].errors++;
+        return ok;
+    };
+
+    std::string username = "load" + runTag + "_" + std::to_string(id);
+    if (!timed(HELLO, [&]() { return client.connectToServer(host, port) && client.serverPublicKey != nullptr; }))
+        return;
+    if (!timed(REGISTER, [&]() { return client.registerAccount(username); }))
+        return;
+    if (!timed(LOGIN, [&]() { return client.logIn(username, "0"); }))
+        return;
+
+    std::mt19937 gen(id);
+    std::discrete_distribution<int> pickCommand(weights.begin(), weights.end());
+    std::uniform_int_distribution<int> pickUser(0, std::max(userCount - 1, 0));
+    auto deadline = loadClock::now() + std::chrono::seconds(seconds);
+    while (loadClock::now() < deadline && client.clientSocket.isConnected) {
+        // someone else to look up or pay, other users may not have logged in yet
+        std::string other = "load" + runTag + "_" + std::to_string(pickUser(gen));
+        Command command = static_cast<Command>(pickCommand(gen));
+        switch (command) {
+        case HELLO:
+            timed(HELLO, [&]() { return client.awaitReply(client.requestAsync("HELLO", false)).find("-----END PUBLIC KEY-----") != std::string::npos; });
+            break;
+        case LIST:
+            timed(LIST, [&]() { return client.fetchServerInfo(); });
+            break;
+        case PKEY:
+            timed(PKEY, [&]() {
+                std::string response = client.request("PKEY#" + other);
+                return response.find("-----END PUBLIC KEY-----") != std::string::npos || response.substr(0, 3) == "240";
+            });
+            break;
+        case TRANSFER:
+            if (other == username)
+                break;
+            timed(TRANSFER, [&]() { return client.sendMicropaymentTransaction(1, other) && client.verifyMicropaymentTransaction(); });
+            break;
+        case RECONNECT:
+            client.dropConnection();
+            client.logOut();
+            timed(RECONNECT, [&]() { return client.connectToServer(host, port) && client.logIn(username, "0"); });
+            break;
+        default:
+            break;
+        }
+    }
+    client.logOut();
+    client.quitApp();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "args: <host> <port> [-u users] [-d seconds] [-m mix] [-j json file] [-v]" << std::endl;
+        return 1;
+    }
+    std::string host = argv[1], port = argv[2];
+    int userCount = 10, seconds = 10;
+    std::string mix = "hello=1,list=4,pkey=2,transfer=1";
+    std::string jsonFile;
+    bool verbose = false;
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "-u")
+                userCount = std::stoi(value);
+            else if (arg == "-d")
+                seconds = std::stoi(value);
+            else if (arg == "-m")
+                mix = value;
+            else if (arg == "-j")
+                jsonFile = value;
+            else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+            return 1;
+        }
+    }
+    std::vector<int> weights;
+    if (!parseMix(mix, weights)) {
+        std::cerr << "Invalid command mix: " << mix << "\nCommands: hello, list, pkey, transfer, reconnect" << std::endl;
+        return 1;
+    }
+
+    // the client logs every message, which would cost more than the requests themselves
+    std::streambuf *coutBuffer = std::cout.rdbuf();
+    std::streambuf *cerrBuffer = std::cerr.rdbuf();
+    if (!verbose) {
+        std::cout.rdbuf(nullptr);
+        std::cerr.rdbuf(nullptr);
+    }
+
+    // usernames are unique per run, so the generator can be pointed at the same server again
+    std::string runTag = std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() % 100000);
+
+    std::vector<std::vector<CommandStats>> userStats(userCount, std::vector<CommandStats>(COMMAND_COUNT));
+    std::vector<std::thread> users;
+    auto start = loadClock::now();
+    for (int i = 0; i < userCount; i++)
+        users.emplace_back(runUser, i, host, port, runTag, std::cref(weights), seconds, userCount, std::ref(userStats[i]));
+    for (auto &user : users)
+        user.join();
+    double elapsed = std::chrono::duration<double>(loadClock::now() - start).count();
+    std::cout.rdbuf(coutBuffer);
+    std::cerr.rdbuf(cerrBuffer);
+    std::cout.clear();
+    std::cerr.clear();
+
+    std::vector<CommandStats> totals(COMMAND_COUNT);
+    for (auto &stats : userStats) {
+        for (int c = 0; c < COMMAND_COUNT; c++) {
+            totals[c].latencies.insert(totals[c].latencies.end(), stats[c].latencies.begin(), stats[c].latencies.end());
+            totals[c].errors += stats[c].errors;
+        }
+    }
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3) << "{\"users\":" << userCount << ",\"seconds\":" << elapsed << ",\"commands\":{";
+    std::cout << userCount << " users, " << std::fixed << std::setprecision(1) << elapsed << " s" << std::endl;
+    std::cout << std::left << std::setw(10) << "command" << std::setw(10) << "count" << std::setw(8) << "errors" << std::setw(12) << "req/s"
+              << std::setw(10) << "p50 (ms)" << std::setw(10) << "p99 (ms)" << "p999 (ms)" << std::endl;
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+        CommandStats &stats = totals[c];
+        if (stats.latencies.empty() && stats.errors == 0)
+            continue;
+        double throughput = stats.latencies.size() / elapsed;
+        double p50 = percentile(stats.latencies, 0.50), p99 = percentile(stats.latencies, 0.99), p999 = percentile(stats.latencies, 0.999);
+        std::cout << std::left << std::setw(10) << commandNames[c] << std::setw(10) << stats.latencies.size() << std::setw(8) << stats.errors
+                  << std::setprecision(1) << std::setw(12) << throughput << std::setprecision(2) << std::setw(10) << p50 << std::setw(10) << p99
+                  << p999 << std::endl;
+        if (json.str().back() != '{')
+            json << ",";
+        json << "\"" << commandNames[c] << "\":{\"count\":" << stats.latencies.size() << ",\"errors\":" << stats.errors
+             << ",\"throughput\":" << throughput << ",\"p50_ms\":" << p50 << ",\"p99_ms\":" << p99 << ",\"p999_ms\":" << p999 << "}";
+    }
+    json << "}}";
+
+    if (jsonFile == "-") {
+        std::cout << json.str() << std::endl;
+    } else if (!jsonFile.empty()) {
+        std::ofstream out(jsonFile);
+        out << json.str() << std::endl;
+        if (!out) {
+            std::cerr << "Failed to write " << jsonFile << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef LOCAL_KEYSTORE_H
+#define LOCAL_KEYSTORE_H
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "encryption.h"
+
+// this process's own key pair, read and parsed once and shared by every ClientAction in it.
+// prepare loads it, or generates it if the files are missing, on a background thread and returns at once,
+// so the first window can show meanwhile. only the first use of the key waits for that to finish
+class LocalKeystore {
+public:
+    std::string error_t; // set once the key pair failed to load, read it after privateKey returned nullptr
+
+    LocalKeystore(KeyType type = KEY_X25519, const std::string &privateKeyFile = PRIVATE_KEY_FILE, const std::string &publicKeyFile = PUBLIC_KEY_FILE)
+        : type(type), privateKeyFile(privateKeyFile), publicKeyFile(publicKeyFile) {
+        // OpenSSL registers its cleanup at exit when it is first set up, and objects constructed before that are
+        // destroyed after it. set it up here rather than on the loader thread, the global ClientAction logs out
+        // from its destructor
+        OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, nullptr);
+    }
+
+    // the key is not freed, this runs at exit and a ClientAction being torn down may still use it
+    ~LocalKeystore() {
+        if (loader.joinable())
+            loader.join();
+    }
+
+    // start loading the key pair in the background, does nothing if that has already started
+    void prepare() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (started)
+            return;
+        started = true;
+        loader = std::thread([this]() { load(); });
+    }
+
+    // the key pair has been loaded, or failed to
+    bool ready() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done;
+    }
+
+    // the private key, waits for the key pair to load. nullptr if there is no usable key.
+    // owned by the keystore and valid for as long as the process runs
+    EVP_PKEY *privateKey() {
+        wait();
+        return key;
+    }
+
+    // the public key in PEM, as it is sent with LOGIN. waits for the key pair to load
+    const std::string &publicKeyPem() {
+        wait();
+        return publicPem;
+    }
+
+private:
+    KeyType type;
+    std::string privateKeyFile;
+    std::string publicKeyFile;
+
+    std::mutex mutex;
+    std::condition_variable loaded;
+    std::thread loader;
+    bool started = false;
+    bool done = false;
+    // written once by the loader before done is set, read only after
+    EVP_PKEY *key = nullptr;
+    std::string publicPem;
+
+    void wait() {
+        prepare();
+        std::unique_lock<std::mutex> lock(mutex);
+        loaded.wait(lock, [this]() { return done; });
+    }
+
+    void load() {
+        checkKeyFiles(type, privateKeyFile, publicKeyFile);
+        EVP_PKEY *parsed = stringToKey(loadKeyFromFile(privateKeyFile), true);
+        std::string pem = loadKeyFromFile(publicKeyFile);
+        std::lock_guard<std::mutex> lock(mutex);
+        key = parsed;
+        publicPem = pem;
+        if (!key || publicPem.empty())
+            error_t = "Failed to load the key pair from " + privateKeyFile + " and " + publicKeyFile;
+        done = true;
+        loaded.notify_all();
+    }
+};
+
+// the keystore every ClientAction shares
+LocalKeystore &localKeystore() {
+    static LocalKeystore keystore;
+    return keystore;
+}
+
+#endif // LOCAL_KEYSTORE_H
@@ -0,0 +1,244 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <functional>
+#include "mySocket.h"
+
+// the requests the server counts separately
+enum MetricsCommand {
+    COMMAND_HELLO,
+    COMMAND_REGISTER,
+    COMMAND_LOGIN,
+    COMMAND_LIST,
+    COMMAND_PKEY,
+    COMMAND_TRANSFER,
+    COMMAND_BATCH,
+    COMMAND_SESSION,
+    COMMAND_SUBSCRIBE,
+    COMMAND_EXIT,
+    COMMAND_TICKET,
+    COMMAND_RESUME,
+    COMMAND_OTHER,
+    METRICS_COMMAND_COUNT,
+};
+
+const char *const metricsCommandNames[METRICS_COMMAND_COUNT] = {"HELLO", "REGISTER", "LOGIN", "List", "PKEY", "transfer", "BATCH", "SESSION", "SUBSCRIBE", "Exit", "TICKET", "RESUME", "other"};
+
+// the socket and crypto pool stages plus the time spent handling a request, which includes encrypting and sending the reply
+#define STAGE_HANDLE (STAGE_CRYPTO_JOB + 1)
+#define METRICS_STAGE_COUNT (STAGE_HANDLE + 1)
+const char *const metricsStageNames[METRICS_STAGE_COUNT] = {"recv", "decrypt", "encrypt", "send", "crypto_queue", "crypto_job", "handle"};
+
+// histogram bucket upper bounds in seconds, the last bucket is +Inf
+const double metricsBuckets[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5};
+#define METRICS_BUCKET_COUNT (sizeof(metricsBuckets) / sizeof(metricsBuckets[0]))
+
+// the counters of one thread. only that thread writes them, so an increment is a plain load and store
+// (no locked instruction), and the scrape reads them with relaxed loads
+struct ThreadMetrics {
+    std::atomic<uint64_t> requests[METRICS_COMMAND_COUNT];
+    std::atomic<uint64_t> errors[METRICS_COMMAND_COUNT];
+    std::atomic<uint64_t> stageBuckets[METRICS_STAGE_COUNT][METRICS_BUCKET_COUNT + 1];
+    std::atomic<uint64_t> stageNanos[METRICS_STAGE_COUNT];
+    std::atomic<uint64_t> rsaOps;
+    std::atomic<uint64_t> aesOps;
+    std::atomic<uint64_t> x25519Ops;
+};
+
+// server metrics, exposed in the Prometheus text format on a local port.
+// every thread that records something gets its own ThreadMetrics, they are only summed up on scrape.
+// there is one Metrics per process, the per-thread blocks are found through a thread_local pointer
+class Metrics : public SocketObserver {
+public:
+    std::string error_t;
+    // extra lines appended to every scrape, for gauges that are cheaper to read than to keep up to date
+    std::function<std::string()> gaugesCallback;
+
+    void countRequest(MetricsCommand command, bool failed) {
+        ThreadMetrics &local = threadMetrics();
+        bump(local.requests[command]);
+        if (failed)
+            bump(local.errors[command]);
+    }
+
+    void countCrypto(uint64_t rsaOps, uint64_t aesOps, uint64_t x25519Ops = 0) {
+        ThreadMetrics &local = threadMetrics();
+        bump(local.rsaOps, rsaOps);
+        bump(local.aesOps, aesOps);
+        bump(local.x25519Ops, x25519Ops);
+    }
+
+    void observeStage(SocketStage stage, double seconds) override {
+        observe(stage, seconds);
+    }
+
+    void observe(int stage, double seconds) {
+        ThreadMetrics &local = threadMetrics();
+        size_t bucket = 0;
+        while (bucket < METRICS_BUCKET_COUNT && seconds > metricsBuckets[bucket])
+            bucket++;
+        bump(local.stageBuckets[stage][bucket]);
+        bump(local.stageNanos[stage], (uint64_t)(seconds * 1e9));
+    }
+
+    // totals over all threads, for the shutdown summary
+    uint64_t totalRequests() {
+        uint64_t total = 0;
+        forEachThread([&total](const ThreadMetrics &metrics) {
+            for (int c = 0; c < METRICS_COMMAND_COUNT; c++)
+                total += metrics.requests[c].load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+    uint64_t totalCrypto(bool rsa) {
+        uint64_t total = 0;
+        forEachThread([&total, rsa](const ThreadMetrics &metrics) {
+            total += (rsa ? metrics.rsaOps : metrics.aesOps).load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+    // the whole scrape in the Prometheus text format
+    std::string render() {
+        std::vector<uint64_t> requests(METRICS_COMMAND_COUNT), errors(METRICS_COMMAND_COUNT);
+        std::vector<std::vector<uint64_t>> buckets(METRICS_STAGE_COUNT, std::vector<uint64_t>(METRICS_BUCKET_COUNT + 1));
+        std::vector<uint64_t> nanos(METRICS_STAGE_COUNT);
+        uint64_t rsaOps = 0, aesOps = 0, x25519Ops = 0;
+        forEachThread([&](const ThreadMetrics &metrics) {
+            for (int c = 0; c < METRICS_COMMAND_COUNT; c++) {
+                requests[c] += metrics.requests[c].load(std::memory_order_relaxed);
+                errors[c] += metrics.errors[c].load(std::memory_order_relaxed);
+            }
+            for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+                for (size_t b = 0; b <= METRICS_BUCKET_COUNT; b++)
+                    buckets[s][b] += metrics.stageBuckets[s][b].load(std::memory_order_relaxed);
+                nanos[s] += metrics.stageNanos[s].load(std::memory_order_relaxed);
+            }
+            rsaOps += metrics.rsaOps.load(std::memory_order_relaxed);
+            aesOps += metrics.aesOps.load(std::memory_order_relaxed);
+            x25519Ops += metrics.x25519Ops.load(std::memory_order_relaxed);
+        });
+
+        std::ostringstream out;
+        out << "# HELP p2ppay_requests_total Requests handled, by command.\n# TYPE p2ppay_requests_total counter\n";
+        for (int c = 0; c < METRICS_COMMAND_COUNT; c++)
+            out << "p2ppay_requests_total{command=\"" << metricsCommandNames[c] << "\"} " << requests[c] << "\n";
+        out << "# HELP p2ppay_request_errors_total Requests that were rejected or failed, by command.\n# TYPE p2ppay_request_errors_total counter\n";
+        for (int c = 0; c < METRICS_COMMAND_COUNT; c++)
+            out << "p2ppay_request_errors_total{command=\"" << metricsCommandNames[c] << "\"} " << errors[c] << "\n";
+
+        out << "# HELP p2ppay_stage_seconds Time spent per message in each stage.\n# TYPE p2ppay_stage_seconds histogram\n";
+        for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b <= METRICS_BUCKET_COUNT; b++) {
+                cumulative += buckets[s][b];
+                out << "p2ppay_stage_seconds_bucket{stage=\"" << metricsStageNames[s] << "\",le=\"";
+                if (b < METRICS_BUCKET_COUNT)
+                    out << metricsBuckets[b];
+                else
+                    out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "p2ppay_stage_seconds_sum{stage=\"" << metricsStageNames[s] << "\"} " << nanos[s] / 1e9 << "\n";
+            out << "p2ppay_stage_seconds_count{stage=\"" << metricsStageNames[s] << "\"} " << cumulative << "\n";
+        }
+
+        out << "# HELP p2ppay_crypto_operations_total Public key (rsa, x25519) and symmetric (aes) operations spent on requests.\n"
+            << "# TYPE p2ppay_crypto_operations_total counter\n"
+            << "p2ppay_crypto_operations_total{kind=\"rsa\"} " << rsaOps << "\n"
+            << "p2ppay_crypto_operations_total{kind=\"x25519\"} " << x25519Ops << "\n"
+            << "p2ppay_crypto_operations_total{kind=\"aes\"} " << aesOps << "\n";
+        if (gaugesCallback)
+            out << gaugesCallback();
+        return out.str();
+    }
+
+    // one gauge in the text format, for gaugesCallback
+    static std::string gauge(const std::string &name, const std::string &help, double value) {
+        std::ostringstream out;
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+        return out.str();
+    }
+
+    // serve GET /metrics on 127.0.0.1:<port> from a background thread
+    bool startEndpoint(const std::string &port) {
+        if (!endpointSocket.bindSocket(port, "127.0.0.1")) {
+            error_t = "Failed to bind metrics port " + port + "\n" + endpointSocket.error_t;
+            return false;
+        }
+        endpointRunning = true;
+        endpointThread = std::thread([this]() {
+            while (endpointRunning) {
+                if (endpointSocket.listen(1))
+                    serveScrape();
+            }
+        });
+        return true;
+    }
+
+    void stopEndpoint() {
+        endpointRunning = false;
+        if (endpointThread.joinable())
+            endpointThread.join();
+        if (endpointSocket.sockfd != -1)
+            ::close(endpointSocket.sockfd);
+        endpointSocket.sockfd = -1;
+    }
+
+    ~Metrics() {
+        stopEndpoint();
+    }
+
+private:
+    std::mutex threadsMutex;
+    std::vector<ThreadMetrics *> threads; // never freed, a finished thread's counts still belong in the totals
+
+    MySocket endpointSocket{"metrics"};
+    std::atomic<bool> endpointRunning{false};
+    std::thread endpointThread;
+
+    static void bump(std::atomic<uint64_t> &counter, uint64_t by = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    ThreadMetrics &threadMetrics() {
+        static thread_local ThreadMetrics *local = nullptr;
+        if (!local) {
+            local = new ThreadMetrics(); // value initialized, so every counter starts at zero
+            std::lock_guard<std::mutex> lock(threadsMutex);
+            threads.push_back(local);
+        }
+        return *local;
+    }
+
+    void forEachThread(const std::function<void(const ThreadMetrics &)> &visit) {
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        for (ThreadMetrics *metrics : threads)
+            visit(*metrics);
+    }
+
+    // answer one HTTP request, the scraper only ever asks for the metrics so the path is not checked
+    void serveScrape() {
+        MySocket scraper("metricsScrape");
+        if (endpointSocket.accept(scraper).first.empty())
+            return;
+        scraper.framed = false; // plain HTTP
+        std::string request = scraper.recv(1);
+        if (request.compare(0, 4, "GET ") != 0) {
+            scraper.send("HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+            return;
+        }
+        std::string body = render();
+        scraper.send("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) +
+                     "\r\nConnection: close\r\n\r\n" + body);
+    }
+};
+
+#endif // METRICS_H
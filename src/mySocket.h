@@ -6,20 +6,77 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
-#include <sys/select.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <cerrno>
 #include <string>
 #include <random>
 #include <sstream>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include "encryption.h"
 #include <sstream>
+// the steps a message goes through in a socket, reported to a SocketObserver
+enum SocketStage {
+    STAGE_RECV,
+    STAGE_DECRYPT,
+    STAGE_ENCRYPT,
+    STAGE_SEND,
+    STAGE_CRYPTO_QUEUE, // waiting for a crypto pool thread
+    STAGE_CRYPTO_JOB,   // one RSA operation on a crypto pool thread
+};
+
+// gets told how long each stage took, for every socket it is attached to. may be called from any thread
+class SocketObserver {
+public:
+    virtual void observeStage(SocketStage stage, double seconds) = 0;
+    virtual ~SocketObserver() {}
+};
+
+// times the enclosing scope for a socket's observer, does nothing without one
+class StageTimer {
+public:
+    StageTimer(SocketObserver *observer, SocketStage stage) : observer(observer), stage(stage) {
+        if (observer)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer() {
+        if (observer)
+            observer->observeStage(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    SocketObserver *observer;
+    SocketStage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+// encrypts the RSA chunks of one message all at once, so a long message can be spread over several threads
+class ChunkEncryptor {
+public:
+    // replace every chunk with its base64 ciphertext. false if the chunks were left untouched, the caller encrypts them then
+    virtual bool encryptChunks(EVP_PKEY *publicKey, std::vector<std::string> &chunks) = 0;
+    virtual ~ChunkEncryptor() {}
+};
+
+// largest payload a frame can carry. it fits in 3 bytes, so the first byte of a length prefix is always zero,
+// which is how a frame is told apart from an old unframed text message
+#define MAX_FRAME_SIZE 0xFFFFFF
+
+// the most payments a payee may forward to the server in one BATCH message
+#define FORWARD_BATCH_LIMIT 1024
+
 // a custom simple socket class to consolidate the socket code
 // heavily inspired by Beej's Guide to Network Programming
+// every message is sent as a frame: a 4 byte big endian payload length followed by the payload
 class MySocket {
 public:
     int sockfd;
@@ -27,6 +84,14 @@ public:
     std::string socketNameForDebug = "Unknown";
     bool enableLogging = false;
     bool isConnected = false;
+    std::string recvBuffer; // bytes read by recvAvailable that have not been split into frames yet
+    // AES-GCM key negotiated for this connection. while set, sendEncrypted and decodeEncrypted use it instead of the peer's key
+    std::vector<unsigned char> sessionKey;
+    // length-prefix outgoing messages. cleared as soon as the peer sends an unframed message, so replies to
+    // clients from before framing are sent the way they expect
+    std::atomic<bool> framed{true};
+    SocketObserver *observer = nullptr; // optional, not owned
+    ChunkEncryptor *chunkEncryptor = nullptr; // optional, not owned. used for RSA messages of more than one chunk
 
     MySocket(const std::string &socketName, bool enableLogging = false) : sockfd(-1), socketNameForDebug(socketName), enableLogging(enableLogging) {}
 
@@ -94,18 +159,12 @@ public:
             return false;
         }
 
-        fd_set writefds;
-        FD_ZERO(&writefds);
-        FD_SET(sockfd, &writefds);
-
-        struct timeval tv;
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-
-        result = select(sockfd + 1, NULL, &writefds, NULL, &tv);
+        // poll rather than select, select cannot watch descriptors above FD_SETSIZE (1024)
+        struct pollfd pfd = {sockfd, POLLOUT, 0};
+        result = poll(&pfd, 1, timeout * 1000);
         if (result == -1) {
             error_t = strerror(errno);
-            std::cerr << "Select error" << std::endl;
+            std::cerr << "Poll error" << std::endl;
             return false;
         } else if (result == 0) {
             error_t = "Connection timed out";
@@ -128,13 +187,14 @@ public:
         freeaddrinfo(res);
         this->sockfd = sockfd;
         isConnected = true;
+        disableNagle(sockfd);
         if (enableLogging)
             std::cerr << "Connected to " << hostname << ":" << serverPort << std::endl;
         return true;
     }
 
-    // bind the socket to the given port on the system
-    bool bindSocket(const std::string &clientPort) {
+    // bind the socket to the given port on the system, on every interface unless a host is given
+    bool bindSocket(const std::string &clientPort, const std::string &host = "") {
         if (enableLogging)
             std::cerr << "Socket " << socketNameForDebug << " binding to port " << clientPort << std::endl;
         struct addrinfo hints, *res, *p;
@@ -142,7 +202,7 @@ public:
         hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_flags = AI_PASSIVE;
-        if (getaddrinfo(NULL, clientPort.c_str(), &hints, &res) != 0) {
+        if (getaddrinfo(host.empty() ? NULL : host.c_str(), clientPort.c_str(), &hints, &res) != 0) {
             error_t = strerror(errno);
             std::cerr << "Failed to get address info" << std::endl;
             return false;
@@ -173,20 +233,13 @@ public:
     // listen for incoming TCP connections
     bool listen(int timeout_sec = 5) {
         // std::cerr << "Socket " << socketNameForDebug << " starting to listen for connection" << std::endl;
-        if (::listen(sockfd, 10) == -1) {
+        if (::listen(sockfd, SOMAXCONN) == -1) {
             error_t = strerror(errno);
             return false;
         }
 
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-
-        struct timeval tv;
-        tv.tv_sec = timeout_sec;
-        tv.tv_usec = 0;
-
-        int retval = select(sockfd + 1, &readfds, NULL, NULL, &tv);
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int retval = poll(&pfd, 1, timeout_sec * 1000);
         if (retval == -1) {
             error_t = strerror(errno);
             return false;
@@ -211,6 +264,11 @@ public:
             error_t = strerror(errno);
             return {"", ""};
         }
+        newSock.isConnected = true;
+        // reads never block anyway (MSG_DONTWAIT), this makes a send to a peer that stopped reading wait in
+        // send's poll with its timeout instead of in ::send forever
+        fcntl(newSock.sockfd, F_SETFL, fcntl(newSock.sockfd, F_GETFL, 0) | O_NONBLOCK);
+        disableNagle(newSock.sockfd);
         if (enableLogging)
             std::cerr << "OK" << std::endl;
         // return ipv4 address and port
@@ -252,78 +310,206 @@ public:
         return -1;
     }
 
-    // send a message with the socket
+    // every message goes out in one write, so there is nothing for Nagle's algorithm to coalesce. left on, it holds
+    // back a request sent while the previous one is unacknowledged, which stalls pipelined requests and pushes
+    static void disableNagle(int fd) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    }
+
+    // send a message with the socket as one frame. partial writes are retried until the whole frame is out,
+    // and sends from different threads never interleave
     bool send(const std::string &message) {
         if (enableLogging)
             std::cerr << "\033[32mSocket " << socketNameForDebug << " sending: " << message << "\033[0m" << std::endl;
-        int sendRes = ::send(sockfd, message.c_str(), message.size(), 0);
-        if (sendRes == -1) {
-            error_t = strerror(errno);
-            return false;
+        std::string data;
+        if (framed) {
+            if (message.size() > MAX_FRAME_SIZE) {
+                error_t = "Message too large to send (" + std::to_string(message.size()) + " bytes)";
+                return false;
+            }
+            uint32_t length = htonl(message.size());
+            data.assign(reinterpret_cast<const char *>(&length), sizeof length);
+            data += message;
+        } else {
+            data = message;
         }
-        return true;
+
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (corked) {
+            corkedData += data;
+            return true;
+        }
+        return writeAll(data);
     }
 
-    // receive a message from the socket
+    // hold back what send is given until uncork, which writes it all at once. lets a reply be put together
+    // under a lock and written to the network after the lock is released
+    void cork() {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        corked = true;
+    }
+
+    bool uncork() {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        corked = false;
+        std::string data;
+        data.swap(corkedData);
+        return data.empty() || writeAll(data);
+    }
+
+    // receive the next message from the socket, waiting up to timeout_sec for all of it to arrive.
+    // bytes past the end of the message stay buffered for the next call
     std::string recv(int timeout_sec = 5) {
         if (enableLogging)
             std::cerr << "Socket " << socketNameForDebug << " receiving" << std::endl;
-        char buf[4096];
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec);
+        std::string frame;
+        while (!popFrame(frame)) {
+            int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            struct pollfd pfd = {sockfd, POLLIN, 0};
+            int retval = poll(&pfd, 1, std::max(remaining, 0));
+            if (retval == -1) {
+                if (errno == EINTR)
+                    continue;
+                error_t = strerror(errno);
+                return "";
+            } else if (retval == 0) {
+                error_t = "Timeout occurred";
+                return "";
+            }
+            if (!recvAvailable()) {
+                if (popFrame(frame))
+                    break; // the peer closed right after its last message
+                std::cerr << "ERROR: " << error_t << std::endl;
+                return "";
+            }
+        }
 
-        struct timeval tv;
-        tv.tv_sec = timeout_sec;
-        tv.tv_usec = 0;
+        if (enableLogging)
+            std::cerr << "\033[34mSocket " << socketNameForDebug << " received: " << frame << "\033[0m" << std::endl;
+        return frame;
+    }
 
-        int retval = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        if (retval == -1) {
-            error_t = strerror(errno);
-            return "";
-        } else if (retval == 0) {
-            error_t = "Timeout occurred";
-            return "";
+    bool sendEncrypted(EVP_PKEY *publicKey, const std::string &message) {
+        std::string output;
+        {
+            StageTimer timer(observer, STAGE_ENCRYPT);
+            if (!sessionKey.empty()) {
+                // one symmetric encryption for the whole message, no matter how long
+                output = "------ SESSION ------\r\n" + sessionEncrypt(sessionKey, message) + "\r\n------ END ------\r\n";
+            } else if (isSealingKey(publicKey)) {
+                // an X25519 key takes the whole message in one line, no chunks
+                std::string sealed;
+                if (!sealMessage(publicKey, message, sealed)) {
+                    error_t = "Failed to seal message";
+                    return false;
+                }
+                output = "------ SEALED ------\r\n" + sealed + "\r\n------ END ------\r\n";
+            } else {
+                std::vector<std::string> chunks;
+                for (size_t i = 0; i < message.size(); i += 202)
+                    chunks.push_back(message.substr(i, 202));
+                if (chunks.size() < 2 || !chunkEncryptor || !chunkEncryptor->encryptChunks(publicKey, chunks)) {
+                    std::string encrypted;
+                    for (auto &chunk : chunks) {
+                        encryptMessage(publicKey, chunk, encrypted);
+                        chunk.swap(encrypted);
+                    }
+                }
+                output = "------ ENCRYPTED ------\r\n";
+                // the newline ends each base64 line for peers that still decode with OpenSSL's BIO, which
+                // drops a line without one
+                for (const auto &chunk : chunks)
+                    output += chunk + "\n\r\n";
+                output += "------ END ------\r\n";
+            }
         }
 
-        if (!FD_ISSET(sockfd, &readfds)) {
-            error_t = "Socket not ready for reading";
-            std::cerr << "FD_ISSET error: " << error_t << std::endl;
-            return "";
-        }
+        return send(output);
+    }
 
-        int numbytes = ::recv(sockfd, buf, sizeof(buf) - 1, 0);
-        if (enableLogging)
-            std::cerr << "recv returned " << numbytes << std::endl;
-        if (numbytes == -1) {
+    // read everything the kernel has buffered for this socket into recvBuffer without blocking.
+    // returns false once the peer has closed the connection or the socket failed
+    bool recvAvailable() {
+        StageTimer timer(observer, STAGE_RECV);
+        char buf[4096];
+        while (true) {
+            ssize_t numbytes = ::recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (numbytes > 0) {
+                recvBuffer.append(buf, numbytes);
+                continue;
+            }
+            if (numbytes == 0) {
+                error_t = "Connection closed by peer";
+                return false;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
             error_t = strerror(errno);
-            std::cerr << "ERROR: " << error_t << std::endl;
-            return "";
-        }
-        if (numbytes == 0) {
-            error_t = "Connection closed by peer";
-            return "";
+            return false;
         }
-
-        buf[numbytes] = '\0';
-        if (enableLogging)
-            std::cerr << "\033[34mSocket " << socketNameForDebug << " received: " << buf << "\033[0m" << std::endl;
-        return buf;
     }
 
-    bool sendEncrypted(EVP_PKEY *publicKey, const std::string &message) {
-        std::string output = "------ ENCRYPTED ------\r\n";
-        for (int i = 0; i < message.size(); i += 202) {
-            output += encryptMessage(publicKey, message.substr(i, 202)) + "\r\n";
+    // split the next complete message off recvBuffer, returns false until all of it has arrived
+    bool popFrame(std::string &frame) {
+        if (recvBuffer.empty())
+            return false;
+        if (recvBuffer[0] != '\0') {
+            framed = false;
+            return popUnframed(frame);
         }
-        output += "------ END ------\r\n";
+        if (recvBuffer.size() < 4)
+            return false;
+        uint32_t length;
+        memcpy(&length, recvBuffer.data(), sizeof length);
+        length = ntohl(length);
+        if (recvBuffer.size() < 4 + (size_t)length)
+            return false;
+        frame = recvBuffer.substr(4, length);
+        recvBuffer.erase(0, 4 + (size_t)length);
+        return true;
+    }
 
-        return send(output);
+    // messages from peers that predate framing. an encrypted message is complete once its END line
+    // has arrived, anything else is taken as-is up to the start of the next encrypted message
+    bool popUnframed(std::string &frame) {
+        static const std::string headers[] = {"------ ENCRYPTED ------", "------ SESSION ------", "------ SEALED ------"};
+        static const std::string footer = "------ END ------\r\n";
+        size_t end = std::string::npos;
+        bool encryptedFrame = false;
+        for (const std::string &header : headers) {
+            if (recvBuffer.size() < header.size() && header.compare(0, recvBuffer.size(), recvBuffer) == 0)
+                return false; // header not fully arrived yet
+            if (recvBuffer.compare(0, header.size(), header) == 0)
+                encryptedFrame = true;
+            end = std::min(end, recvBuffer.find(header, 1));
+        }
+        if (encryptedFrame) {
+            end = recvBuffer.find(footer);
+            if (end == std::string::npos)
+                return false;
+            end += footer.size();
+        } else if (end == std::string::npos) {
+            end = recvBuffer.size();
+        }
+        frame = recvBuffer.substr(0, end);
+        recvBuffer.erase(0, end);
+        return true;
     }
 
-    std::string recvEncrypted(EVP_PKEY *privateKey, bool *encrypted = nullptr) {
-        std::string raw = recv(5);
+    std::string recvEncrypted(EVP_PKEY *privateKey, bool *encrypted = nullptr, int timeout_sec = 5) {
+        std::string raw = recv(timeout_sec);
+        if (raw.empty())
+            return raw;
+        return decodeEncrypted(raw, privateKey, encrypted);
+    }
 
+    // decrypt a raw message received from the peer. unencrypted messages are returned unchanged with *encrypted set to false.
+    // sealed messages are opened with sealingKey, or privateKey if it is not given
+    std::string decodeEncrypted(const std::string &raw, EVP_PKEY *privateKey, bool *encrypted = nullptr, EVP_PKEY *sealingKey = nullptr) {
         // if (enableLogging) {
         //     std::cerr << "Raw message: ";
         //     for (char c : raw) {
@@ -337,48 +523,45 @@ public:
         //     std::cerr << std::endl;
         // }
 
-        if (raw.empty())
-            return raw;
-        if (raw.substr(0, 23) != "------ ENCRYPTED ------") {
+        bool sessionFrame = raw.compare(0, 21, "------ SESSION ------") == 0;
+        bool sealedFrame = raw.compare(0, 20, "------ SEALED ------") == 0;
+        if (raw.substr(0, 23) != "------ ENCRYPTED ------" && !sessionFrame && !sealedFrame) {
             std::cerr << "Header not encrypted" << std::endl;
             if (encrypted)
                 *encrypted = false;
             return raw;
         }
-        std::stringstream ss(raw);
-        std::string line;
-        std::string message;
-        bool reading = false;
-        while (std::getline(ss, line, '\r')) {
-            if (line.empty())
-                continue;
-            if (line[0] == '\n')
-                line = line.substr(1);
-            if (line == "------ ENCRYPTED ------") {
-                reading = true;
-                continue;
-            }
-            if (line == "------ END ------") {
-                reading = false;
-                break;
-            }
-            if (reading) {
-                std::string decrypted = decryptMessage(privateKey, line);
-                if (decrypted.empty()) {
-                    if (encrypted)
-                        *encrypted = false;
-                    error_t = "Failed to decrypt message";
-                    return raw;
-                }
-                message += decrypted;
-            }
+        if (sessionFrame && sessionKey.empty()) {
+            if (encrypted)
+                *encrypted = false;
+            error_t = "Session message received but no session was negotiated";
+            return raw;
         }
-        if (reading) {
+        StageTimer timer(observer, STAGE_DECRYPT);
+        std::vector<std::string> lines;
+        if (!encryptedLines(raw, lines)) {
             if (encrypted)
                 *encrypted = false;
             error_t = "Invalid encrypted message format";
             return raw;
         }
+        std::string message, decrypted;
+        for (const auto &line : lines) {
+            bool decryptOk;
+            if (sessionFrame)
+                decryptOk = sessionDecrypt(sessionKey, line, decrypted);
+            else if (sealedFrame)
+                decryptOk = openSealed(sealingKey ? sealingKey : privateKey, line, decrypted);
+            else
+                decryptOk = decryptMessage(privateKey, line, decrypted);
+            if (!decryptOk) {
+                if (encrypted)
+                    *encrypted = false;
+                error_t = "Failed to decrypt message";
+                return raw;
+            }
+            message += decrypted;
+        }
         if (encrypted)
             *encrypted = true;
 
@@ -387,6 +570,33 @@ public:
         return message;
     }
 
+    // an encrypted message with one RSA chunk per line, as opposed to a session message or plain text
+    static bool isRsaMessage(const std::string &raw) {
+        return raw.compare(0, 23, "------ ENCRYPTED ------") == 0;
+    }
+
+    // the base64 lines of an encrypted message, between its header and END line. false if the END line is missing
+    static bool encryptedLines(const std::string &raw, std::vector<std::string> &lines) {
+        std::stringstream ss(raw);
+        std::string line;
+        bool reading = false;
+        while (std::getline(ss, line, '\r')) {
+            if (line.empty())
+                continue;
+            if (line[0] == '\n')
+                line = line.substr(1);
+            if (line == "------ ENCRYPTED ------" || line == "------ SESSION ------" || line == "------ SEALED ------") {
+                reading = true;
+                continue;
+            }
+            if (line == "------ END ------")
+                return true;
+            if (reading)
+                lines.push_back(line);
+        }
+        return !reading;
+    }
+
     // close the active TCP connection. This is also called when the MySocket object is destroyed
     void closeConnection() {
         if (enableLogging)
@@ -397,6 +607,9 @@ public:
             ::close(sockfd);
             isConnected = false;
         }
+        recvBuffer.clear();
+        sessionKey.clear();
+        framed = true;
         if (enableLogging)
             std::cerr << "Connection closed gracefully" << std::endl;
     }
@@ -405,6 +618,36 @@ public:
         if (isConnected)
             closeConnection();
     }
+
+private:
+    std::mutex sendMutex;
+    bool corked = false;    // guarded by sendMutex
+    std::string corkedData; // frames sent while corked, guarded by sendMutex
+
+    // write data out, partial writes are retried until all of it is. with sendMutex held
+    bool writeAll(const std::string &data) {
+        StageTimer timer(observer, STAGE_SEND);
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t sendRes = ::send(sockfd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (sendRes == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // the kernel send buffer is full, wait until the peer has read some of it
+                    struct pollfd pfd = {sockfd, POLLOUT, 0};
+                    if (poll(&pfd, 1, 5000) > 0)
+                        continue;
+                    error_t = "Timeout occurred";
+                    return false;
+                }
+                error_t = strerror(errno);
+                return false;
+            }
+            sent += sendRes;
+        }
+        return true;
+    }
 };
 
 std::vector<std::string> split(const std::string &s, char delimiter) {
@@ -0,0 +1,130 @@
+#ifndef P2P_POOL_H
+#define P2P_POOL_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include "mySocket.h"
+
+#define P2P_IDLE_TIMEOUT_SEC 60
+
+// long lived connections to payees, so repeated payments to the same peer skip the lookup and the TCP handshake.
+// a connection is keyed by the payee's username, address and public key fingerprint, so it is only reused
+// for the exact peer it was opened for. payees never write on these connections, so a readable socket means
+// the peer closed it, which is what the health check looks for
+class P2PPool {
+public:
+    std::string error_t;
+    int idleTimeoutSec = P2P_IDLE_TIMEOUT_SEC;
+
+    uint64_t reused = 0; // payments sent on a pooled connection
+    uint64_t opened = 0; // connections opened
+
+    // send one message to the peer, on its pooled connection if there is a healthy one.
+    // a pooled connection that fails to send is replaced by a fresh one once. the pool is only locked to take a
+    // connection out and put it back, so a slow or unreachable peer does not hold up payments to anyone else
+    bool send(const std::string &key, const std::string &host, const std::string &port, EVP_PKEY *peerKey, const std::string &message) {
+        MySocket *sock = take(key);
+        if (sock) {
+            if (healthy(*sock) && sock->sendEncrypted(peerKey, message)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                reused++;
+                putBack(key, sock);
+                return true;
+            }
+            delete sock;
+        }
+
+        sock = new MySocket("p2pSend");
+        bool sent = sock->connect(host, port) && sock->sendEncrypted(peerKey, message);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (sock->isConnected)
+            opened++;
+        if (!sent) {
+            error_t = sock->error_t;
+            delete sock;
+            return false;
+        }
+        putBack(key, sock);
+        return true;
+    }
+
+    // close connections that have not been used for idleTimeoutSec
+    void evictIdle() {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropIdle();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connections.size();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!connections.empty())
+            drop(connections.begin());
+    }
+
+    ~P2PPool() {
+        clear();
+    }
+
+private:
+    struct Connection {
+        MySocket *socket;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Connection> connections;
+
+    void dropIdle() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto connection = connections.begin(); connection != connections.end();) {
+            if (now - connection->second.lastUsed > std::chrono::seconds(idleTimeoutSec))
+                connection = drop(connection);
+            else
+                connection++;
+        }
+    }
+
+    // take the connection for key out of the pool, nullptr if there is none. nobody else uses it until putBack
+    MySocket *take(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropIdle();
+        auto pooled = connections.find(key);
+        if (pooled == connections.end())
+            return nullptr;
+        MySocket *sock = pooled->second.socket;
+        connections.erase(pooled);
+        return sock;
+    }
+
+    // return a connection that was just used to the pool, with mutex held. if another payment to the same peer
+    // opened one meanwhile, that one stays and this is closed
+    void putBack(const std::string &key, MySocket *sock) {
+        if (connections.count(key)) {
+            delete sock;
+            return;
+        }
+        connections[key] = Connection{sock, std::chrono::steady_clock::now()};
+    }
+
+    std::map<std::string, Connection>::iterator drop(std::map<std::string, Connection>::iterator connection) {
+        delete connection->second.socket;
+        return connections.erase(connection);
+    }
+
+    // the peer only ever reads, so anything readable is the end of the stream or an error
+    static bool healthy(MySocket &sock) {
+        if (!sock.isConnected)
+            return false;
+        char byte;
+        ssize_t n = ::recv(sock.sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+};
+
+#endif // P2P_POOL_H
@@ -0,0 +1,247 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <map>
+#include <vector>
+#include <deque>
+#include "mySocket.h"
+
+// an edge-triggered epoll event loop that owns a set of connected sockets.
+// every complete frame read from a socket is handed to frameCallback on the reactor thread,
+// so one reactor serves thousands of idle connections without a thread (or a sleep) per client
+class Reactor {
+public:
+    // return false from frameCallback to close the connection after the frame
+    std::function<bool(MySocket *, const std::string &)> frameCallback;
+    // called on the reactor thread right before a socket is closed and deleted
+    std::function<void(MySocket *)> closeCallback;
+
+    std::string error_t;
+    std::string reactorNameForDebug;
+
+    Reactor(const std::string &reactorName) : reactorNameForDebug(reactorName) {}
+
+    bool start() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd == -1) {
+            error_t = strerror(errno);
+            return false;
+        }
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd == -1) {
+            error_t = strerror(errno);
+            return false;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr; // the wake up eventfd is the only entry without a socket
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) == -1) {
+            error_t = strerror(errno);
+            return false;
+        }
+        running = true;
+        loopThread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    // hand a connected socket over to the reactor, it is deleted when the connection closes
+    bool addSocket(MySocket *sock) {
+        {
+            std::lock_guard<std::mutex> lock(socketsMutex);
+            sockets[sock] = nextSerial++;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = sock;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock->sockfd, &ev) == -1) {
+            error_t = strerror(errno);
+            std::lock_guard<std::mutex> lock(socketsMutex);
+            sockets.erase(sock);
+            return false;
+        }
+        return true;
+    }
+
+    // run task on the reactor thread. may be called from any thread
+    void post(const std::function<void()> &task) {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            tasks.push_back(task);
+        }
+        uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof one) == -1)
+            error_t = strerror(errno);
+    }
+
+    // run task with sock on the reactor thread, unless sock is closed by then. sock has to be open when this is
+    // called, so a later connection that happens to get the same address is not handed the task
+    void postTo(MySocket *sock, const std::function<void(MySocket *)> &task) {
+        uint64_t serial;
+        {
+            std::lock_guard<std::mutex> lock(socketsMutex);
+            auto open = sockets.find(sock);
+            if (open == sockets.end())
+                return;
+            serial = open->second;
+        }
+        post([this, sock, serial, task]() {
+            {
+                // sockets are only closed on this thread, so it stays open while the task runs
+                std::lock_guard<std::mutex> lock(socketsMutex);
+                auto open = sockets.find(sock);
+                if (open == sockets.end() || open->second != serial)
+                    return;
+            }
+            task(sock);
+        });
+    }
+
+    // stop handing sock's frames to frameCallback until resume, for a frame that is being handled
+    // elsewhere. reactor thread only. a paused socket stays open even if the peer closes it, so
+    // whoever holds it can still finish; it is closed on resume
+    void pause(MySocket *sock) {
+        paused.insert(sock);
+    }
+
+    // reactor thread only: hand sock the frames that arrived while it was paused, or close it if the
+    // peer went away in the meantime or keepOpen is false
+    void resume(MySocket *sock, bool keepOpen) {
+        paused.erase(sock);
+        bool peerOpen = closedWhilePaused.erase(sock) == 0;
+        serve(sock, peerOpen, keepOpen);
+    }
+
+    // reactor thread only: close sock as if the peer had gone away. a paused socket is closed on resume
+    void close(MySocket *sock) {
+        if (paused.count(sock))
+            closedWhilePaused.insert(sock);
+        else
+            closeSocket(sock);
+    }
+
+    size_t connectionCount() {
+        std::lock_guard<std::mutex> lock(socketsMutex);
+        return sockets.size();
+    }
+
+    void stop() {
+        if (!running)
+            return;
+        running = false;
+        uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof one) == -1)
+            error_t = strerror(errno);
+        if (loopThread.joinable())
+            loopThread.join();
+
+        std::map<MySocket *, uint64_t> remaining;
+        {
+            std::lock_guard<std::mutex> lock(socketsMutex);
+            remaining.swap(sockets);
+        }
+        for (const auto &sock : remaining) {
+            if (closeCallback)
+                closeCallback(sock.first);
+            delete sock.first;
+        }
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    ~Reactor() {
+        stop();
+    }
+
+private:
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::atomic<bool> running{false};
+    std::thread loopThread;
+
+    std::mutex socketsMutex;
+    // the open sockets, each with the order it was added in, which tells apart two sockets at the same address
+    std::map<MySocket *, uint64_t> sockets;
+    uint64_t nextSerial = 0;
+
+    std::mutex tasksMutex;
+    std::deque<std::function<void()>> tasks;
+
+    // reactor thread only
+    std::set<MySocket *> paused;
+    std::set<MySocket *> closedWhilePaused;
+
+    void run() {
+        std::vector<struct epoll_event> events(256);
+        while (running) {
+            int n = epoll_wait(epollFd, events.data(), events.size(), 1000);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                error_t = strerror(errno);
+                std::cerr << "\033[31mReactor " << reactorNameForDebug << " epoll_wait failed: " << error_t << "\033[0m" << std::endl;
+                break;
+            }
+            bool woken = false;
+            for (int i = 0; i < n; i++) {
+                MySocket *sock = static_cast<MySocket *>(events[i].data.ptr);
+                if (sock == nullptr) {
+                    uint64_t value;
+                    while (::read(wakeFd, &value, sizeof value) > 0) {
+                    }
+                    woken = true;
+                    continue;
+                }
+                // edge triggered: drain the socket completely, then dispatch whatever frames are complete
+                bool peerOpen = sock->recvAvailable() && !(events[i].events & (EPOLLHUP | EPOLLERR));
+                serve(sock, peerOpen, true);
+            }
+            // after the events, a task may close a socket that a later event in this batch is for
+            if (woken)
+                runTasks();
+        }
+    }
+
+    void runTasks() {
+        std::deque<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            ready.swap(tasks);
+        }
+        for (auto &task : ready)
+            task();
+    }
+
+    void serve(MySocket *sock, bool peerOpen, bool keepOpen) {
+        std::string frame;
+        while (keepOpen && !paused.count(sock) && sock->popFrame(frame))
+            keepOpen = frameCallback(sock, frame);
+        if (peerOpen && keepOpen)
+            return;
+        if (paused.count(sock))
+            closedWhilePaused.insert(sock);
+        else
+            closeSocket(sock);
+    }
+
+    void closeSocket(MySocket *sock) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, sock->sockfd, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(socketsMutex);
+            sockets.erase(sock);
+        }
+        if (closeCallback)
+            closeCallback(sock);
+        delete sock;
+    }
+};
+
+#endif // REACTOR_H
@@ -9,10 +9,16 @@ volatile bool stopServer = false;
 // -d: show client register, login, and exit info in console only
 // -s: also show online list on login or exit
 // -a: also show TCP messages, without this tag, errors will still be shown
+// -c: run one event loop per CPU core instead of a single one
+// -p <port>: serve Prometheus metrics on 127.0.0.1:<port>/metrics
+// -k <threads>: RSA worker threads, 0 to do RSA on the event loops. one per core by default
+// -S <seconds>: how often to check if the account snapshot is worth updating, 0 to never write one. 60 by default
+// -T <seconds>: how long a session resumption ticket is valid, 0 to not issue any. 600 by default
 // -h: run headless, no gui
 int main(int argc, char *argv[]) {
     int consoleLogLevel = 0; // no log
     bool runHeadless = false;
+    int reactorCount = 1;
 
     if (argc < 2) {
         std::cerr << "args: <portNum> <Options>" << std::endl;
@@ -26,6 +32,16 @@ int main(int argc, char *argv[]) {
             consoleLogLevel = std::max(consoleLogLevel, 2);
         else if (std::string(argv[i]) == "-a")
             consoleLogLevel = std::max(consoleLogLevel, 3);
+        else if (std::string(argv[i]) == "-c")
+            reactorCount = std::max(1u, std::thread::hardware_concurrency());
+        else if (std::string(argv[i]) == "-p" && i + 1 < argc)
+            serverAction.metricsPort = argv[++i];
+        else if (std::string(argv[i]) == "-k" && i + 1 < argc)
+            serverAction.cryptoThreads = std::max(0, atoi(argv[++i]));
+        else if (std::string(argv[i]) == "-S" && i + 1 < argc)
+            serverAction.snapshotIntervalSec = std::max(0, atoi(argv[++i]));
+        else if (std::string(argv[i]) == "-T" && i + 1 < argc)
+            serverAction.ticketLifetimeSec = std::max(0, atoi(argv[++i]));
         else if (std::string(argv[i]) == "-h")
             runHeadless = true;
         else {
@@ -34,12 +50,18 @@ int main(int argc, char *argv[]) {
             std::cerr << "-d: show client register, login, and exit info in console only" << std::endl;
             std::cerr << "-s: also show online list on login or exit" << std::endl;
             std::cerr << "-a: also show TCP messages, without this tag, errors will still be shown" << std::endl;
+            std::cerr << "-c: run one event loop per CPU core instead of a single one" << std::endl;
+            std::cerr << "-p <port>: serve Prometheus metrics on 127.0.0.1:<port>/metrics" << std::endl;
+            std::cerr << "-k <threads>: RSA worker threads, 0 to do RSA on the event loops. one per core by default" << std::endl;
+            std::cerr << "-S <seconds>: how often to check if the account snapshot is worth updating, 0 to never write one. 60 by default" << std::endl;
+            std::cerr << "-T <seconds>: how long a session resumption ticket is valid, 0 to not issue any. 600 by default" << std::endl;
             std::cerr << "-h: run headless, no gui" << std::endl;
             return 1;
         }
     }
 
     serverAction.consoleLogLevel = consoleLogLevel;
+    serverAction.reactorCount = reactorCount;
     if (!serverAction.startServer(argv[1])) {
         std::cerr << "Failed to start server: " << serverAction.error_t << std::endl;
         return 1;
@@ -62,6 +84,7 @@ int main(int argc, char *argv[]) {
                 keyPressThread.join();
                 return 0;
             }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
     } else {
 
@@ -2,34 +2,81 @@
 #define SERVER_ACTION_H
 
 #include <vector>
+#include <deque>
+#include <unordered_set>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <thread>
 #include <atomic>
 #include <iomanip>
+#include <mutex>
+#include <sys/resource.h>
 #include "mySocket.h"
 #include "encryption.h"
+#include "reactor.h"
+#include "accountStore.h"
+#include "transferEngine.h"
+#include "ledger.h"
+#include "snapshot.h"
+#include "keyCache.h"
+#include "metrics.h"
+#include "cryptoPool.h"
 
-struct UserAccount {
-    std::string username;
-    int balance;
-};
+// how many presence changes the server remembers. a subscriber further behind than this gets a full snapshot
+#define PRESENCE_LOG_SIZE 1024
+// longest request ID prefix accepted, @ and up to 20 digits
+#define REQUEST_TAG_MAX 21
+// how long a session resumption ticket is valid by default, in seconds
+#define SESSION_TICKET_LIFETIME 600
 
+// one connection, a plain row so List and presence pushes scan a compact array. the username is the account's
+// and the public key lives in the keyStore, once per distinct key
 struct OnlineEntry {
     MySocket *clientSocket;
-    std::string username;
-    std::string ipAddr;
-    int clientPort;
-    int p2pPort;
+    AccountHandle account; // set on LOGIN, NO_ACCOUNT while not logged in
+    KeyId key;             // the key sent with LOGIN, NO_KEY while not logged in. also used to encrypt every reply
+    uint32_t ipAddr;       // IPv4 in network byte order, the server only accepts IPv4
+    uint16_t clientPort;
+    uint16_t p2pPort;
+    uint16_t reactor; // index into reactors, the event loop that owns clientSocket
+    bool subscribed;  // gets presence changes pushed instead of polling List
+};
+
+std::string ipToString(uint32_t ipAddr) {
+    char text[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = ipAddr;
+    return inet_ntop(AF_INET, &addr, text, sizeof(text)) ? text : "";
+}
+
+uint32_t ipFromString(const std::string &text) {
+    struct in_addr addr;
+    return inet_pton(AF_INET, text.c_str(), &addr) == 1 ? addr.s_addr : 0;
+}
+
+// what a resumption ticket restores, the ticket holds all of it sealed under the server's ticket key
+struct ResumedSession {
+    AccountHandle account;
+    uint16_t p2pPort;
     std::string publicKey;
+    std::vector<unsigned char> sessionKey; // derived from the ticket's key and the client's nonce
+};
+
+// a forwarded micropayment, looked up under stateMutex and applied after it is released
+struct PendingTransfer {
+    AccountHandle payer;
+    AccountHandle payee;
+    int amount;
+    std::string error; // why it cannot be applied, empty if it can
 };
 
 class ServerAction {
 public:
     int consoleLogLevel = 0;
-    std::vector<UserAccount>
-        userAccounts;
+    AccountStore userAccounts;
+    // every balance change after startup goes through here, transfers do not need stateMutex
+    TransferEngine transfers{userAccounts};
     std::vector<OnlineEntry> onlineUsers;
 
     MySocket serverSocket;
@@ -38,14 +85,71 @@ public:
     std::atomic<bool> serverListening;
     std::thread listeningThread;
 
+    // client sockets are owned by the reactors, one epoll loop each. set reactorCount before startListening
+    int reactorCount = 1;
+    std::vector<Reactor *> reactors;
+    // guards onlineUsers and the username index of userAccounts, which are shared by all reactor threads
+    std::mutex stateMutex;
+
+    // request counters and stage latencies, served in the Prometheus format on metricsPort if it is set
+    Metrics metrics;
+    std::string metricsPort;
+
+    // every balance change is logged here before it is acknowledged, and replayed on startup
+    Ledger ledger;
+
+    // the account table as of some point in the ledger, so startup only replays the ledger after it.
+    // every snapshotIntervalSec it is brought up to date in the background if the ledger has grown by
+    // SNAPSHOT_MIN_LEDGER_BYTES since. 0 turns that off. set before startServer
+    int snapshotIntervalSec = 60;
+    std::atomic<uint64_t> snapshotOffset{0}; // ledger bytes covered by the current snapshot
+    std::thread snapshotThread;
+    std::mutex snapshotMutex;
+    std::condition_variable snapshotWake;
+    bool snapshotStopping = false;
+
+    // clients' public keys, parsed once per distinct key instead of once per reply
+    KeyCache keyCache;
+    // the keys of the logged in users, guarded by stateMutex
+    KeyStore keyStore{keyCache};
+
+    // RSA decryption of requests and encryption of long replies, off the reactor threads.
+    // cryptoThreads is -1 for one thread per core, 0 to do all RSA on the reactors. set before startListening
+    int cryptoThreads = -1;
+    CryptoPool cryptoPool;
+
+    // presence: every join and leave bumps presenceVersion and is kept in presenceLog, so a subscriber
+    // that reconnects or falls behind only needs the changes since its version. guarded by stateMutex
+    uint64_t presenceVersion = 0;
+    std::deque<std::pair<uint64_t, std::string>> presenceLog;
+
+    // session resumption: a logged in session can ask for a TICKET, its account, P2P port, public key and session
+    // key sealed under ticketKey. a client that lost its connection presents it with RESUME and is logged in again
+    // without HELLO, RSA or LOGIN. ticketKey is made at startup, so a restart voids every ticket.
+    // ticketLifetimeSec is how long a ticket is valid, 0 to not issue any. set before startListening
+    int ticketLifetimeSec = SESSION_TICKET_LIFETIME;
+    std::vector<unsigned char> ticketKey;
+    // nonces of the RESUME requests accepted while their tickets may still be valid, so a captured request cannot
+    // be replayed. guarded by stateMutex
+    std::unordered_set<std::string> resumeNonces;
+    std::deque<std::pair<uint64_t, std::string>> resumeNonceLog; // when each can be forgotten, oldest first
+
     std::string serverPublicKey;
     EVP_PKEY *serverPrivateKey;
+    // X25519 pair given to clients that ask for it with HELLO#X25519. opening a request sealed to it takes one key
+    // agreement instead of an RSA private key operation
+    std::string serverSealingPublicKey;
+    EVP_PKEY *serverSealingKey;
 
     ServerAction() : serverSocket("server") {
         checkKeyFiles();
         std::string privateKeyStr = loadKeyFromFile(PRIVATE_KEY_FILE);
         serverPrivateKey = stringToKey(privateKeyStr, true);
         serverPublicKey = loadKeyFromFile(PUBLIC_KEY_FILE);
+        checkKeyFiles(KEY_X25519, SEALING_PRIVATE_KEY_FILE, SEALING_PUBLIC_KEY_FILE);
+        serverSealingKey = stringToKey(loadKeyFromFile(SEALING_PRIVATE_KEY_FILE), true);
+        serverSealingPublicKey = serverSealingKey ? loadKeyFromFile(SEALING_PUBLIC_KEY_FILE) : "";
+        ticketKey = generateSessionKey();
     }
 
     bool startServer(const std::string &port) {
@@ -55,150 +159,467 @@ public:
             return false;
         }
 
+        // every connected client holds a descriptor, lift the soft limit so thousands of clients fit
+        struct rlimit fileLimit;
+        if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+            fileLimit.rlim_cur = fileLimit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &fileLimit);
+        }
+
         if (!serverSocket.bindSocket(port)) {
             error_t = "Failed to bind to port " + port + "\n" + serverSocket.error_t;
             return false;
         }
 
+        if (!ledger.open(LEDGER_FILE)) {
+            error_t = ledger.error_t;
+            return false;
+        }
+        if (fileExists(SNAPSHOT_FILE)) {
+            Snapshot snapshot;
+            uint64_t offset = 0;
+            if (snapshot.load(SNAPSHOT_FILE, userAccounts, LEDGER_FILE, offset)) {
+                snapshotOffset = offset;
+                if (consoleLogLevel >= 1)
+                    std::cout << "Loaded " << userAccounts.size() << " accounts from the snapshot at ledger byte " << offset << std::endl;
+            } else {
+                std::cerr << "\033[33m" << snapshot.error_t << ", replaying the whole ledger\033[0m" << std::endl;
+            }
+        }
+        size_t replayed = 0;
+        if (!ledger.replay([this](const std::vector<std::string> &record) {
+                if (!applyLedgerRecord(userAccounts, record))
+                    std::cerr << "\033[31mSkipping invalid ledger record: " << record[0] << "\033[0m" << std::endl;
+            }, &replayed, snapshotOffset)) {
+            error_t = ledger.error_t;
+            return false;
+        }
+        if (consoleLogLevel >= 1)
+            std::cout << "Replayed " << replayed << " ledger records, " << userAccounts.size() << " accounts restored" << std::endl;
+        if (snapshotIntervalSec > 0) {
+            snapshotStopping = false;
+            snapshotThread = std::thread([this]() { snapshotLoop(); });
+        }
+
+        if (!metricsPort.empty()) {
+            metrics.gaugesCallback = [this]() { return metricsGauges(); };
+            if (!metrics.startEndpoint(metricsPort)) {
+                error_t = metrics.error_t;
+                return false;
+            }
+            if (consoleLogLevel >= 1)
+                std::cout << "Serving metrics on http://127.0.0.1:" << metricsPort << "/metrics" << std::endl;
+        }
+
         if (consoleLogLevel >= 3)
             std::cerr << "Server started on port " << port << std::endl;
         return true;
     }
 
     void startListening() {
+        cryptoPool.observer = &metrics;
+        cryptoPool.start(cryptoThreads < 0 ? std::max(1u, std::thread::hardware_concurrency()) : cryptoThreads);
+        for (int i = 0; i < std::max(reactorCount, 1); i++) {
+            Reactor *reactor = new Reactor("reactor" + std::to_string(i));
+            reactor->frameCallback = [this, reactor](MySocket *client, const std::string &frame) {
+                return handleFrame(reactor, client, frame);
+            };
+            reactor->closeCallback = [this](MySocket *client) {
+                dropClient(client);
+            };
+            if (!reactor->start()) {
+                error_t = "Failed to start event loop\n" + reactor->error_t;
+                std::cerr << "\033[31m" << error_t << "\033[0m" << std::endl;
+                delete reactor;
+                continue;
+            }
+            reactors.push_back(reactor);
+        }
+        if (reactors.empty())
+            return;
+        if (consoleLogLevel >= 3)
+            std::cerr << "Started " << reactors.size() << " event loop(s)" << std::endl;
+
         serverListening = true;
         listeningThread = std::thread([this]() {
+            size_t nextReactor = 0;
             while (serverListening) {
                 if (serverSocket.listen(1)) {
                     MySocket *client = new MySocket("client" + std::to_string(onlineUsers.size()), consoleLogLevel >= 3);
+                    client->observer = &metrics;
+                    if (cryptoPool.running())
+                        client->chunkEncryptor = &cryptoPool;
                     auto ipAndPort = serverSocket.accept(*client);
                     if (ipAndPort.first.empty()) {
                         error_t = "Failed to accept incoming connection\n" + serverSocket.error_t;
+                        delete client;
                         continue;
                     }
                     std::cout << "\033[35;1mAccepted connection from " << ipAndPort.first << ":" << ipAndPort.second << "\033[0m" << std::endl;
-                    onlineUsers.emplace_back(OnlineEntry{client, "", ipAndPort.first, serverSocket.checkPort(ipAndPort.second), 0});
+                    // spread the connections over the event loops
+                    uint16_t reactorIndex = nextReactor++ % reactors.size();
+                    {
+                        std::lock_guard<std::mutex> lock(stateMutex);
+                        onlineUsers.emplace_back(OnlineEntry{client, NO_ACCOUNT, NO_KEY, ipFromString(ipAndPort.first), (uint16_t)serverSocket.checkPort(ipAndPort.second), 0, reactorIndex, false});
+                    }
 
-                    std::thread([this, ipAndPort]() { clientInstance(ipAndPort); }).detach();
+                    Reactor *reactor = reactors[reactorIndex];
+                    if (!reactor->addSocket(client)) {
+                        std::cerr << "\033[31mFailed to watch connection from " << ipAndPort.first << ":" << ipAndPort.second << ": " << reactor->error_t << "\033[0m" << std::endl;
+                        dropClient(client);
+                        delete client;
+                    }
                 }
             }
         });
     }
 
-    void clientInstance(const std::pair<std::string, std::string> &clientAddr) {
-        while (true) {
-            std::vector<OnlineEntry>::iterator clientEntry = findOnlineUser(clientAddr);
-            if (clientEntry == onlineUsers.end()) {
-                std::cerr << "\033[31mClient " << clientAddr.first << ":" << clientAddr.second << " not found in online list" << "\033[0m" << std::endl;
-                break;
+    // keeps the snapshot close to the ledger's end, so a restart has little to replay
+    void snapshotLoop() {
+        std::unique_lock<std::mutex> lock(snapshotMutex);
+        while (!snapshotWake.wait_for(lock, std::chrono::seconds(snapshotIntervalSec), [this]() { return snapshotStopping; })) {
+            uint64_t offset = ledger.durableOffset();
+            if (offset < snapshotOffset + SNAPSHOT_MIN_LEDGER_BYTES || ledger.hasFailed())
+                continue;
+            lock.unlock();
+            auto start = std::chrono::steady_clock::now();
+            Snapshot snapshot;
+            size_t replayed = 0;
+            bool ok = snapshot.compact(SNAPSHOT_FILE, LEDGER_FILE, offset, &replayed);
+            lock.lock();
+            if (!ok) {
+                std::cerr << "\033[31m" << snapshot.error_t << "\033[0m" << std::endl;
+                continue;
             }
+            snapshotOffset = offset;
+            if (consoleLogLevel >= 1)
+                std::cout << "Snapshot updated to ledger byte " << offset << " with " << replayed << " records in "
+                          << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+        }
+    }
 
-            if (!handleIncomingMessage(clientEntry))
-                break;
+    // called on a reactor thread for every complete frame a client sends
+    bool handleFrame(Reactor *reactor, MySocket *client, const std::string &frame) {
+        // an RSA request is decrypted on the crypto pool. the client's connection is paused meanwhile, so its
+        // requests are still handled in order, while the reactor goes on serving everyone else
+        std::vector<std::string> chunks;
+        if (cryptoPool.running() && MySocket::isRsaMessage(frame) && MySocket::encryptedLines(frame, chunks)) {
+            std::vector<CryptoJob> jobs;
+            for (const auto &chunk : chunks)
+                jobs.push_back(CryptoJob{serverPrivateKey, true, chunk, ""});
+            bool queued = cryptoPool.submit(std::move(jobs), [this, reactor, client, frame](std::vector<CryptoJob> &done) {
+                std::string message;
+                bool decrypted = true;
+                for (const auto &job : done) {
+                    decrypted = decrypted && !job.output.empty();
+                    message += job.output;
+                }
+                CryptoOpCount decryptOps;
+                decryptOps.rsa = done.size();
+                reactor->post([this, reactor, client, frame, message, decrypted, decryptOps]() {
+                    // like decodeEncrypted, a message that does not decrypt is handled as it came
+                    bool keepOpen = decrypted ? handleRequest(client, message, true, decryptOps) : handleRequest(client, frame, false, decryptOps);
+                    reactor->resume(client, keepOpen);
+                });
+            });
+            if (queued) {
+                reactor->pause(client);
+                return true;
+            }
+            // the pool is full, decrypt right here. the reactor slows down and takes in less until it catches up
+        }
+        CryptoOpCount before = cryptoOps;
+        bool encrypted = false;
+        std::string message = client->decodeEncrypted(frame, serverPrivateKey, &encrypted, serverSealingKey);
+        CryptoOpCount decryptOps;
+        decryptOps.rsa = cryptoOps.rsa - before.rsa;
+        decryptOps.aes = cryptoOps.aes - before.aes;
+        decryptOps.x25519 = cryptoOps.x25519 - before.x25519;
+        return handleRequest(client, message, encrypted, decryptOps);
+    }
+
+    // a decrypted request, decryptOps is what decrypting it took
+    bool handleRequest(MySocket *client, std::string message, bool encrypted, const CryptoOpCount &decryptOps) {
+        CryptoOpCount before = cryptoOps;
+
+        // multiplexing clients put @<id><space> in front of a request and get the same prefix back on the reply
+        replyTag() = "";
+        if (message.compare(0, 1, "@") == 0) {
+            size_t space = message.find(' ');
+            if (space != std::string::npos && space <= REQUEST_TAG_MAX) {
+                replyTag() = message.substr(0, space + 1);
+                message.erase(0, space + 1);
+            }
+        }
+
+        requestFailed() = false;
+        auto start = std::chrono::steady_clock::now();
+        // the reply is written once stateMutex is released, so a client that stopped reading holds up only its own event loop
+        client->cork();
+        bool keepOpen = handleIncomingMessage(client, message, encrypted);
+        client->uncork();
+        metrics.observe(STAGE_HANDLE, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        metrics.countRequest(classifyCommand(message), requestFailed());
+
+        uint64_t rsaOps = decryptOps.rsa + cryptoOps.rsa - before.rsa;
+        uint64_t aesOps = decryptOps.aes + cryptoOps.aes - before.aes;
+        uint64_t x25519Ops = decryptOps.x25519 + cryptoOps.x25519 - before.x25519;
+        metrics.countCrypto(rsaOps, aesOps, x25519Ops);
+        if (consoleLogLevel >= 3)
+            std::cerr << "Request took " << rsaOps << " RSA, " << x25519Ops << " X25519 and " << aesOps << " AES operations" << std::endl;
+        return keepOpen;
+    }
+
+    // set by handleIncomingMessage when the request it is handling on this thread is rejected or fails
+    static bool &requestFailed() {
+        static thread_local bool failed = false;
+        return failed;
+    }
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // the request ID prefix of the request this thread is handling, empty for untagged requests.
+    // replies carry it, pushes never do
+    static std::string &replyTag() {
+        static thread_local std::string tag;
+        return tag;
+    }
+
+    // which counter a request goes to, by its keyword. transfers are the only messages with three fields and no keyword
+    static MetricsCommand classifyCommand(const std::string &message) {
+        static const std::pair<const char *, MetricsCommand> keywords[] = {
+            {"HELLO", COMMAND_HELLO}, {"REGISTER", COMMAND_REGISTER}, {"LOGIN", COMMAND_LOGIN}, {"List", COMMAND_LIST}, {"PKEY", COMMAND_PKEY},
+            {"BATCH", COMMAND_BATCH}, {"SESSION", COMMAND_SESSION}, {"SUBSCRIBE", COMMAND_SUBSCRIBE}, {"Exit", COMMAND_EXIT},
+            {"TICKET", COMMAND_TICKET}, {"RESUME", COMMAND_RESUME},
+        };
+        std::string keyword = message.substr(0, message.find('#'));
+        for (const auto &known : keywords) {
+            if (keyword == known.first)
+                return known.second;
+        }
+        return std::count(message.begin(), message.end(), '#') == 2 ? COMMAND_TRANSFER : COMMAND_OTHER;
+    }
+
+    // gauges read at scrape time
+    std::string metricsGauges() {
+        size_t connections = 0;
+        for (Reactor *reactor : reactors)
+            connections += reactor->connectionCount();
+        size_t loggedIn = 0, online;
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            online = onlineUsers.size();
+            for (const auto &user : onlineUsers)
+                loggedIn += user.account != NO_ACCOUNT;
+        }
+        return Metrics::gauge("p2ppay_connections", "Open client connections.", connections) +
+               Metrics::gauge("p2ppay_online_users", "Logged in users.", loggedIn) +
+               Metrics::gauge("p2ppay_guest_connections", "Connections that have not logged in.", online - loggedIn) +
+               Metrics::gauge("p2ppay_accounts", "Registered accounts.", userAccounts.size()) +
+               Metrics::gauge("p2ppay_crypto_queue_depth", "RSA operations waiting for a crypto pool thread.", cryptoPool.queueDepth()) +
+               Metrics::gauge("p2ppay_crypto_rejected_batches", "Messages the full crypto pool turned away since startup, they were done on the reactor.", cryptoPool.rejectedBatches()) +
+               Metrics::gauge("p2ppay_ledger_bytes_since_snapshot", "Ledger bytes a restart would replay.", ledger.durableOffset() - snapshotOffset);
+    }
+
+    // called on a reactor thread when a client connection is about to be closed
+    void dropClient(MySocket *client) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        auto clientEntry = findOnlineUser(client);
+        if (clientEntry != onlineUsers.end()) {
+            // the client did not say Exit, erase it from the online list
+            std::cerr << "\033[31mClient " << ipToString(clientEntry->ipAddr) << ":" << clientEntry->clientPort << " disconnected" << "\033[0m" << std::endl;
+            AccountHandle account = clientEntry->account;
+            eraseOnlineUser(clientEntry);
+            if (account != NO_ACCOUNT)
+                publishPresence("LEAVE#" + userAccounts.get(account).username, account);
         }
         if (consoleLogLevel >= 3)
             std::cerr << "Connection closed" << std::endl;
     }
 
-    std::vector<OnlineEntry>::iterator findOnlineUser(const std::pair<std::string, std::string> &ipAndPort) {
+    std::vector<OnlineEntry>::iterator findOnlineUser(const MySocket *client) {
         for (auto user = onlineUsers.begin(); user != onlineUsers.end(); user++) {
-            int port = serverSocket.checkPort(ipAndPort.second);
-            if (user->ipAddr == ipAndPort.first && user->clientPort == port) {
+            if (user->clientSocket == client)
                 return user;
-            }
         }
         return onlineUsers.end();
     }
 
-    std::vector<UserAccount>::iterator findUserAccount(const std::string &username) {
-        for (auto user = userAccounts.begin(); user != userAccounts.end(); user++) {
-            if (user->username == username) {
-                return user;
+    // log the session out of its account and forget it, with stateMutex held
+    void eraseOnlineUser(std::vector<OnlineEntry>::iterator user) {
+        keyStore.release(user->key);
+        onlineUsers.erase(user);
+    }
+
+    // log the connection user in to account with key, which it takes over, signing out any other session of the
+    // account. the caller publishes the JOIN once it has replied. with stateMutex held
+    void logInSession(std::vector<OnlineEntry>::iterator user, AccountHandle account, KeyId key, uint16_t p2pPort) {
+        for (auto other = onlineUsers.begin(); other != onlineUsers.end(); other++) {
+            if (other->account == account && other != user) {
+                keyStore.release(other->key);
+                other->key = NO_KEY;
+                other->p2pPort = 0;
+                other->account = NO_ACCOUNT;
+                other->subscribed = false;
+                break;
             }
         }
-        return userAccounts.end();
+        if (user->account != NO_ACCOUNT && user->account != account) // same connection, different user
+            publishPresence("LEAVE#" + userAccounts.get(user->account).username, user->account);
+
+        keyStore.release(user->key);
+        user->key = key;
+        user->p2pPort = p2pPort;
+        user->account = account;
     }
 
-    bool handleIncomingMessage(std::vector<OnlineEntry>::iterator &clientEntry) {
-        MySocket *client = clientEntry->clientSocket;
-        std::pair<std::string, std::string> ipAndPort = {clientEntry->ipAddr, std::to_string(clientEntry->clientPort)};
+    // seal what it takes to resume user's session into a ticket only this server can open:
+    // <expiry unix time>#<account handle>#<p2p port>#<base64 session key>#<public key>
+    std::string issueTicket(const OnlineEntry &user, const std::vector<unsigned char> &sessionKey) {
+        uint64_t expiry = time(nullptr) + ticketLifetimeSec;
+        return sessionEncrypt(ticketKey, std::to_string(expiry) + "#" + std::to_string(user.account) + "#" + std::to_string(user.p2pPort) + "#" +
+                                             base64Encode(sessionKey) + "#" + keyStore.pem(user.key));
+    }
 
-        if (consoleLogLevel >= 3)
-            std::cerr << "Waiting for message from " << ipAndPort.first << ":" << ipAndPort.second << std::endl;
+    // check a RESUME#<ticket>#<base64 nonce>#<proof> request. the new session key is derived from the ticket's key
+    // and the nonce, and the proof is RESUME encrypted with it, so a stolen ticket alone is no use. each nonce is
+    // accepted once. returns why the request is refused, empty if session is filled in. with stateMutex held
+    std::string openResumeRequest(const std::vector<std::string> &parts, ResumedSession &session) {
+        std::string contents;
+        if (parts.size() != 4 || ticketKey.empty() || !sessionDecrypt(ticketKey, parts[1], contents))
+            return "invalid ticket";
+        std::vector<std::string> fields = split(contents, '#');
+        uint64_t expiry;
+        try {
+            if (fields.size() != 5)
+                return "invalid ticket";
+            expiry = std::stoull(fields[0]);
+            session.account = std::stoul(fields[1]);
+            session.p2pPort = std::stoul(fields[2]);
+        } catch (const std::exception &e) {
+            return "invalid ticket";
+        }
+        uint64_t now = time(nullptr);
+        if (expiry < now)
+            return "ticket expired";
+        if (session.account >= userAccounts.size())
+            return "invalid ticket";
 
-        bool encrypted = false;
-        std::string message = client->recvEncrypted(serverPrivateKey, &encrypted);
+        std::vector<unsigned char> nonce = base64Decode(parts[2]);
+        std::string proof;
+        if (nonce.size() != RESUME_NONCE_SIZE)
+            return "invalid nonce";
+        session.sessionKey = deriveSessionKey(base64Decode(fields[3]), nonce);
+        if (session.sessionKey.empty() || !sessionDecrypt(session.sessionKey, parts[3], proof) || proof != "RESUME")
+            return "wrong proof";
+
+        while (!resumeNonceLog.empty() && resumeNonceLog.front().first < now) {
+            resumeNonces.erase(resumeNonceLog.front().second);
+            resumeNonceLog.pop_front();
+        }
+        std::string nonceBytes(nonce.begin(), nonce.end());
+        if (!resumeNonces.insert(nonceBytes).second)
+            return "replayed request";
+        // no ticket accepted now is valid for longer than this
+        resumeNonceLog.emplace_back(now + ticketLifetimeSec, nonceBytes);
+        session.publicKey = fields[4];
+        return "";
+    }
+
+    AccountHandle findUserAccount(const std::string &username) {
+        return userAccounts.find(username);
+    }
+
+    bool handleIncomingMessage(MySocket *client, const std::string &message, bool encrypted) {
+        std::unique_lock<std::mutex> lock(stateMutex);
+        auto clientEntry = findOnlineUser(client);
+        if (clientEntry == onlineUsers.end()) {
+            std::cerr << "\033[31mClient " << client->socketNameForDebug << " not found in online list" << "\033[0m" << std::endl;
+            requestFailed() = true;
+            return false;
+        }
+        std::pair<std::string, std::string> ipAndPort = {ipToString(clientEntry->ipAddr), std::to_string(clientEntry->clientPort)};
 
         if (consoleLogLevel >= 3)
             std::cerr << "Received message: " << message << std::endl;
 
-        if (message.empty()) {
-            // check if socket is still connected
-            if (client->error_t == "Connection closed by peer") {
-                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " disconnected" << "\033[0m" << std::endl;
-                // erase the client from the online list
-                onlineUsers.erase(clientEntry);
-                return false; // end the client thread
-            } else if (client->error_t == "Timeout occurred") {
-                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " disconnected (listen timeout)" << "\033[0m" << std::endl;
-            }
+        // get server public key (unencrypted HELLO). HELLO#X25519 asks for the X25519 key, older servers refuse it
+        // as an unencrypted message and the client falls back to HELLO and RSA
+        if (message == "HELLO" || message == "HELLO#X25519") {
+            std::cerr << "Received HELLO from " << ipAndPort.first << ":" << ipAndPort.second << std::endl;
+            bool sealing = message != "HELLO" && !serverSealingPublicKey.empty();
+            client->send(replyTag() + (sealing ? serverSealingPublicKey : serverPublicKey) + "\r\n");
             return true;
         }
 
-        // get server public key (unencrypted HELLO)
-        if (message == "HELLO") {
-            std::cerr << "Received HELLO from " << ipAndPort.first << ":" << ipAndPort.second << std::endl;
-            client->send(serverPublicKey + "\r\n");
+        // resume a session from a ticket, unencrypted since the ticket is sealed. the reply is encrypted with the
+        // resumed session's key, so only the client the ticket was issued to can read it
+        if (message.compare(0, 7, "RESUME#") == 0) {
+            if (refuseWithoutLedger(client, ipAndPort))
+                return true;
+            ResumedSession session;
+            std::string refused = openResumeRequest(split(message, '#'), session);
+            KeyId key = refused.empty() ? keyStore.acquire(session.publicKey) : NO_KEY;
+            if (refused.empty() && key == NO_KEY)
+                refused = "invalid public key";
+            if (!refused.empty()) {
+                client->send(replyTag() + "220 AUTH FAIL\r\n");
+                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to resume a session, " << refused << "\033[0m" << std::endl;
+                requestFailed() = true;
+                return true;
+            }
+            logInSession(clientEntry, session.account, key, session.p2pPort);
+            client->sessionKey = session.sessionKey;
+            client->sendEncrypted(nullptr, replyTag() + "100 RESUMED\r\n");
+            const std::string &username = userAccounts.get(session.account).username;
+            publishPresence("JOIN#" + username + "#" + ipAndPort.first + "#" + std::to_string(session.p2pPort) + "#" + keyStore.fingerprint(key), session.account);
+            if (consoleLogLevel >= 1) {
+                std::cout << "\033[32;1mClient " << ipAndPort.first << ":" << ipAndPort.second
+                          << " resumed the session of " << username << "\033[0m" << std::endl;
+                if (consoleLogLevel >= 2)
+                    printOnlineList();
+            }
             return true;
         }
 
         /// ENCRYPTED MESSAGES
         if (!encrypted) {
-            client->send("Invalid unencrypted message format\r\n");
+            client->send(replyTag() + "Invalid unencrypted message format\r\n");
+            requestFailed() = true;
             return true;
         }
 
         std::vector<std::string> parts = split(message, '#');
         if (parts.size() < 1) {
             error_t = "Invalid message format";
+            requestFailed() = true;
             return true;
         }
 
         if (parts[0] == "List") {
-            auto onlineUser = findOnlineUser(ipAndPort);
-            if (onlineUser == onlineUsers.end()) {
-                client->send("Please log in first\r\n");
-                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " requested online list but not found in online list" << "\033[0m" << std::endl;
+            if (clientEntry->account == NO_ACCOUNT) {
+                client->send(replyTag() + "Please log in first\r\n");
+                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " requested online list but is not logged in" << "\033[0m" << std::endl;
+                requestFailed() = true;
                 return true;
             }
-            auto userAccount = findUserAccount(onlineUser->username);
-            if (userAccount == userAccounts.end()) {
-                client->send("Please register first\r\n");
-                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " requested online list but not found in user accounts" << "\033[0m" << std::endl;
-                return true;
-            }
-            sendOnlineUsers(*client, *userAccount, onlineUser->publicKey);
+            // List#FP also asks for the key fingerprints, older clients would read them as part of the port
+            sendOnlineUsers(*client, clientEntry->account, keyStore.parsed(clientEntry->key).get(), parts.size() > 1 && parts[1] == "FP");
         } else if (parts[0] == "Exit") {
             // logout
             if (parts.size() != 1) {
                 error_t = "Invalid message format";
+                requestFailed() = true;
                 return true;
             }
-            client->send("Bye\r\n");
+            client->send(replyTag() + "Bye\r\n");
             if (consoleLogLevel >= 3)
                 std::cerr << "\033[34mClient " << ipAndPort.first << ":" << ipAndPort.second << " logged out" << "\033[0m" << std::endl;
             std::string username;
-            auto onlineUser = findOnlineUser(ipAndPort);
+            auto onlineUser = clientEntry;
             if (onlineUser == onlineUsers.end()) {
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " logged out but not found in online list" << "\033[0m" << std::endl;
                 username = "unknown";
             } else {
-                username = onlineUser->username;
-                if (username.empty()) {
-                    username = "<guest>";
-                }
+                username = onlineUser->account != NO_ACCOUNT ? userAccounts.get(onlineUser->account).username : "<guest>";
             }
             if (consoleLogLevel >= 1) {
                 std::cout << "\033[34;1mClient " << username << " logged out" << "\033[0m" << std::endl;
@@ -207,59 +628,83 @@ public:
                 }
             }
 
-            onlineUsers.erase(onlineUser);
+            AccountHandle account = onlineUser->account;
+            eraseOnlineUser(onlineUser);
+            if (account != NO_ACCOUNT)
+                publishPresence("LEAVE#" + username, account);
             return false;
         } else if (parts[0] == "REGISTER") {
             if (parts.size() != 2) {
                 error_t = "Invalid message format";
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to register username, " << error_t << "\033[0m" << std::endl;
+                requestFailed() = true;
                 return true;
             }
-            if (registerUser(*client, parts[1])) {
-                if (consoleLogLevel >= 1) {
-                    std::cout << "\033[36;1mClient " << ipAndPort.first << ":" << ipAndPort.second
-                              << " registered username " << parts[1] << "\033[0m" << std::endl;
-                    if (consoleLogLevel >= 2)
-                        printOnlineList();
-                }
-            } else
+            if (refuseWithoutLedger(client, ipAndPort))
+                return true;
+            // the account is only acknowledged once its record is on disk. the reply is sent from the commit callback
+            // through the event loop that owns the connection, so this one keeps serving others during the flush
+            Reactor *reactor = reactors[clientEntry->reactor];
+            std::string tag = replyTag(), username = parts[1];
+            auto onDurable = [this, reactor, client, tag, username, ipAndPort](bool durable) {
+                reactor->postTo(client, [this, tag, username, ipAndPort, durable](MySocket *client) {
+                    if (!durable) {
+                        client->send(tag + "230 SERVER ERROR\r\n");
+                        // the account stays in memory, but with the ledger failed nobody can log in to it or pay with it
+                        std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " registered " << username << " but the ledger write failed" << "\033[0m" << std::endl;
+                        return;
+                    }
+                    client->send(tag + "100 OK\r\n");
+                    if (consoleLogLevel >= 1) {
+                        std::cout << "\033[36;1mClient " << ipAndPort.first << ":" << ipAndPort.second
+                                  << " registered username " << username << "\033[0m" << std::endl;
+                        if (consoleLogLevel >= 2) {
+                            std::lock_guard<std::mutex> lock(stateMutex);
+                            printOnlineList();
+                        }
+                    }
+                });
+            };
+            if (!registerUser(parts[1], onDurable)) {
+                client->send(replyTag() + "210 FAIL\r\n");
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << "\033[0m" << ipAndPort.second
                           << " failed to register username " << parts[1] << ", " << error_t << std::endl;
+                requestFailed() = true;
+            }
             return true;
 
         } else if (parts[0] == "LOGIN") {
             if (parts.size() != 4) {
                 error_t = "Invalid message format, please include the public key";
+                requestFailed() = true;
                 return true;
             }
+            if (refuseWithoutLedger(client, ipAndPort))
+                return true;
 
-            auto userAccount = findUserAccount(parts[1]);
-            if (userAccount == userAccounts.end()) {
-                client->send("220 AUTH FAIL\r\n");
+            AccountHandle userAccount = findUserAccount(parts[1]);
+            if (userAccount == NO_ACCOUNT) {
+                client->send(replyTag() + "220 AUTH FAIL\r\n");
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to log in, user not found" << "\033[0m" << std::endl;
+                requestFailed() = true;
                 return true;
             }
-            auto clientOnline = findOnlineUser(ipAndPort);
-            if (clientOnline == onlineUsers.end()) {
-                client->send("230 SERVER ERROR\r\n");
-                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " socket connection not found" << "\033[0m" << std::endl;
+            KeyId key = keyStore.acquire(parts[3]);
+            if (key == NO_KEY) {
+                client->send(replyTag() + "220 AUTH FAIL\r\n");
+                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to log in, invalid public key" << "\033[0m" << std::endl;
+                requestFailed() = true;
                 return true;
             }
+            auto clientOnline = clientEntry;
 
-            // check other log in sessions and sign them out
-            for (auto user = onlineUsers.begin(); user != onlineUsers.end(); user++) {
-                if (user->username == parts[1]) {
-                    user->username = "";
-                    user->p2pPort = 0;
-                    break;
-                }
-            }
-
-            clientOnline->username = parts[1];
-            clientOnline->p2pPort = clientOnline->clientSocket->checkPort(parts[2]);
-            clientOnline->publicKey = parts[3];
+            // a port that does not check out is stored as 0, no P2P port
+            int p2pPort = clientOnline->clientSocket->checkPort(parts[2]);
+            logInSession(clientOnline, userAccount, key, p2pPort > 0 ? p2pPort : 0);
 
-            sendOnlineUsers(*client, *userAccount, clientOnline->publicKey);
+            sendOnlineUsers(*client, userAccount, keyStore.parsed(key).get());
+            // a JOIN for a name already in the list replaces the old entry, so a re-login needs no LEAVE
+            publishPresence("JOIN#" + parts[1] + "#" + ipToString(clientOnline->ipAddr) + "#" + std::to_string(clientOnline->p2pPort) + "#" + keyStore.fingerprint(key), userAccount);
 
             if (consoleLogLevel >= 1) {
                 std::cout << "\033[32;1mClient " << ipAndPort.first << ":" << ipAndPort.second
@@ -268,39 +713,88 @@ public:
                     printOnlineList();
             }
 
+            return true;
+        } else if (parts[0] == "SUBSCRIBE") {
+            // format: SUBSCRIBE#<last presence version the client has, 0 for none>
+            if (clientEntry->account == NO_ACCOUNT) {
+                client->send(replyTag() + "Please log in first\r\n");
+                requestFailed() = true;
+                return true;
+            }
+            uint64_t version = 0;
+            try {
+                if (parts.size() == 2)
+                    version = std::stoull(parts[1]);
+            } catch (const std::exception &e) {
+            }
+            clientEntry->subscribed = true;
+            sendPresenceSince(*clientEntry, version);
+            if (consoleLogLevel >= 3)
+                std::cerr << "Client " << ipAndPort.first << ":" << ipAndPort.second << " subscribed to presence at version " << version << std::endl;
+            return true;
+        } else if (parts[0] == "SESSION") {
+            // the client picked a symmetric key for the rest of this connection, it arrived under our RSA or X25519 key
+            std::vector<unsigned char> key;
+            if (parts.size() == 2)
+                key = base64Decode(parts[1]);
+            if (key.size() != SESSION_KEY_SIZE) {
+                client->send(replyTag() + "250 MESSAGE_ERROR\r\n");
+                requestFailed() = true;
+                return true;
+            }
+            client->sessionKey = key;
+            client->sendEncrypted(nullptr, replyTag() + "100 SESSION OK\r\n");
+            if (consoleLogLevel >= 3)
+                std::cerr << "Client " << ipAndPort.first << ":" << ipAndPort.second << " switched to session encryption" << std::endl;
+            return true;
+        } else if (parts[0] == "TICKET") {
+            // a ticket to resume this session with after a lost connection, TICKET#<seconds it is valid>#<ticket>.
+            // only a session has a symmetric key to resume
+            if (clientEntry->account == NO_ACCOUNT) {
+                client->send(replyTag() + "Please log in first\r\n");
+                requestFailed() = true;
+                return true;
+            }
+            if (client->sessionKey.empty() || ticketLifetimeSec <= 0 || ticketKey.empty()) {
+                client->send(replyTag() + "250 MESSAGE_ERROR\r\n");
+                requestFailed() = true;
+                return true;
+            }
+            client->sendEncrypted(nullptr, replyTag() + "TICKET#" + std::to_string(ticketLifetimeSec) + "#" + issueTicket(*clientEntry, client->sessionKey) + "\r\n");
             return true;
         } else if (parts[0] == "PKEY") {
             if (parts.size() == 1) {
-                client->send(serverPublicKey + "\r\n");
+                client->send(replyTag() + serverPublicKey + "\r\n");
                 return true;
             } else {
-                for (auto user = onlineUsers.begin(); user != onlineUsers.end(); user++) {
-                    if (user->username == parts[1]) {
-                        client->send(user->publicKey + "\r\n");
+                AccountHandle account = findUserAccount(parts[1]);
+                for (auto user = onlineUsers.begin(); account != NO_ACCOUNT && user != onlineUsers.end(); user++) {
+                    if (user->account == account) {
+                        client->send(replyTag() + keyStore.pem(user->key) + "\r\n");
                         return true;
                     }
                 }
             }
-            client->send("240 User_not_found\r\n");
+            client->send(replyTag() + "240 User_not_found\r\n");
+            requestFailed() = true;
             return true;
         } else if (parts[0] == "Exit") {
             // logout
             if (parts.size() != 1) {
                 error_t = "Invalid message format";
+                requestFailed() = true;
                 return true;
             }
-            client->send("Bye\r\n");
+            client->send(replyTag() + "Bye\r\n");
             if (consoleLogLevel >= 3)
                 std::cerr << "\033[34mClient " << ipAndPort.first << ":" << ipAndPort.second << " logged out" << "\033[0m" << std::endl;
             std::string username;
-            auto onlineUser = findOnlineUser(ipAndPort);
+            auto onlineUser = clientEntry;
             if (onlineUser == onlineUsers.end()) {
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " logged out but not found in online list" << "\033[0m" << std::endl;
                 username = "unknown";
             } else {
-                username = onlineUser->username;
-                if (username.empty())
-                    username = "<guest>";
+                username = onlineUser->account != NO_ACCOUNT ? userAccounts.get(onlineUser->account).username : "<guest>";
             }
             if (consoleLogLevel >= 1) {
                 std::cout << "\033[34;1mClient " << username << " logged out" << "\033[0m" << std::endl;
@@ -308,54 +802,77 @@ public:
                     printOnlineList();
             }
 
-            onlineUsers.erase(onlineUser);
+            AccountHandle account = onlineUser->account;
+            eraseOnlineUser(onlineUser);
+            if (account != NO_ACCOUNT)
+                publishPresence("LEAVE#" + username, account);
             return false;
+        } else if (parts[0] == "BATCH") {
+            // payments a payee collected and forwards in one message, BATCH#<count><CRLF><payer#amount#payee><CRLF>...
+            std::vector<std::string> lines = split(message, '\n');
+            for (auto &line : lines) {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+            }
+            size_t count = 0;
+            try {
+                count = parts.size() > 1 ? std::stoul(lines[0].substr(6)) : 0;
+            } catch (const std::exception &e) {
+            }
+            if (count == 0 || count > FORWARD_BATCH_LIMIT || lines.size() < count + 1) {
+                std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " sent an invalid batch" << "\033[0m" << std::endl;
+                client->send(replyTag() + "250 MESSAGE_ERROR\r\n");
+                requestFailed() = true;
+                return true;
+            }
+            if (refuseWithoutLedger(client, ipAndPort))
+                return true;
+            std::vector<PendingTransfer> batch;
+            for (size_t i = 1; i <= count; i++)
+                batch.push_back(resolveTransfer(split(lines[i], '#'), clientEntry->account));
+            SharedKey payeeKey = keyStore.parsed(clientEntry->key);
+
+            // apply the whole batch in one pass, each payer is confirmed on its own as its record is committed.
+            // the payee gets one line per payment, <index>#OK or <index>#FAILED#<reason>
+            lock.unlock();
+            std::string results = "BATCH#" + std::to_string(count) + "\r\n";
+            size_t failed = 0;
+            for (size_t i = 0; i < batch.size(); i++) {
+                std::string error = batch[i].error.empty() ? executeTransfer(batch[i]) : batch[i].error;
+                if (!error.empty()) {
+                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment " << i << " of a batch, " << error << "\033[0m" << std::endl;
+                    failed++;
+                }
+                results += std::to_string(i) + (error.empty() ? "#OK" : "#FAILED#" + error) + "\r\n";
+            }
+            if (consoleLogLevel >= 3)
+                std::cerr << "Applied batch of " << count << " micropayments, " << failed << " failed" << std::endl;
+            client->sendEncrypted(payeeKey.get(), replyTag() + results);
+            if (failed > 0)
+                requestFailed() = true;
         } else { // no keywords
             if (parts.size() == 3) {
                 // I hope it is a micropayment transfer
-                auto payer = findUserAccount(parts[0]);
-                auto payee = findUserAccount(parts[2]);
-                if (payer == userAccounts.end()) {
-                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, payer not found" << "\033[0m" << std::endl;
-                    return true;
-                }
-                if (payee == userAccounts.end()) {
-                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, payee not found" << "\033[0m" << std::endl;
-                    return true;
-                }
-                // check online
-                auto payeeOnline = findOnlineUser({ipAndPort.first, ipAndPort.second});
-                if (payeeOnline == onlineUsers.end() || payeeOnline->username != parts[2]) {
-                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, payee not online, or message not from payee" << "\033[0m" << std::endl;
-                    return true;
-                }
-                auto payerOnline = std::vector<OnlineEntry>::iterator();
-                for (auto user = onlineUsers.begin(); user != onlineUsers.end(); user++) {
-                    if (user->username == parts[0]) {
-                        payerOnline = user;
-                        break;
-                    }
-                }
-                if (payerOnline == onlineUsers.end()) {
-                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, payer not online" << "\033[0m" << std::endl;
-                }
-                try {
-                    int amount = std::stoi(parts[1]);
-                } catch (const std::exception &e) {
-                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, failed to convert " << parts[1] << " to integer." << "\033[0m" << std::endl;
+                PendingTransfer transfer = resolveTransfer(parts, clientEntry->account);
+                if (!transfer.error.empty()) {
+                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, " << transfer.error << "\033[0m" << std::endl;
+                    requestFailed() = true;
                     return true;
                 }
 
-                // transfer the amount
-                payer->balance -= std::stoi(parts[1]);
-                payee->balance += std::stoi(parts[1]);
-
-                // send confirmation to payer
-                payerOnline->clientSocket->sendEncrypted(stringToKey(payerOnline->publicKey, false), "Transfer OK!\r\n");
+                // the balances are guarded by the transfer engine's own locks, so the reactors only
+                // contend on the two accounts involved instead of on the whole server state
+                lock.unlock();
+                std::string error = executeTransfer(transfer);
+                if (!error.empty()) {
+                    std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " failed to transfer micropayment, " << error << "\033[0m" << std::endl;
+                    requestFailed() = true;
+                }
             } else {
                 error_t = "Invalid message format";
                 std::cerr << "\033[31mClient " << ipAndPort.first << ":" << ipAndPort.second << " sent an invalid message: " << message << "\033[0m" << std::endl;
-                client->send("250 MESSAGE_ERROR\r\n");
+                client->send(replyTag() + "250 MESSAGE_ERROR\r\n");
+                requestFailed() = true;
             }
         }
         return true;
@@ -369,9 +886,11 @@ public:
                   << std::setw(10) << "P2P Port"
                   << std::setw(10) << "Public key" << std::endl;
         for (const auto &user : onlineUsers) {
-            std::string publicKey = user.publicKey.length() > 40 ? user.publicKey.substr(27, 37) + "..." : "N/A";
-            std::cerr << std::right << std::setw(20) << user.username + "  "
-                      << std::left << std::setw(16) << user.ipAddr
+            const std::string &pem = keyStore.pem(user.key);
+            std::string publicKey = pem.length() > 40 ? pem.substr(27, 37) + "..." : "N/A";
+            std::string username = user.account != NO_ACCOUNT ? userAccounts.get(user.account).username : "";
+            std::cerr << std::right << std::setw(20) << username + "  "
+                      << std::left << std::setw(16) << ipToString(user.ipAddr)
                       << std::setw(6) << user.clientPort
                       << std::setw(10) << user.p2pPort
                       << std::setw(10) << publicKey << std::endl;
@@ -379,40 +898,191 @@ public:
         std::cerr << "\033[0m";
     }
 
-    bool registerUser(MySocket &client, const std::string &username) {
-        for (auto &user : userAccounts) {
-            if (user.username == username) {
-                client.send("210 FAIL\r\n");
-                error_t = "User already exists";
-                return false;
-            }
+    // create the account and queue its ledger record, onDurable is called once the record is on disk or failed to get there.
+    // with stateMutex held, and onDurable may run before this returns, so it must not take it
+    bool registerUser(const std::string &username, const std::function<void(bool)> &onDurable) {
+        // the name is a field of a ledger record, a '#' or a line break in it would write records of its own
+        if (!Ledger::validField(username)) {
+            error_t = "Invalid username";
+            return false;
+        }
+        if (userAccounts.insert(username, 10000) == NO_ACCOUNT) {
+            error_t = "User already exists";
+            return false;
         }
-        UserAccount newUser;
-        newUser.username = username;
-        newUser.balance = 10000;
-        userAccounts.emplace_back(newUser);
-        client.send("100 OK\r\n");
+        ledger.append("REGISTER#" + username + "#10000", onDurable);
+        return true;
+    }
+
+    // once the ledger has failed nothing can be made durable, so accounts, logins and transfers are refused. this also
+    // keeps out an account whose REGISTER was in memory but never reached the disk. with stateMutex held
+    bool refuseWithoutLedger(MySocket *client, const std::pair<std::string, std::string> &ipAndPort) {
+        if (!ledger.hasFailed())
+            return false;
+        client->send(replyTag() + "230 SERVER ERROR\r\n");
+        std::cerr << "\033[31mRefused a request from " << ipAndPort.first << ":" << ipAndPort.second << ", the ledger has failed" << "\033[0m" << std::endl;
+        requestFailed() = true;
         return true;
     }
 
-    bool sendOnlineUsers(MySocket &client, const UserAccount &record, const std::string &clientKeyStr) {
-        std::string response = std::to_string(record.balance) + "\r\n";
+    // check a payer#amount#payee forwarded by sender, with stateMutex held. error is set if it cannot be applied
+    PendingTransfer resolveTransfer(const std::vector<std::string> &parts, AccountHandle sender) {
+        PendingTransfer transfer{NO_ACCOUNT, NO_ACCOUNT, 0, ""};
+        if (parts.size() != 3) {
+            transfer.error = "invalid format";
+            return transfer;
+        }
+        transfer.payer = findUserAccount(parts[0]);
+        transfer.payee = findUserAccount(parts[2]);
+        if (transfer.payer == NO_ACCOUNT) {
+            transfer.error = "payer not found";
+        } else if (transfer.payee == NO_ACCOUNT) {
+            transfer.error = "payee not found";
+        } else if (sender != transfer.payee) {
+            // check online
+            transfer.error = "payee not online, or message not from payee";
+        } else {
+            try {
+                transfer.amount = std::stoi(parts[1]);
+            } catch (const std::exception &e) {
+                transfer.error = "failed to convert " + parts[1] + " to integer.";
+            }
+        }
+        return transfer;
+    }
+
+    // move the money and queue the ledger record, without stateMutex. returns why it failed, or an empty string
+    std::string executeTransfer(const PendingTransfer &transfer) {
+        AccountHandle payer = transfer.payer, payee = transfer.payee;
+        int amount = transfer.amount;
+        if (ledger.hasFailed()) {
+            confirmTransfer(payer, payee, false, "the server cannot record transfers");
+            return "ledger failed";
+        }
+        TransferResult result = transfers.transfer(payer, payee, amount);
+        if (result != TRANSFER_OK) {
+            confirmTransfer(payer, payee, false);
+            return result == TRANSFER_INSUFFICIENT_FUNDS ? "insufficient funds" : "invalid amount";
+        }
+
+        // the payer is told once the transfer is committed. the reactor moves on meanwhile,
+        // so transfers from all connections share the ledger's group commits.
+        // a transfer that does not make it to disk is undone before the payer hears of it
+        uint64_t seq = ledger.append("TRANSFER#" + userAccounts.get(payer).username + "#" + std::to_string(amount) + "#" + userAccounts.get(payee).username,
+                                     [this, payer, payee, amount](bool durable) {
+                                         if (!durable)
+                                             transfers.reverse(payer, payee, amount);
+                                         confirmTransfer(payer, payee, durable, durable ? "" : "the server could not record it and undid it");
+                                     });
+        return seq == 0 ? "ledger failed" : "";
+    }
+
+    // tell the payer how the transfer went, with why it failed if it did. runs on the ledger flusher thread once a
+    // transfer has been written to disk, or right away on the reactor when it was rejected
+    void confirmTransfer(AccountHandle payer, AccountHandle payee, bool ok, const std::string &reason = "") {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        pushBalance(payee);
+        for (auto &user : onlineUsers) {
+            if (user.account == payer) {
+                pushTo(user, ok ? "Transfer OK!\r\n" : "Transfer FAILED" + (reason.empty() ? "" : ", " + reason) + "\r\n");
+                pushBalance(payer);
+                return;
+            }
+        }
+        std::cerr << "\033[31mTransfer from " << userAccounts.get(payer).username << " finished, but the payer is no longer online" << "\033[0m" << std::endl;
+    }
+
+    // record a JOIN or LEAVE of account and push it to every subscriber. call with stateMutex held.
+    // pushes look like PRESENCE#<from version>#<to version><CRLF><change><CRLF>...
+    void publishPresence(const std::string &change, AccountHandle account) {
+        transfers.touch(account);
+        uint64_t from = presenceVersion++;
+        presenceLog.emplace_back(presenceVersion, change);
+        if (presenceLog.size() > PRESENCE_LOG_SIZE)
+            presenceLog.pop_front();
+        std::string push = "PRESENCE#" + std::to_string(from) + "#" + std::to_string(presenceVersion) + "\r\n" + change + "\r\n";
+        for (auto &user : onlineUsers) {
+            if (user.subscribed && user.account != NO_ACCOUNT)
+                pushTo(user, push);
+        }
+    }
+
+    // a balance is private to its owner, so it is pushed to that user alone and does not bump the version
+    void pushBalance(AccountHandle account) {
+        for (auto &user : onlineUsers) {
+            if (user.subscribed && user.account == account) {
+                std::string version = std::to_string(presenceVersion);
+                pushTo(user, "PRESENCE#" + version + "#" + version + "\r\nBALANCE#" + std::to_string(transfers.balance(account)) + "\r\n");
+            }
+        }
+    }
+
+    // send message to user from the event loop that owns its connection, with stateMutex held. the socket is
+    // never written to under the lock, and a client that stopped reading holds up only its own event loop, until
+    // the send times out and the connection is dropped
+    void pushTo(const OnlineEntry &user, const std::string &message) {
+        SharedKey key = keyStore.parsed(user.key);
+        Reactor *reactor = reactors[user.reactor];
+        reactor->postTo(user.clientSocket, [reactor, key, message](MySocket *client) {
+            if (!client->sendEncrypted(key.get(), message)) {
+                std::cerr << "\033[31mFailed to push to " << client->socketNameForDebug << ", closing the connection: " << client->error_t << "\033[0m" << std::endl;
+                reactor->close(client);
+            }
+        });
+    }
+
+    // bring a subscriber from its version to the current one: the missed changes if they are still in the log,
+    // otherwise a full snapshot in the List format, PRESENCE#FULL#<version><CRLF><balance><CRLF><count><CRLF><users>.
+    // this is the reply to SUBSCRIBE, so it carries the request's tag
+    void sendPresenceSince(OnlineEntry &user, uint64_t version) {
+        bool inLog = version > 0 && version <= presenceVersion && (presenceLog.empty() || presenceLog.front().first <= version + 1);
+        if (!inLog) {
+            user.clientSocket->sendEncrypted(keyStore.parsed(user.key).get(), replyTag() + "PRESENCE#FULL#" + std::to_string(presenceVersion) + "\r\n" + onlineUsersText(user.account, true));
+            return;
+        }
+        std::string push = "PRESENCE#" + std::to_string(version) + "#" + std::to_string(presenceVersion) + "\r\n";
+        for (const auto &change : presenceLog) {
+            if (change.first > version)
+                push += change.second + "\r\n";
+        }
+        push += "BALANCE#" + std::to_string(transfers.balance(user.account)) + "\r\n";
+        user.clientSocket->sendEncrypted(keyStore.parsed(user.key).get(), replyTag() + push);
+    }
+
+    // the List response: the account's balance, then every logged in user as <username>#<ip>#<p2p port>,
+    // followed by #<key fingerprint> when withFingerprints is set
+    std::string onlineUsersText(AccountHandle account, bool withFingerprints = false) {
+        std::string response = std::to_string(transfers.balance(account)) + "\r\n";
 
         // response += serverPublicKey + "\r\n";
 
-        std::vector<OnlineEntry> filteredOnlineUsers;
+        size_t count = 0;
+        for (const auto &onlineUser : onlineUsers)
+            count += onlineUser.account != NO_ACCOUNT;
+        response += std::to_string(count) + "\r\n";
+        char ip[INET_ADDRSTRLEN];
         for (const auto &onlineUser : onlineUsers) {
-            if (onlineUser.username.empty())
+            if (onlineUser.account == NO_ACCOUNT)
                 continue;
-            filteredOnlineUsers.emplace_back(onlineUser);
-        }
-
-        response += std::to_string(filteredOnlineUsers.size()) + "\r\n";
-        for (const auto &onlineUser : filteredOnlineUsers) {
-            response += onlineUser.username + "#" + onlineUser.ipAddr + "#" + std::to_string(onlineUser.p2pPort) + "\r\n";
+            struct in_addr addr;
+            addr.s_addr = onlineUser.ipAddr;
+            response += userAccounts.get(onlineUser.account).username;
+            response += '#';
+            response += inet_ntop(AF_INET, &addr, ip, sizeof(ip)) ? ip : "";
+            response += '#';
+            response += std::to_string(onlineUser.p2pPort);
+            if (withFingerprints) {
+                response += '#';
+                response += keyStore.fingerprint(onlineUser.key);
+            }
+            response += "\r\n";
         }
+        return response;
+    }
 
-        if (client.sendEncrypted(stringToKey(clientKeyStr, false), response)) {
+    bool sendOnlineUsers(MySocket &client, AccountHandle account, EVP_PKEY *clientKey, bool withFingerprints = false) {
+        const UserAccount &record = userAccounts.get(account);
+        if (client.sendEncrypted(clientKey, replyTag() + onlineUsersText(account, withFingerprints))) {
             if (consoleLogLevel >= 3)
                 std::cerr << "Sent online users list to " << record.username << std::endl;
             return true;
@@ -429,6 +1099,27 @@ public:
             std::cerr << "Stopping server listening thread" << std::endl;
         if (listeningThread.joinable())
             listeningThread.join();
+        // before the reactors, the last decrypted requests are posted to them
+        cryptoPool.stop();
+        for (Reactor *reactor : reactors) {
+            reactor->stop();
+            delete reactor;
+        }
+        reactors.clear();
+        {
+            std::lock_guard<std::mutex> lock(snapshotMutex);
+            snapshotStopping = true;
+        }
+        snapshotWake.notify_all();
+        if (snapshotThread.joinable())
+            snapshotThread.join(); // waits for a snapshot that is being written
+        ledger.close();
+        metrics.stopEndpoint();
+        uint64_t requestCount = metrics.totalRequests();
+        if (requestCount > 0)
+            std::cerr << "Handled " << requestCount << " requests with " << std::fixed << std::setprecision(2)
+                      << (double)metrics.totalCrypto(true) / requestCount << " RSA and " << (double)metrics.totalCrypto(false) / requestCount
+                      << " AES operations per request" << std::endl;
         std::cerr << "\033[7mServer stopped successfully\033[0m" << std::endl;
     }
 };
@@ -3,8 +3,12 @@
 
 #include <gtkmm.h>
 #include <vector>
+#include <unordered_map>
 #include "../serverAction.h"
 
+// rows added in one refresh above which the sorted view is rebuilt instead of updated row by row
+#define TABLE_BULK_ROWS 1000
+
 using namespace Gtk;
 using namespace Glib;
 
@@ -91,7 +95,7 @@ public:
         });
 
         filterGrid.set_column_spacing(10);
-        onlineUsersGrid.attach(filterGrid, 3, 0, 3, 1);
+        userStatusGrid.attach(filterGrid, 2, 2, 3, 1);
         Label *filterLabel = manage(new Label("Filter:"));
         filterGrid.attach(*filterLabel, 0, 0, 1, 1);
         filterLabel->set_halign(Align::ALIGN_END);
@@ -100,18 +104,45 @@ public:
         filterGrid.attach(usernameFilterEntry, 1, 0, 1, 1);
         usernameFilterEntry.set_placeholder_text("Filter by username");
         usernameFilterEntry.signal_changed().connect([this]() {
-            updateUsers();
+            filterText = usernameFilterEntry.get_text();
+            filteredModel->refilter();
+            updateHiddenByFilter();
         });
 
-        // bottom part
-        scrolledWindow.add(onlineUsersGrid);
+        // bottom part, the table only draws the rows that are scrolled into view
+        scrolledWindow.add(onlineUsersView);
+        scrolledWindow.set_policy(PolicyType::POLICY_AUTOMATIC, PolicyType::POLICY_AUTOMATIC);
+
+        onlineUsersView.set_margin_top(15);
+        onlineUsersView.set_margin_bottom(15);
+        onlineUsersView.set_margin_start(15);
+        onlineUsersView.set_margin_end(15);
+
+        Pango::FontDescription tableFont;
+        tableFont.set_family("monospace");
+        tableFont.set_size(12 * PANGO_SCALE);
+        onlineUsersView.override_font(tableFont);
+
+        userStore = ListStore::create(columns);
+        attachModel();
 
-        onlineUsersGrid.set_row_spacing(5);
-        onlineUsersGrid.set_column_spacing(10);
-        onlineUsersGrid.set_margin_top(15);
-        onlineUsersGrid.set_margin_bottom(15);
-        onlineUsersGrid.set_margin_start(15);
-        onlineUsersGrid.set_margin_end(15);
+        appendColumn("Username", columns.username, 160);
+        appendColumn("Transfer Address", columns.address, 200);
+        appendColumn("Balance", columns.balance, 100);
+        appendColumn("Status", columns.status, 80);
+        // every column has a fixed width, so rows are measured once instead of each one being laid out
+        onlineUsersView.set_fixed_height_mode(true);
+
+        onlineUsersView.signal_row_activated().connect([this](const TreeModel::Path &path, TreeViewColumn *) {
+            showUserDetails(sortedModel->get_iter(path)->get_value(columns.account));
+        });
+
+        mainBox.pack_start(hiddenByFilterLabel, false, false);
+        Pango::FontDescription tableHeaderFont;
+        tableHeaderFont.set_style(Pango::Style::STYLE_ITALIC);
+        hiddenByFilterLabel.set_text("Some users are hidden by the filter");
+        hiddenByFilterLabel.override_font(tableHeaderFont);
+        hiddenByFilterLabel.set_no_show_all(true);
 
         updateUsers();
 
@@ -121,8 +152,6 @@ public:
     void on_show() override {
         Window::on_show();
 
-        fetchOk = true;
-
         updateAll();
 
         signal_timeout().connect(sigc::mem_fun(*this, &ServerMainWindow::autoRefresh), 1000);
@@ -135,157 +164,111 @@ public:
 
     void updateAll() {
         updateUsers();
-        show_all_children();
     }
 
+    // bring the table up to date. only accounts whose version moved since the last refresh are read again,
+    // and only their rows are touched, so an idle server costs one counter read per refresh
     void updateUsers() {
-        for (auto &child : onlineUsersGrid.get_children()) {
-            if (child != &filterGrid)
-                onlineUsersGrid.remove(*child);
+        uint64_t changeCount = serverAction.transfers.changeCount();
+        size_t accountCount = serverAction.userAccounts.size();
+        if (changeCount == shownChangeCount && accountCount == rows.size())
+            return;
+        shownChangeCount = changeCount;
+
+        // new accounts get a row each. a large batch, like the first refresh, is added with the sorted
+        // and filtered views detached, so they sort once instead of once per row
+        bool bulk = accountCount - rows.size() > TABLE_BULK_ROWS;
+        if (bulk)
+            detachModel();
+        for (AccountHandle account = rows.size(); account < accountCount; account++) {
+            TreeModel::Row row = *userStore->append();
+            row[columns.account] = account;
+            row[columns.username] = serverAction.userAccounts.get(account).username;
+            row[columns.address] = "N/A";
+            row[columns.status] = "Offline";
+            rows.push_back(row);
+            shownVersions.push_back(UINT64_MAX);
         }
-
-        std::vector<std::pair<std::string, std::pair<OnlineEntry *, int>>> allValidUsers;
-
-        for (auto &user : serverAction.onlineUsers) {
-            if (user.username.empty())
-                continue;
-            if (user.username.find(usernameFilterEntry.get_text()) == std::string::npos)
-                continue;
-            allValidUsers.push_back({user.username, {&user, 0}});
-        }
-
-        size_t cnt = allValidUsers.size();
-
-        for (auto &user : serverAction.userAccounts) {
-            bool found = false;
-            for (size_t i = 0; i < cnt; i++) {
-                if (allValidUsers[i].first == user.username) {
-                    allValidUsers[i].second.second = user.balance;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                allValidUsers.push_back({user.username, {nullptr, user.balance}});
+        if (bulk)
+            attachModel();
+
+        // the versions are read before the online list, so an account that logs in or out in between is
+        // seen again on the next refresh instead of keeping a stale address
+        std::vector<std::pair<AccountHandle, int>> changed;
+        for (AccountHandle account = 0; account < accountCount; account++) {
+            uint64_t version;
+            int balance = serverAction.transfers.balance(account, version);
+            if (version != shownVersions[account]) {
+                shownVersions[account] = version;
+                changed.emplace_back(account, balance);
             }
         }
 
-        size_t prefilteredSize = allValidUsers.size();
-
-        std::vector<std::pair<std::string, std::pair<OnlineEntry *, int>>> filteredUsers = allValidUsers;
-
-        std::string filter = usernameFilterEntry.get_text();
-        // if (!filter.empty()) {
-        //     std::transform(filter.begin(), filter.end(), filter.begin(), ::tolower);
-        //     filteredUsers.erase(std::remove_if(filteredUsers.begin(), filteredUsers.end(), [filter](const UserAccount &user) {
-        //                             std::string username = user.username;
-        //                             std::transform(username.begin(), username.end(), username.begin(), ::tolower);
-        //                             return username.find(filter) == std::string::npos;
-        //                         }),
-        //                         filteredUsers.end());
-        // }
-
-        Pango::FontDescription tableHeaderFont;
-        tableHeaderFont.set_style(Pango::Style::STYLE_ITALIC);
-
-        Label *onlineUsersHeader = manage(new Label("Username  "));
-        onlineUsersGrid.attach(*onlineUsersHeader, 0, 0, 1, 1);
-        onlineUsersHeader->override_font(tableHeaderFont);
-        onlineUsersHeader->set_halign(Align::ALIGN_START);
-
-        Label *onlineIPHeader = manage(new Label("Transfer Address  "));
-        onlineUsersGrid.attach(*onlineIPHeader, 1, 0, 1, 1);
-        onlineIPHeader->override_font(tableHeaderFont);
-        onlineIPHeader->set_halign(Align::ALIGN_START);
-
-        Label *balanceHeader = manage(new Label("Balance  "));
-        onlineUsersGrid.attach(*balanceHeader, 2, 0, 1, 1);
-        balanceHeader->override_font(tableHeaderFont);
-        balanceHeader->set_halign(Align::ALIGN_START);
-
-        onlineIPHeader->set_hexpand(true);
-
-        Pango::FontDescription tableFont;
-        tableFont.set_family("monospace");
-        tableFont.set_size(12 * PANGO_SCALE);
-
-        for (auto &user : filteredUsers) {
-            Label *onlineUsersLabel = manage(new Label(user.first));
-            onlineUsersLabel->set_halign(Align::ALIGN_START);
-            onlineUsersLabel->override_font(tableFont);
-            if (!fetchOk)
-                onlineUsersLabel->get_style_context()->add_class("fetch_fail");
-            onlineUsersGrid.attach(*onlineUsersLabel, 0, (onlineUsersGrid.get_children().size() + 1) / 5, 1, 1);
-
-            std::string address = "N/A";
-
-            if (user.second.first != nullptr)
-                address = user.second.first->ipAddr + ":" + std::to_string(user.second.first->clientPort);
-
-            Label *ipLabel = manage(new Label(address));
-            ipLabel->set_halign(Align::ALIGN_START);
-            ipLabel->override_font(tableFont);
-            if (!fetchOk)
-                ipLabel->get_style_context()->add_class("fetch_fail");
-            onlineUsersGrid.attach(*ipLabel, 1, (onlineUsersGrid.get_children().size() + 1) / 5, 1, 1);
-
-            Label *balanceLabel = manage(new Label(std::to_string(user.second.second)));
-            balanceLabel->set_halign(Align::ALIGN_START);
-            balanceLabel->override_font(tableFont);
-            if (!fetchOk)
-                balanceLabel->get_style_context()->add_class("fetch_fail");
-            onlineUsersGrid.attach(*balanceLabel, 2, (onlineUsersGrid.get_children().size() + 1) / 5, 1, 1);
-
-            Button *onlineButton = manage(new Button(user.second.first == nullptr ? "Offline" : "Online"));
-            if (user.second.first == nullptr)
-                onlineButton->set_sensitive(false);
-            else
-                onlineButton->get_style_context()->add_class("success");
-            onlineButton->get_style_context()->add_class("wide-button");
-            onlineUsersGrid.attach(*onlineButton, 4, (onlineUsersGrid.get_children().size() + 1) / 5, 1, 1);
-
-            std::string secondary = "User is offline";
-            if (user.second.first != nullptr)
-                secondary = "IP: " + user.second.first->ipAddr + "\nPort: " + std::to_string(user.second.first->clientPort);
-
-            onlineButton->signal_clicked().connect([this, secondary]() {
-                MessageDialog dialog(*this, "User details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
-                dialog.set_secondary_text(secondary);
-                dialog.run();
-            });
-
-            Button *detailsButton = manage(new Button("Details"));
-            detailsButton->get_style_context()->add_class("wide-button");
-            onlineUsersGrid.attach(*detailsButton, 5, (onlineUsersGrid.get_children().size() + 1) / 5, 1, 1);
-
-            detailsButton->signal_clicked().connect([this, user]() {
-                MessageDialog dialog(*this, "User details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
-                dialog.set_secondary_text("IP: " + user.second.first->ipAddr + "\nPort: " + std::to_string(user.second.first->clientPort) + "\nPublic key: \n" + user.second.first->publicKey);
-                dialog.run();
-            });
+        std::unordered_map<AccountHandle, std::string> addresses;
+        size_t online = 0;
+        {
+            // the reactor threads modify the list while we read it
+            std::lock_guard<std::mutex> lock(serverAction.stateMutex);
+            for (const auto &user : serverAction.onlineUsers) {
+                if (user.account == NO_ACCOUNT)
+                    continue;
+                online++;
+                if (!changed.empty())
+                    addresses[user.account] = ipToString(user.ipAddr) + ":" + std::to_string(user.clientPort);
+            }
         }
 
-        if (filteredUsers.size() != prefilteredSize) {
-            Label *filteredLabel = manage(new Label("Some users are hidden by the filter"));
-            filteredLabel->override_font(tableHeaderFont);
-            filteredLabel->set_halign(Align::ALIGN_CENTER);
-            onlineUsersGrid.attach(*filteredLabel, 0, (onlineUsersGrid.get_children().size() + 1) / 5, 6, 1);
+        for (const auto &change : changed) {
+            TreeModel::Row &row = rows[change.first];
+            auto address = addresses.find(change.first);
+            bool isOnline = address != addresses.end();
+            if (row.get_value(columns.balance) != change.second)
+                row[columns.balance] = change.second;
+            if (row.get_value(columns.online) != isOnline) {
+                row[columns.online] = isOnline;
+                row[columns.status] = isOnline ? "Online" : "Offline";
+            }
+            std::string shownAddress = isOnline ? address->second : "N/A";
+            if (row.get_value(columns.address) != shownAddress)
+                row[columns.address] = shownAddress;
         }
 
-        // std::vector<OnlineEntry> filteredUsers;
-        // for (const auto &user : serverAction.onlineUsers) {
-        //     if (user.username.find(usernameFilterEntry.get_text()) != std::string::npos)
-        //         filteredUsers.push_back(user);
-        // }
-
-        onlineUsersLabel.set_text(std::to_string(cnt));
-        totalUsersLabel.set_text(std::to_string(serverAction.userAccounts.size()));
-
-        show_all_children();
+        onlineUsersLabel.set_text(std::to_string(online));
+        totalUsersLabel.set_text(std::to_string(accountCount));
+        updateHiddenByFilter();
     }
 
 private:
-    bool fetchOk = false;
+    struct UserColumns : public TreeModelColumnRecord {
+        TreeModelColumn<AccountHandle> account;
+        TreeModelColumn<std::string> username;
+        TreeModelColumn<std::string> address;
+        TreeModelColumn<int> balance;
+        TreeModelColumn<std::string> status;
+        TreeModelColumn<bool> online;
+
+        UserColumns() {
+            add(account);
+            add(username);
+            add(address);
+            add(balance);
+            add(status);
+            add(online);
+        }
+    };
+
+    UserColumns columns;
+    RefPtr<ListStore> userStore; // one row per account, in handle order
+    RefPtr<TreeModelFilter> filteredModel;
+    RefPtr<TreeModelSort> sortedModel; // what the view shows, online users first unless a header was clicked
+    // the row of every account and the account version it shows. list store rows stay valid while rows are
+    // added, so an account's row is found without searching
+    std::vector<TreeModel::Row> rows;
+    std::vector<uint64_t> shownVersions;
+    uint64_t shownChangeCount = UINT64_MAX;
+    std::string filterText;
+    int sortColumn = -1;
+    SortType sortOrder = SortType::SORT_DESCENDING;
 
     Box mainBox;
 
@@ -306,8 +289,57 @@ private:
 
     // bottom
     ScrolledWindow scrolledWindow;
-    Grid onlineUsersGrid;
+    TreeView onlineUsersView;
     Entry usernameFilterEntry;
+    Label hiddenByFilterLabel;
+
+    template <typename T>
+    void appendColumn(const std::string &title, const TreeModelColumn<T> &column, int width) {
+        TreeViewColumn *viewColumn = onlineUsersView.get_column(onlineUsersView.append_column(title, column) - 1);
+        viewColumn->set_sizing(TreeViewColumnSizing::TREE_VIEW_COLUMN_FIXED);
+        viewColumn->set_fixed_width(width);
+        viewColumn->set_resizable(true);
+        viewColumn->set_sort_column(column);
+    }
+
+    // filter and sort on top of the store. they follow every change to the store row by row
+    void attachModel() {
+        filteredModel = TreeModelFilter::create(userStore);
+        filteredModel->set_visible_func([this](const TreeModel::const_iterator &iter) {
+            return filterText.empty() || iter->get_value(columns.username).find(filterText) != std::string::npos;
+        });
+        sortedModel = TreeModelSort::create(filteredModel);
+        sortedModel->set_sort_column(sortColumn == -1 ? columns.online.index() : sortColumn, sortOrder);
+        onlineUsersView.set_model(sortedModel);
+    }
+
+    void detachModel() {
+        if (sortedModel && !sortedModel->get_sort_column_id(sortColumn, sortOrder))
+            sortColumn = -1;
+        onlineUsersView.unset_model();
+        sortedModel.reset();
+        filteredModel.reset();
+    }
+
+    void updateHiddenByFilter() {
+        hiddenByFilterLabel.set_visible(filteredModel->children().size() != userStore->children().size());
+    }
+
+    void showUserDetails(AccountHandle account) {
+        std::string secondary = "User is offline";
+        {
+            std::lock_guard<std::mutex> lock(serverAction.stateMutex);
+            for (const auto &user : serverAction.onlineUsers) {
+                if (user.account == account) {
+                    secondary = "IP: " + ipToString(user.ipAddr) + "\nPort: " + std::to_string(user.clientPort) + "\nPublic key: \n" + serverAction.keyStore.pem(user.key);
+                    break;
+                }
+            }
+        }
+        MessageDialog dialog(*this, "User details", false, MessageType::MESSAGE_INFO, ButtonsType::BUTTONS_OK, true);
+        dialog.set_secondary_text(secondary);
+        dialog.run();
+    }
 };
 
 #endif // SERVER_MAIN_WINDOW_H
\ No newline at end of file
@@ -0,0 +1,263 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "accountStore.h"
+#include "ledger.h"
+
+#define SNAPSHOT_FILE "accounts.snap"
+#define SNAPSHOT_MAGIC "P2PSNAP1"
+#define SNAPSHOT_TAIL_CHECK 256                // ledger bytes before the snapshot's offset that have to match on load
+#define SNAPSHOT_MIN_LEDGER_BYTES (16 << 20) // ledger growth worth writing a new snapshot for
+
+// the account table as of a byte offset in the ledger, so startup maps this file and only replays the ledger
+// written after it instead of parsing all of it. layout, in host byte order:
+//   SnapshotHeader
+//   SnapshotRecord[accountCount], by handle
+//   string heap of heapSize bytes, the usernames back to back
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t accountCount;
+    uint64_t heapSize;
+    uint64_t ledgerOffset;   // ledger bytes already in the snapshot, replay starts here
+    uint64_t ledgerTailHash; // of the SNAPSHOT_TAIL_CHECK ledger bytes before ledgerOffset, catches a replaced ledger
+    uint32_t hashCheck;      // AccountStore::hashName of SNAPSHOT_MAGIC, the stored hashes are only used if it matches
+    uint32_t reserved;
+};
+
+struct SnapshotRecord {
+    uint64_t nameOffset; // into the string heap
+    uint32_t nameLength;
+    int32_t balance;
+    uint32_t hash; // AccountStore::hashName of the username
+    uint32_t reserved;
+};
+
+// apply one ledger record to accounts. the funds check is not repeated: concurrent transfers may be logged
+// in a different order than they were applied, and the sums are the same anyway. false if it is not valid
+bool applyLedgerRecord(AccountStore &accounts, const std::vector<std::string> &record) {
+    try {
+        if (record.size() == 3 && record[0] == "REGISTER") {
+            accounts.insert(record[1], std::stoi(record[2]));
+            return true;
+        }
+        if (record.size() == 4 && record[0] == "TRANSFER") {
+            AccountHandle payer = accounts.find(record[1]);
+            AccountHandle payee = accounts.find(record[3]);
+            if (payer != NO_ACCOUNT && payee != NO_ACCOUNT) {
+                int amount = std::stoi(record[2]);
+                accounts.get(payer).balance -= amount;
+                accounts.get(payee).balance += amount;
+                return true;
+            }
+        }
+    } catch (const std::exception &e) {
+    }
+    return false;
+}
+
+class Snapshot {
+public:
+    std::string error_t;
+
+    // add the snapshot's accounts to accounts, which has to be empty. they are indexed on the first lookup.
+    // ledgerOffset gets where the ledger replay starts. nothing is added if the snapshot is damaged or was
+    // taken of another ledger
+    bool load(const std::string &path, AccountStore &accounts, const std::string &ledgerPath, uint64_t &ledgerOffset) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            error_t = "Failed to open snapshot " + path + "\n" + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+            error_t = "Snapshot " + path + " is too short";
+            ::close(fd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            error_t = "Failed to map snapshot " + path + "\n" + strerror(errno);
+            return false;
+        }
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        bool ok = loadMapped(static_cast<const char *>(mapped), st.st_size, accounts, ledgerPath, ledgerOffset);
+        munmap(mapped, st.st_size);
+        return ok;
+    }
+
+    // write accounts as of ledgerOffset to path. goes through a temporary file, so a crash leaves the old snapshot
+    bool write(const std::string &path, const AccountStore &accounts, const std::string &ledgerPath, uint64_t ledgerOffset) {
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.accountCount = accounts.size();
+        header.ledgerOffset = ledgerOffset;
+        if (!ledgerTailHash(ledgerPath, ledgerOffset, header.ledgerTailHash))
+            return false;
+        header.hashCheck = AccountStore::hashName(SNAPSHOT_MAGIC);
+
+        std::vector<SnapshotRecord> records(header.accountCount);
+        std::string heap;
+        for (AccountHandle handle = 0; handle < header.accountCount; handle++) {
+            const UserAccount &account = accounts.get(handle);
+            records[handle] = SnapshotRecord{heap.size(), (uint32_t)account.username.size(), account.balance,
+                                             AccountStore::hashName(account.username), 0};
+            heap += account.username;
+        }
+        header.heapSize = heap.size();
+
+        std::string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            error_t = "Failed to create snapshot " + temporary + "\n" + strerror(errno);
+            return false;
+        }
+        bool ok = writeAll(fd, &header, sizeof(header)) &&
+                  writeAll(fd, records.data(), records.size() * sizeof(SnapshotRecord)) &&
+                  writeAll(fd, heap.data(), heap.size()) && fdatasync(fd) == 0;
+        int writeErrno = errno;
+        ::close(fd);
+        if (!ok || rename(temporary.c_str(), path.c_str()) == -1) {
+            error_t = "Failed to write snapshot " + path + "\n" + strerror(ok ? errno : writeErrno);
+            std::remove(temporary.c_str());
+            return false;
+        }
+        syncDirectory(path);
+        return true;
+    }
+
+    // bring the snapshot at path up to ledgerOffset of the ledger. runs on its own copy of the accounts,
+    // built from the old snapshot and the ledger records after it, so the server is not paused, but it
+    // takes about as much memory as the server's own account table while it runs
+    bool compact(const std::string &path, const std::string &ledgerPath, uint64_t ledgerOffset, size_t *replayed = nullptr) {
+        AccountStore accounts;
+        uint64_t from = 0;
+        if (access(path.c_str(), F_OK) == 0 && !load(path, accounts, ledgerPath, from)) {
+            std::cerr << "\033[33m" << error_t << ", rebuilding it from the whole ledger\033[0m" << std::endl;
+            return compactFromScratch(path, ledgerPath, ledgerOffset, replayed);
+        }
+        if (from > ledgerOffset) {
+            error_t = "Snapshot is newer than the ledger offset to compact to";
+            return false;
+        }
+        Ledger::readRecords(ledgerPath, from, ledgerOffset, [&accounts](const std::vector<std::string> &record) {
+            applyLedgerRecord(accounts, record);
+        }, replayed);
+        return write(path, accounts, ledgerPath, ledgerOffset);
+    }
+
+private:
+    bool loadMapped(const char *data, size_t size, AccountStore &accounts, const std::string &ledgerPath, uint64_t &ledgerOffset) {
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            error_t = "Not a snapshot file";
+            return false;
+        }
+        if (header.accountCount > (size - sizeof(header)) / sizeof(SnapshotRecord) ||
+            sizeof(header) + header.accountCount * sizeof(SnapshotRecord) + header.heapSize != size) {
+            error_t = "Snapshot is truncated or corrupt";
+            return false;
+        }
+        uint64_t tailHash;
+        if (!ledgerTailHash(ledgerPath, header.ledgerOffset, tailHash))
+            return false;
+        if (tailHash != header.ledgerTailHash) {
+            error_t = "Snapshot does not belong to this ledger";
+            return false;
+        }
+        if (accounts.size() != 0) {
+            error_t = "Snapshot has to be loaded into an empty account table";
+            return false;
+        }
+
+        const SnapshotRecord *records = reinterpret_cast<const SnapshotRecord *>(data + sizeof(header));
+        const char *heap = data + sizeof(header) + header.accountCount * sizeof(SnapshotRecord);
+        // another build may hash differently, then the stored hashes are no use
+        bool hashesValid = header.hashCheck == AccountStore::hashName(SNAPSHOT_MAGIC);
+        for (uint64_t i = 0; i < header.accountCount; i++) {
+            if (records[i].nameOffset > header.heapSize || records[i].nameLength > header.heapSize - records[i].nameOffset) {
+                error_t = "Snapshot record " + std::to_string(i) + " is corrupt";
+                return false;
+            }
+        }
+        if (header.accountCount > (uint64_t)ACCOUNT_MAX_CHUNKS << ACCOUNT_CHUNK_BITS) {
+            error_t = "Snapshot has more accounts than the account table holds";
+            return false;
+        }
+        for (uint64_t i = 0; i < header.accountCount; i++) {
+            const SnapshotRecord &record = records[i];
+            std::string username(heap + record.nameOffset, record.nameLength);
+            uint32_t hash = hashesValid ? record.hash : AccountStore::hashName(username);
+            accounts.load(std::move(username), record.balance, hash);
+        }
+        ledgerOffset = header.ledgerOffset;
+        return true;
+    }
+
+    bool compactFromScratch(const std::string &path, const std::string &ledgerPath, uint64_t ledgerOffset, size_t *replayed) {
+        AccountStore accounts;
+        Ledger::readRecords(ledgerPath, 0, ledgerOffset, [&accounts](const std::vector<std::string> &record) {
+            applyLedgerRecord(accounts, record);
+        }, replayed);
+        return write(path, accounts, ledgerPath, ledgerOffset);
+    }
+
+    // FNV-1a of the bytes before offset. false if the ledger is shorter than offset
+    bool ledgerTailHash(const std::string &ledgerPath, uint64_t offset, uint64_t &hash) {
+        int fd = ::open(ledgerPath.c_str(), O_RDONLY | O_CLOEXEC);
+        uint64_t start = offset > SNAPSHOT_TAIL_CHECK ? offset - SNAPSHOT_TAIL_CHECK : 0;
+        char tail[SNAPSHOT_TAIL_CHECK];
+        ssize_t length = fd == -1 ? -1 : pread(fd, tail, offset - start, start);
+        if (fd != -1)
+            ::close(fd);
+        if (length != (ssize_t)(offset - start)) {
+            error_t = "Ledger " + ledgerPath + " is shorter than the snapshot";
+            return false;
+        }
+        hash = 14695981039346656037ull;
+        for (ssize_t i = 0; i < length; i++)
+            hash = (hash ^ (unsigned char)tail[i]) * 1099511628211ull;
+        return true;
+    }
+
+    static bool writeAll(int fd, const void *data, size_t size) {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd, bytes, size);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            bytes += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // make the rename itself durable
+    static void syncDirectory(const std::string &path) {
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,102 @@
+#ifndef TRANSFER_ENGINE_H
+#define TRANSFER_ENGINE_H
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include "accountStore.h"
+
+#define TRANSFER_STRIPES 64
+
+enum TransferResult {
+    TRANSFER_OK,
+    TRANSFER_INSUFFICIENT_FUNDS,
+    TRANSFER_INVALID_AMOUNT,
+};
+
+// moves money between accounts without a global lock. every account maps to one of a fixed set of
+// mutexes (lock striping), a transfer holds the stripes of both accounts, always taken in stripe order
+// so two transfers in opposite directions cannot deadlock. transfers on unrelated accounts run in parallel
+class TransferEngine {
+public:
+    TransferEngine(AccountStore &accounts, size_t stripeCount = TRANSFER_STRIPES) : accounts(accounts), stripes(stripeCount) {}
+
+    // check the payer can afford it and move the amount in one step
+    TransferResult transfer(AccountHandle payer, AccountHandle payee, int amount) {
+        if (amount <= 0)
+            return TRANSFER_INVALID_AMOUNT;
+        size_t first = payer % stripes.size(), second = payee % stripes.size();
+        if (first > second)
+            std::swap(first, second);
+        std::lock_guard<std::mutex> firstLock(stripes[first]);
+        std::unique_lock<std::mutex> secondLock(stripes[second], std::defer_lock);
+        if (second != first)
+            secondLock.lock();
+
+        UserAccount &from = accounts.get(payer);
+        if (from.balance < amount)
+            return TRANSFER_INSUFFICIENT_FUNDS;
+        from.balance -= amount;
+        from.version++;
+        UserAccount &to = accounts.get(payee);
+        to.balance += amount;
+        to.version++;
+        changes.fetch_add(1, std::memory_order_release);
+        return TRANSFER_OK;
+    }
+
+    // undo a transfer that could not be logged: move amount back from payee to payer, without a funds check.
+    // the ledger has failed by then and takes no more transfers, so the payee cannot have built on the money
+    // except in transfers that are undone the same way
+    void reverse(AccountHandle payer, AccountHandle payee, int amount) {
+        size_t first = payer % stripes.size(), second = payee % stripes.size();
+        if (first > second)
+            std::swap(first, second);
+        std::lock_guard<std::mutex> firstLock(stripes[first]);
+        std::unique_lock<std::mutex> secondLock(stripes[second], std::defer_lock);
+        if (second != first)
+            secondLock.lock();
+
+        UserAccount &from = accounts.get(payee);
+        from.balance -= amount;
+        from.version++;
+        UserAccount &to = accounts.get(payer);
+        to.balance += amount;
+        to.version++;
+        changes.fetch_add(1, std::memory_order_release);
+    }
+
+    // read a balance consistently with running transfers
+    int balance(AccountHandle account) {
+        std::lock_guard<std::mutex> lock(stripes[account % stripes.size()]);
+        return accounts.get(account).balance;
+    }
+
+    // balance and version read together, a viewer only redraws an account when the version moved
+    int balance(AccountHandle account, uint64_t &version) {
+        std::lock_guard<std::mutex> lock(stripes[account % stripes.size()]);
+        const UserAccount &user = accounts.get(account);
+        version = user.version;
+        return user.balance;
+    }
+
+    // mark an account changed for something other than its balance, like logging in or out
+    void touch(AccountHandle account) {
+        std::lock_guard<std::mutex> lock(stripes[account % stripes.size()]);
+        accounts.get(account).version++;
+        changes.fetch_add(1, std::memory_order_release);
+    }
+
+    // bumped with every account version, so a viewer can skip the scan when nothing changed at all
+    uint64_t changeCount() const {
+        return changes.load(std::memory_order_acquire);
+    }
+
+private:
+    AccountStore &accounts;
+    std::vector<std::mutex> stripes;
+    std::atomic<uint64_t> changes{0};
+};
+
+#endif // TRANSFER_ENGINE_H